@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "antireplay.h"
+#include "arg_error.h"
+
+static unsigned int windowSize = DEFAULT_REPLAY_WINDOW;
+static unsigned int slotMask = 2 * DEFAULT_REPLAY_WINDOW / REPLAY_SLOT_BITS - 1;
+
+void set_replay_window_size(unsigned int size)
+{
+	windowSize = size;
+	slotMask = 2 * size / REPLAY_SLOT_BITS - 1;
+}
+
+void replay_window_reset(struct replay_window *win)
+{
+	win->top = 0;
+	memset(win->slots, 0, sizeof(win->slots));
+	__sync_synchronize();
+}
+
+// Picks whichever 64-bit sequence number ending in seq is closest to top
+static uint64_t extend_seq(uint64_t top, uint32_t seq)
+{
+	uint64_t ext = (top & ~(uint64_t)UINT32_MAX) | seq;
+
+	if(ext > top + ((uint64_t)1 << 31) && ext > UINT32_MAX)
+		ext -= (uint64_t)1 << 32;
+	else if(ext + ((uint64_t)1 << 31) < top)
+		ext += (uint64_t)1 << 32;
+
+	return ext;
+}
+
+uint64_t replay_window_extend(const struct replay_window *win, uint32_t seq)
+{
+	return extend_seq(win->top, seq);
+}
+
+// Compares the block a slot holds with block, allowing for the tag wrapping
+static inline int32_t block_cmp(uint64_t slot, uint64_t block)
+{
+	return (int32_t)((uint32_t)(slot >> 32) - (uint32_t)block);
+}
+
+int replay_window_check(struct replay_window *win, uint32_t seq)
+{
+	uint64_t top = win->top;
+	uint64_t ext = extend_seq(top, seq);
+	uint64_t block = ext / REPLAY_SLOT_BITS;
+	uint64_t slot;
+
+	if(ext + windowSize <= top)
+	{
+		__sync_fetch_and_add(&win->windowDrops, 1);
+		return -ARG_SEQ_BAD;
+	}
+
+	// Newer than anything seen
+	if(ext > top)
+		return 0;
+
+	slot = win->slots[block & slotMask];
+	if(block_cmp(slot, block) > 0)
+	{
+		__sync_fetch_and_add(&win->windowDrops, 1);
+		return -ARG_SEQ_BAD;
+	}
+
+	if(block_cmp(slot, block) == 0 && (slot & ((uint64_t)1 << (ext % REPLAY_SLOT_BITS))))
+	{
+		__sync_fetch_and_add(&win->replays, 1);
+		return -ARG_SEQ_BAD;
+	}
+
+	return 0;
+}
+
+int replay_window_update(struct replay_window *win, uint32_t seq)
+{
+	uint64_t top = win->top;
+	uint64_t ext = extend_seq(top, seq);
+	uint64_t block = ext / REPLAY_SLOT_BITS;
+	uint64_t bit = (uint64_t)1 << (ext % REPLAY_SLOT_BITS);
+	uint64_t *slot = &win->slots[block & slotMask];
+	uint64_t old;
+	uint64_t new;
+
+	// Others may have moved the window on while this packet was authenticated
+	if(ext + windowSize <= top)
+	{
+		__sync_fetch_and_add(&win->windowDrops, 1);
+		return -ARG_SEQ_BAD;
+	}
+
+	do
+	{
+		old = *slot;
+
+		if(block_cmp(old, block) > 0)
+		{
+			__sync_fetch_and_add(&win->windowDrops, 1);
+			return -ARG_SEQ_BAD;
+		}
+
+		if(block_cmp(old, block) == 0)
+		{
+			if(old & bit)
+			{
+				__sync_fetch_and_add(&win->replays, 1);
+				return -ARG_SEQ_BAD;
+			}
+			new = old | bit;
+		}
+		else
+		{
+			// First in this block, whatever was here is now behind the window
+			new = ((block & UINT32_MAX) << 32) | bit;
+		}
+	} while(!__sync_bool_compare_and_swap(slot, old, new));
+
+	while(ext > top && !__sync_bool_compare_and_swap(&win->top, top, ext))
+		top = win->top;
+
+	return 0;
+}
+
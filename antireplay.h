@@ -0,0 +1,54 @@
+#ifndef ANTIREPLAY_H
+#define ANTIREPLAY_H
+
+#include <stdint.h>
+
+#include "settings.h"
+
+// Sequence numbers tracked by each word of the window
+#define REPLAY_SLOT_BITS 32
+
+// Words kept per window. Twice the most sequence numbers it can cover, so the
+// blocks of the window never share a word however it's aligned
+#define REPLAY_SLOTS (2 * MAX_REPLAY_WINDOW / REPLAY_SLOT_BITS)
+
+// IPsec-style sliding window (RFC 4303 3.4.3) over the sequence numbers seen
+// from one gate. Anything within the configured number of the newest seen is
+// accepted once, in any order, so packets passing each other between receive
+// threads aren't lost. Lock-free; any number of threads may check and update
+// the same window at once.
+//
+// Each slot holds (block << 32) | bits for the REPLAY_SLOT_BITS sequence
+// numbers of one block, with blocks mapped onto slots round-robin. A slot only
+// ever moves forward to newer blocks, so a sequence number whose block has been
+// pushed out of its slot is too old to tell, and dropped
+typedef struct replay_window {
+	// Newest sequence number accepted, extended to 64 bits so wrapping is seamless
+	uint64_t top;
+	uint64_t slots[REPLAY_SLOTS];
+
+	unsigned long windowDrops; // Fell behind the window, may have been authentic
+	unsigned long replays; // Already seen
+} replay_window;
+
+// Sets the number of sequence numbers behind the newest that windows accept,
+// a power of 2 between REPLAY_SLOT_BITS and MAX_REPLAY_WINDOW. Affects every window
+void set_replay_window_size(unsigned int size);
+
+// Forgets everything seen, as when a gate starts over with new connection data
+void replay_window_reset(struct replay_window *win);
+
+// Checks whether seq could be new, without recording it. Call before doing
+// the work of authenticating a packet. Returns 0 if so, -ARG_SEQ_BAD if not
+int replay_window_check(struct replay_window *win, uint32_t seq);
+
+// The 64-bit sequence number seq most likely stands for, going by the newest
+// seen. Lets senders fold the upper half into their nonces without sending it
+uint64_t replay_window_extend(const struct replay_window *win, uint32_t seq);
+
+// Records seq as seen, once its packet is known to be authentic. Returns
+// -ARG_SEQ_BAD if it was seen (or fell out of the window) in the meantime
+int replay_window_update(struct replay_window *win, uint32_t seq);
+
+#endif
+
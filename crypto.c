@@ -1,12 +1,669 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
+
+#include <polarssl/aes.h>
+#include <polarssl/sha2.h>
+
+#if defined(HAVE_OPENSSL_EVP_H) && defined(HAVE_LIBCRYPTO)
+#include <openssl/evp.h>
+#define HAVE_OPENSSL_PROVIDER
+#endif
 
 #include "crypto.h"
 #include "settings.h"
+#include "utility.h"
+#include "arg_error.h"
+
+// PolarSSL keeps its own AES key schedule, which CTR only reads, so threads
+// can share it. HMAC keeps the SHA-256 states
+// left after absorbing the padded key, so each packet starts from a copy of
+// them rather than hashing ipad and opad again
+typedef struct polarssl_key {
+	aes_context aes;
+	sha2_context hmacInner;
+	sha2_context hmacOuter;
+} polarssl_key;
+
+static int polarssl_set_key(struct sym_key *key, const uint8_t *keyData, size_t keyLen)
+{
+	struct polarssl_key *k = (struct polarssl_key*)key->ctx;
+	uint8_t ipad[HMAC_BLOCK_SIZE];
+	uint8_t opad[HMAC_BLOCK_SIZE];
+	int i = 0;
+
+	if(keyLen > HMAC_BLOCK_SIZE)
+		return -ARG_INTERNAL_ERROR;
+
+	if(k == NULL)
+	{
+		k = (struct polarssl_key*)calloc(1, sizeof(struct polarssl_key));
+		if(k == NULL)
+			return -ENOMEM;
+		key->ctx = k;
+	}
+
+	// CTR only ever runs the block cipher forward, even to decrypt
+	if(aes_setkey_enc(&k->aes, keyData, keyLen * 8) != 0)
+		return -ARG_INTERNAL_ERROR;
+
+	// Same as sha2_hmac_starts(), but keeping both halves (RFC 2104)
+	memset(ipad, 0x36, sizeof(ipad));
+	memset(opad, 0x5C, sizeof(opad));
+	for(i = 0; i < keyLen; i++)
+	{
+		ipad[i] ^= keyData[i];
+		opad[i] ^= keyData[i];
+	}
+
+	sha2_starts(&k->hmacInner, 0);
+	sha2_update(&k->hmacInner, ipad, sizeof(ipad));
+	sha2_starts(&k->hmacOuter, 0);
+	sha2_update(&k->hmacOuter, opad, sizeof(opad));
+
+	memset(ipad, 0, sizeof(ipad));
+	memset(opad, 0, sizeof(opad));
+
+	return 0;
+}
+
+static void polarssl_free_key(struct sym_key *key)
+{
+	free(key->ctx);
+	key->ctx = NULL;
+}
+
+static int polarssl_ctr(struct sym_key *key, const uint8_t *nonce, const uint8_t *in, size_t len, uint8_t *out)
+{
+	struct polarssl_key *k = (struct polarssl_key*)key->ctx;
+	uint8_t counter[AES_BLOCK_SIZE];
+	uint8_t stream[AES_BLOCK_SIZE];
+	size_t offset = 0;
+
+	memcpy(counter, nonce, sizeof(counter));
+	if(aes_crypt_ctr(&k->aes, len, &offset, counter, stream, in, out) != 0)
+		return -ARG_INTERNAL_ERROR;
+
+	return 0;
+}
+
+static int polarssl_hmac(struct sym_key *key, const struct iovec *iov, int iovCount, uint8_t *out)
+{
+	struct polarssl_key *k = (struct polarssl_key*)key->ctx;
+	sha2_context ctx;
+	uint8_t inner[SYM_HMAC_SIZE];
+	int i = 0;
+
+	ctx = k->hmacInner;
+	for(i = 0; i < iovCount; i++)
+		sha2_update(&ctx, iov[i].iov_base, iov[i].iov_len);
+	sha2_finish(&ctx, inner);
+
+	ctx = k->hmacOuter;
+	sha2_update(&ctx, inner, sizeof(inner));
+	sha2_finish(&ctx, out);
+
+	return 0;
+}
+
+static void polarssl_sha1(const struct iovec *iov, int iovCount, uint8_t *out)
+{
+	sha1_context ctx;
+	int i = 0;
+
+	sha1_starts(&ctx);
+	for(i = 0; i < iovCount; i++)
+		sha1_update(&ctx, iov[i].iov_base, iov[i].iov_len);
+	sha1_finish(&ctx, out);
+}
+
+// PolarSSL 1.1 has no GCM, so no AEAD
+static const struct crypto_provider polarsslProvider = {
+	"polarssl",
+	polarssl_set_key,
+	polarssl_free_key,
+	polarssl_ctr,
+	polarssl_hmac,
+	polarssl_sha1,
+	NULL,
+	NULL,
+};
+
+#ifdef HAVE_OPENSSL_PROVIDER
+// EVP picks up AES-NI and the SHA extensions by itself where the CPU has them.
+// The contexts here are only templates, left keyed and never used directly:
+// EVP contexts change on every call and keys are shared between threads.
+// Each thread works in its own copies (see get_thread_ctx())
+typedef struct openssl_key {
+	// Unique to each (re)keying, so threads can tell their copies are stale
+	uint64_t id;
+
+	// Where threads keep their copies. See get_key_slot()
+	int slot;
+
+	EVP_CIPHER_CTX *cipher;
+	EVP_CIPHER_CTX *aead;
+	EVP_PKEY *hmacKey;
+	EVP_MD_CTX *hmac;
+} openssl_key;
+
+// A thread's copy of one key's cipher contexts
+typedef struct openssl_thread_ctx {
+	uint64_t keyID;
+	EVP_CIPHER_CTX *cipher;
+	EVP_CIPHER_CTX *aead;
+} openssl_thread_ctx;
+
+// Everything one thread works in. Freed when the thread exits
+typedef struct openssl_thread_state {
+	// Copies of each key's contexts, indexed by the key's slot
+	struct openssl_thread_ctx *ctxs;
+	int ctxCount;
+
+	// Scratch for openssl_hmac() and openssl_sha1(), which start over every time
+	EVP_MD_CTX *hmac;
+	EVP_MD_CTX *sha1;
+} openssl_thread_state;
+
+// Initial size of each thread's context array, which grows with the number of keys
+#define OPENSSL_THREAD_KEYS 16
+
+static uint64_t nextKeyID = 1;
+
+// Key slots handed out so far, and the ones given back by freed keys
+static pthread_mutex_t slotLock = PTHREAD_MUTEX_INITIALIZER;
+static int slotCount = 0;
+static int *freeSlots = NULL;
+static int freeSlotCount = 0;
+
+static pthread_key_t threadStateKey;
+static pthread_once_t threadStateOnce = PTHREAD_ONCE_INIT;
+static __thread struct openssl_thread_state *threadState = NULL;
+
+// Gives a key a slot of its own, so no two live keys share a thread's copy.
+// Returns the slot or -ENOMEM
+static int get_key_slot(void)
+{
+	int slot = 0;
+	int *grown = NULL;
+
+	pthread_mutex_lock(&slotLock);
+
+	if(freeSlotCount > 0)
+		slot = freeSlots[--freeSlotCount];
+	else
+	{
+		// Room for every slot to be given back, so release_key_slot() can't fail
+		grown = (int*)realloc(freeSlots, (slotCount + 1) * sizeof(int));
+		if(grown == NULL)
+		{
+			pthread_mutex_unlock(&slotLock);
+			return -ENOMEM;
+		}
+
+		freeSlots = grown;
+		slot = slotCount++;
+	}
+
+	pthread_mutex_unlock(&slotLock);
+
+	return slot;
+}
+
+static void release_key_slot(int slot)
+{
+	pthread_mutex_lock(&slotLock);
+	freeSlots[freeSlotCount++] = slot;
+	pthread_mutex_unlock(&slotLock);
+}
+
+static void free_thread_state(void *data)
+{
+	struct openssl_thread_state *state = (struct openssl_thread_state*)data;
+	int i = 0;
+
+	for(i = 0; i < state->ctxCount; i++)
+	{
+		EVP_CIPHER_CTX_free(state->ctxs[i].cipher);
+		EVP_CIPHER_CTX_free(state->ctxs[i].aead);
+	}
+
+	EVP_MD_CTX_free(state->hmac);
+	EVP_MD_CTX_free(state->sha1);
+	free(state->ctxs);
+	free(state);
+}
+
+static void create_thread_state_key(void)
+{
+	pthread_key_create(&threadStateKey, free_thread_state);
+}
+
+// This thread's state, created on first use. NULL on failure
+static struct openssl_thread_state *get_thread_state(void)
+{
+	struct openssl_thread_state *state = threadState;
+
+	if(state != NULL)
+		return state;
+
+	pthread_once(&threadStateOnce, create_thread_state_key);
+
+	state = (struct openssl_thread_state*)calloc(1, sizeof(struct openssl_thread_state));
+	if(state == NULL)
+		return NULL;
+
+	state->hmac = EVP_MD_CTX_new();
+	state->sha1 = EVP_MD_CTX_new();
+	if(state->hmac == NULL || state->sha1 == NULL)
+	{
+		free_thread_state(state);
+		return NULL;
+	}
+
+	// Thread exit hands it to free_thread_state()
+	pthread_setspecific(threadStateKey, state);
+	threadState = state;
+
+	return state;
+}
+
+// This thread's contexts for k, copied from its templates if the slot was
+// last used for a different key (or an older keying of this one). NULL on failure
+static struct openssl_thread_ctx *get_thread_ctx(const struct openssl_key *k)
+{
+	struct openssl_thread_state *state = get_thread_state();
+	struct openssl_thread_ctx *grown = NULL;
+	struct openssl_thread_ctx *t = NULL;
+	int count = 0;
+
+	if(state == NULL)
+		return NULL;
+
+	if(k->slot >= state->ctxCount)
+	{
+		count = (state->ctxCount > 0 ? state->ctxCount * 2 : OPENSSL_THREAD_KEYS);
+		if(count <= k->slot)
+			count = k->slot + 1;
+
+		grown = (struct openssl_thread_ctx*)realloc(state->ctxs, count * sizeof(struct openssl_thread_ctx));
+		if(grown == NULL)
+			return NULL;
+
+		memset(grown + state->ctxCount, 0, (count - state->ctxCount) * sizeof(struct openssl_thread_ctx));
+		state->ctxs = grown;
+		state->ctxCount = count;
+	}
+
+	t = &state->ctxs[k->slot];
+	if(t->keyID == k->id)
+		return t;
+
+	if(t->cipher == NULL)
+	{
+		t->cipher = EVP_CIPHER_CTX_new();
+		t->aead = EVP_CIPHER_CTX_new();
+		if(t->cipher == NULL || t->aead == NULL)
+		{
+			EVP_CIPHER_CTX_free(t->cipher);
+			EVP_CIPHER_CTX_free(t->aead);
+			t->cipher = NULL;
+			t->aead = NULL;
+			return NULL;
+		}
+	}
+
+	t->keyID = 0;
+	if(EVP_CIPHER_CTX_copy(t->cipher, k->cipher) != 1 || EVP_CIPHER_CTX_copy(t->aead, k->aead) != 1)
+		return NULL;
+
+	t->keyID = k->id;
+	return t;
+}
+
+static void openssl_free_key(struct sym_key *key)
+{
+	struct openssl_key *k = (struct openssl_key*)key->ctx;
+
+	if(k == NULL)
+		return;
+
+	if(k->cipher != NULL)
+		EVP_CIPHER_CTX_free(k->cipher);
+	if(k->aead != NULL)
+		EVP_CIPHER_CTX_free(k->aead);
+	if(k->hmacKey != NULL)
+		EVP_PKEY_free(k->hmacKey);
+	if(k->hmac != NULL)
+		EVP_MD_CTX_free(k->hmac);
+	if(k->slot >= 0)
+		release_key_slot(k->slot);
+
+	free(k);
+	key->ctx = NULL;
+}
+
+static int openssl_set_key(struct sym_key *key, const uint8_t *keyData, size_t keyLen)
+{
+	struct openssl_key *k = (struct openssl_key*)key->ctx;
+
+	if(keyLen != AES_KEY_SIZE)
+		return -ARG_INTERNAL_ERROR;
+
+	if(k == NULL)
+	{
+		k = (struct openssl_key*)calloc(1, sizeof(struct openssl_key));
+		if(k == NULL)
+			return -ENOMEM;
+		key->ctx = k;
+
+		k->slot = get_key_slot();
+		k->cipher = EVP_CIPHER_CTX_new();
+		k->aead = EVP_CIPHER_CTX_new();
+		k->hmac = EVP_MD_CTX_new();
+		if(k->slot < 0 || k->cipher == NULL || k->aead == NULL || k->hmac == NULL)
+		{
+			openssl_free_key(key);
+			return -ENOMEM;
+		}
+	}
+
+	// IV (and for GCM, direction) is given per packet
+	k->id = __sync_fetch_and_add(&nextKeyID, 1);
+	if(EVP_EncryptInit_ex(k->cipher, EVP_aes_256_ctr(), NULL, keyData, NULL) != 1
+		|| EVP_EncryptInit_ex(k->aead, EVP_aes_256_gcm(), NULL, keyData, NULL) != 1)
+	{
+		return -ARG_INTERNAL_ERROR;
+	}
+
+	if(k->hmacKey != NULL)
+		EVP_PKEY_free(k->hmacKey);
+	k->hmacKey = EVP_PKEY_new_mac_key(EVP_PKEY_HMAC, NULL, keyData, keyLen);
+	if(k->hmacKey == NULL)
+		return -ARG_INTERNAL_ERROR;
+
+	if(EVP_MD_CTX_reset(k->hmac) != 1
+		|| EVP_DigestSignInit(k->hmac, NULL, EVP_sha256(), NULL, k->hmacKey) != 1)
+	{
+		return -ARG_INTERNAL_ERROR;
+	}
+
+	return 0;
+}
+
+static int openssl_ctr(struct sym_key *key, const uint8_t *nonce, const uint8_t *in, size_t len, uint8_t *out)
+{
+	struct openssl_thread_ctx *t = get_thread_ctx((struct openssl_key*)key->ctx);
+	int outLen = 0;
+
+	if(t == NULL)
+		return -ARG_INTERNAL_ERROR;
+
+	if(EVP_EncryptInit_ex(t->cipher, NULL, NULL, NULL, nonce) != 1)
+		return -ARG_INTERNAL_ERROR;
+
+	if(EVP_EncryptUpdate(t->cipher, out, &outLen, in, len) != 1)
+		return -ARG_INTERNAL_ERROR;
+
+	return 0;
+}
+
+static int openssl_hmac(struct sym_key *key, const struct iovec *iov, int iovCount, uint8_t *out)
+{
+	struct openssl_key *k = (struct openssl_key*)key->ctx;
+	struct openssl_thread_state *state = get_thread_state();
+	size_t outLen = SYM_HMAC_SIZE;
+	int i = 0;
+
+	if(state == NULL)
+		return -ENOMEM;
+
+	if(EVP_MD_CTX_copy_ex(state->hmac, k->hmac) != 1)
+		return -ARG_INTERNAL_ERROR;
+
+	for(i = 0; i < iovCount; i++)
+	{
+		if(EVP_DigestSignUpdate(state->hmac, iov[i].iov_base, iov[i].iov_len) != 1)
+			return -ARG_INTERNAL_ERROR;
+	}
+
+	if(EVP_DigestSignFinal(state->hmac, out, &outLen) != 1)
+		return -ARG_INTERNAL_ERROR;
+
+	return 0;
+}
+
+static void openssl_sha1(const struct iovec *iov, int iovCount, uint8_t *out)
+{
+	struct openssl_thread_state *state = get_thread_state();
+	int i = 0;
+
+	if(state == NULL)
+		return;
+
+	EVP_DigestInit_ex(state->sha1, EVP_sha1(), NULL);
+	for(i = 0; i < iovCount; i++)
+		EVP_DigestUpdate(state->sha1, iov[i].iov_base, iov[i].iov_len);
+	EVP_DigestFinal_ex(state->sha1, out, NULL);
+}
+
+static int openssl_aead_seal(struct sym_key *key, const uint8_t *nonce, const uint8_t *aad, size_t aadLen,
+							 const uint8_t *in, size_t len, uint8_t *out, uint8_t *tag)
+{
+	struct openssl_thread_ctx *t = get_thread_ctx((struct openssl_key*)key->ctx);
+	int outLen = 0;
+
+	if(t == NULL
+		|| EVP_CipherInit_ex(t->aead, NULL, NULL, NULL, nonce, 1) != 1
+		|| EVP_CipherUpdate(t->aead, NULL, &outLen, aad, aadLen) != 1
+		|| EVP_CipherUpdate(t->aead, out, &outLen, in, len) != 1
+		|| EVP_CipherFinal_ex(t->aead, out + outLen, &outLen) != 1
+		|| EVP_CIPHER_CTX_ctrl(t->aead, EVP_CTRL_GCM_GET_TAG, SYM_AEAD_TAG_SIZE, tag) != 1)
+	{
+		return -ARG_INTERNAL_ERROR;
+	}
+
+	return 0;
+}
+
+static int openssl_aead_open(struct sym_key *key, const uint8_t *nonce, const uint8_t *aad, size_t aadLen,
+							 const uint8_t *in, size_t len, uint8_t *out, const uint8_t *tag)
+{
+	struct openssl_thread_ctx *t = get_thread_ctx((struct openssl_key*)key->ctx);
+	int outLen = 0;
+
+	if(t == NULL
+		|| EVP_CipherInit_ex(t->aead, NULL, NULL, NULL, nonce, 0) != 1
+		|| EVP_CipherUpdate(t->aead, NULL, &outLen, aad, aadLen) != 1
+		|| EVP_CipherUpdate(t->aead, out, &outLen, in, len) != 1
+		|| EVP_CIPHER_CTX_ctrl(t->aead, EVP_CTRL_GCM_SET_TAG, SYM_AEAD_TAG_SIZE, (void*)tag) != 1)
+	{
+		return -ARG_INTERNAL_ERROR;
+	}
+
+	// Tag is checked here
+	if(EVP_CipherFinal_ex(t->aead, out + outLen, &outLen) != 1)
+		return -ARG_SIG_CHECK_FAILED;
+
+	return 0;
+}
+
+static const struct crypto_provider opensslProvider = {
+	"openssl",
+	openssl_set_key,
+	openssl_free_key,
+	openssl_ctr,
+	openssl_hmac,
+	openssl_sha1,
+	openssl_aead_seal,
+	openssl_aead_open,
+};
+#endif
+
+static const struct crypto_provider *currProvider = &polarsslProvider;
+
+// Output of provider over data under a fixed key, so providers can be compared
+static int crypto_fingerprint(const struct crypto_provider *provider, const uint8_t *keyData,
+							  const uint8_t *data, size_t len, uint8_t *out)
+{
+	int ret = 0;
+	struct sym_key key = {provider, NULL};
+	uint8_t *enc = out + SYM_HMAC_SIZE + SHA1_HASH_SIZE;
+	struct iovec iov[2] = {{(void*)data, len / 2}, {(void*)(data + len / 2), len - len / 2}};
+
+	if((ret = provider->set_key(&key, keyData, AES_KEY_SIZE)) == 0
+		&& (ret = provider->ctr(&key, data, data, len, enc)) == 0)
+	{
+		ret = provider->hmac(&key, iov, 2, out);
+	}
+	provider->sha1(iov, 2, out + SYM_HMAC_SIZE);
+
+	provider->free_key(&key);
+	return ret;
+}
+
+int init_crypto(int provider)
+{
+	const struct crypto_provider *providers[] = {
+		&polarsslProvider,
+		#ifdef HAVE_OPENSSL_PROVIDER
+		&opensslProvider,
+		#endif
+	};
+	int count = sizeof(providers) / sizeof(providers[0]);
+	int i = 0;
+	uint8_t keyData[AES_KEY_SIZE];
+	uint8_t buf[CRYPTO_CHECK_SIZE];
+	uint8_t expected[SYM_HMAC_SIZE + SHA1_HASH_SIZE + CRYPTO_CHECK_SIZE];
+	uint8_t result[SYM_HMAC_SIZE + SHA1_HASH_SIZE + CRYPTO_CHECK_SIZE];
+
+	if(provider == CRYPTO_POLARSSL)
+	{
+		currProvider = &polarsslProvider;
+		arglog(LOG_DEBUG, "Using %s crypto\n", currProvider->name);
+		return 0;
+	}
+
+	if(provider == CRYPTO_OPENSSL)
+	{
+		#ifdef HAVE_OPENSSL_PROVIDER
+		currProvider = &opensslProvider;
+		arglog(LOG_DEBUG, "Using %s crypto\n", currProvider->name);
+		return 0;
+		#else
+		arglog(LOG_FATAL, "Not built with OpenSSL, unable to use it for crypto\n");
+		return -ARG_CONFIG_BAD;
+		#endif
+	}
+
+	// Last one listed (OpenSSL, if built in) wins, so every start of the same
+	// build picks the same one. Anything that disagrees with PolarSSL (which
+	// gates have always used) would be unable to talk to other gates.
+	// Timings are in tests/crypto_bench
+	get_random_bytes(keyData, sizeof(keyData));
+	get_random_bytes(buf, sizeof(buf));
+	crypto_fingerprint(&polarsslProvider, keyData, buf, sizeof(buf), expected);
+
+	for(i = 0; i < count; i++)
+	{
+		if(crypto_fingerprint(providers[i], keyData, buf, sizeof(buf), result) != 0
+			|| memcmp(expected, result, sizeof(result)) != 0)
+		{
+			arglog(LOG_ALERT, "%s crypto disagrees with polarssl, not using\n", providers[i]->name);
+			continue;
+		}
+
+		currProvider = providers[i];
+	}
+
+	arglog(LOG_DEBUG, "Using %s crypto\n", currProvider->name);
+	return 0;
+}
+
+int sym_key_set(struct sym_key *key, const uint8_t *keyData, size_t keyLen)
+{
+	if(key->provider != currProvider)
+		sym_key_free(key);
+
+	key->provider = currProvider;
+	return key->provider->set_key(key, keyData, keyLen);
+}
+
+void sym_key_free(struct sym_key *key)
+{
+	if(key->provider != NULL && key->ctx != NULL)
+		key->provider->free_key(key);
+
+	key->provider = NULL;
+	key->ctx = NULL;
+}
+
+int sym_ctr(struct sym_key *key, const uint8_t *nonce, const uint8_t *in, size_t len, uint8_t *out)
+{
+	if(key->ctx == NULL)
+		return -ARG_INTERNAL_ERROR;
+
+	return key->provider->ctr(key, nonce, in, len, out);
+}
+
+int sym_hmac(struct sym_key *key, const uint8_t *data, size_t len, uint8_t *out)
+{
+	struct iovec iov = {(void*)data, len};
+
+	return sym_hmac_iov(key, &iov, 1, out);
+}
+
+int sym_hmac_iov(struct sym_key *key, const struct iovec *iov, int iovCount, uint8_t *out)
+{
+	if(key->ctx == NULL)
+		return -ARG_INTERNAL_ERROR;
+
+	return key->provider->hmac(key, iov, iovCount, out);
+}
+
+void crypto_sha1(const uint8_t *data, size_t len, uint8_t *out)
+{
+	struct iovec iov = {(void*)data, len};
+
+	currProvider->sha1(&iov, 1, out);
+}
+
+void crypto_sha1_iov(const struct iovec *iov, int iovCount, uint8_t *out)
+{
+	currProvider->sha1(iov, iovCount, out);
+}
+
+bool crypto_has_aead(void)
+{
+	return currProvider->aead_seal != NULL;
+}
+
+int sym_aead_seal(struct sym_key *key, const uint8_t *nonce, const uint8_t *aad, size_t aadLen,
+				  const uint8_t *in, size_t len, uint8_t *out, uint8_t *tag)
+{
+	if(key->ctx == NULL || key->provider->aead_seal == NULL)
+		return -ARG_INTERNAL_ERROR;
+
+	return key->provider->aead_seal(key, nonce, aad, aadLen, in, len, out, tag);
+}
+
+int sym_aead_open(struct sym_key *key, const uint8_t *nonce, const uint8_t *aad, size_t aadLen,
+				  const uint8_t *in, size_t len, uint8_t *out, const uint8_t *tag)
+{
+	if(key->ctx == NULL || key->provider->aead_open == NULL)
+		return -ARG_INTERNAL_ERROR;
+
+	return key->provider->aead_open(key, nonce, aad, aadLen, in, len, out, tag);
+}
 
 uint32_t hotp(const uint8_t *key, unsigned int klen, unsigned long count)
 {
@@ -2,6 +2,10 @@
 #define HMAC_H
 
 #include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include <sys/uio.h>
 
 #include "polarssl/config.h"	
 #include "polarssl/rsa.h"
@@ -10,6 +14,85 @@
 #define HMAC_SIZE 20
 #define HMAC_BLOCK_SIZE 64
 
+// Output of sym_hmac() (HMAC-SHA256)
+#define SYM_HMAC_SIZE 32
+
+// AEAD (AES-256-GCM) nonce and tag sizes
+#define SYM_AEAD_NONCE_SIZE 12
+#define SYM_AEAD_TAG_SIZE 16
+
+// Bytes run through each provider when checking they agree
+#define CRYPTO_CHECK_SIZE 1500
+
+struct crypto_provider;
+
+// A gate's symmetric key, as prepared by whichever provider was active when
+// it was set. Zero it before first use
+typedef struct sym_key {
+	const struct crypto_provider *provider;
+	void *ctx;
+} sym_key;
+
+// Library that does the per-packet work: AES-256-CTR, HMAC-SHA256, and the
+// SHA1 digests RSA signs. Every provider produces identical output, so gates
+// don't need to agree on one. RSA itself stays with PolarSSL, which holds the keys.
+// Once set, a key may be used by several threads at once; setting or freeing
+// it must not overlap any use
+typedef struct crypto_provider {
+	const char *name;
+
+	int (*set_key)(struct sym_key *key, const uint8_t *keyData, size_t keyLen);
+	void (*free_key)(struct sym_key *key);
+
+	// Whole payload in one call. nonce is the initial counter block
+	int (*ctr)(struct sym_key *key, const uint8_t *nonce, const uint8_t *in, size_t len, uint8_t *out);
+
+	// Digests of the iovCount segments in iov, taken as one message
+	int (*hmac)(struct sym_key *key, const struct iovec *iov, int iovCount, uint8_t *out);
+	void (*sha1)(const struct iovec *iov, int iovCount, uint8_t *out);
+
+	// AES-256-GCM, encrypting and authenticating in one pass. NULL if the
+	// provider has no AEAD. Open fails if the tag doesn't match
+	int (*aead_seal)(struct sym_key *key, const uint8_t *nonce, const uint8_t *aad, size_t aadLen,
+					 const uint8_t *in, size_t len, uint8_t *out, uint8_t *tag);
+	int (*aead_open)(struct sym_key *key, const uint8_t *nonce, const uint8_t *aad, size_t aadLen,
+					 const uint8_t *in, size_t len, uint8_t *out, const uint8_t *tag);
+} crypto_provider;
+
+// Picks the provider (see CRYPTO_* in settings.h). With CRYPTO_AUTO it's
+// OpenSSL if built in and its output matches PolarSSL's, otherwise PolarSSL.
+// Must be called before any keys are set
+int init_crypto(int provider);
+
+// (Re)keys key with the current provider
+int sym_key_set(struct sym_key *key, const uint8_t *keyData, size_t keyLen);
+void sym_key_free(struct sym_key *key);
+
+// AES-256-CTR over len bytes starting from the counter block nonce. in and
+// out may be the same
+int sym_ctr(struct sym_key *key, const uint8_t *nonce, const uint8_t *in, size_t len, uint8_t *out);
+
+// HMAC-SHA256 of data, SYM_HMAC_SIZE bytes written to out
+int sym_hmac(struct sym_key *key, const uint8_t *data, size_t len, uint8_t *out);
+
+// Same, over several segments as if they were one buffer
+int sym_hmac_iov(struct sym_key *key, const struct iovec *iov, int iovCount, uint8_t *out);
+
+// SHA1 digest, SHA1_HASH_SIZE bytes written to out
+void crypto_sha1(const uint8_t *data, size_t len, uint8_t *out);
+void crypto_sha1_iov(const struct iovec *iov, int iovCount, uint8_t *out);
+
+// True if the current provider can do AEAD
+bool crypto_has_aead(void);
+
+// AES-256-GCM over len bytes of in, with aad authenticated but not encrypted.
+// in and out may be the same. Seal writes SYM_AEAD_TAG_SIZE bytes to tag,
+// open returns -ARG_SIG_CHECK_FAILED if tag doesn't match (out is garbage then)
+int sym_aead_seal(struct sym_key *key, const uint8_t *nonce, const uint8_t *aad, size_t aadLen,
+				  const uint8_t *in, size_t len, uint8_t *out, uint8_t *tag);
+int sym_aead_open(struct sym_key *key, const uint8_t *nonce, const uint8_t *aad, size_t aadLen,
+				  const uint8_t *in, size_t len, uint8_t *out, const uint8_t *tag);
+
 // Generates a Hash-based One-Time Password value. See RFC4226
 uint32_t hotp(const uint8_t *key, unsigned int klen, unsigned long count);
 
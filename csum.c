@@ -0,0 +1,212 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CSUM_X86
+#endif
+
+#include "csum.h"
+#include "utility.h"
+
+static uint32_t csum_generic(const void *data, unsigned long len, uint32_t sum);
+
+static csum_func csumImpl = csum_generic;
+
+// Folds a 64-bit accumulator down to a 32-bit partial sum
+static inline uint32_t fold64(uint64_t sum)
+{
+	sum = (sum >> 32) + (sum & 0xFFFFFFFF);
+	sum = (sum >> 32) + (sum & 0xFFFFFFFF);
+	return (uint32_t)sum;
+}
+
+uint32_t csum_reference(const void *data, unsigned long len, uint32_t sum)
+{
+	const uint8_t *curr = (const uint8_t*)data;
+	uint64_t total = sum;
+	uint16_t word = 0;
+
+	while(len > 1)
+	{
+		memcpy(&word, curr, 2);
+		total += word;
+		curr += 2;
+		len -= 2;
+	}
+
+	// Last byte is the high half of a word in network order
+	if(len == 1)
+	{
+		word = 0;
+		memcpy(&word, curr, 1);
+		total += word;
+	}
+
+	return fold64(total);
+}
+
+// 32 bits at a time into a 64-bit accumulator, which can't overflow
+// for anything we'd ever checksum
+static uint32_t csum_generic(const void *data, unsigned long len, uint32_t sum)
+{
+	const uint8_t *curr = (const uint8_t*)data;
+	uint64_t total = sum;
+	uint64_t word = 0;
+
+	while(len >= 8)
+	{
+		memcpy(&word, curr, 8);
+		total += (uint32_t)word;
+		total += word >> 32;
+		curr += 8;
+		len -= 8;
+	}
+
+	return csum_reference(curr, len, fold64(total));
+}
+
+#ifdef CSUM_X86
+// 16 bytes at a time. Each 32-bit lane is widened into a 64-bit accumulator
+__attribute__((target("sse2")))
+static uint32_t csum_sse2(const void *data, unsigned long len, uint32_t sum)
+{
+	const uint8_t *curr = (const uint8_t*)data;
+	__m128i zero = _mm_setzero_si128();
+	__m128i acc = zero;
+	__m128i v;
+	uint64_t lanes[2];
+
+	while(len >= 16)
+	{
+		v = _mm_loadu_si128((const __m128i*)curr);
+		acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(v, zero));
+		acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(v, zero));
+		curr += 16;
+		len -= 16;
+	}
+
+	_mm_storeu_si128((__m128i*)lanes, acc);
+	sum = fold64((uint64_t)sum + fold64(lanes[0]) + fold64(lanes[1]));
+
+	return csum_generic(curr, len, sum);
+}
+
+// 32 bytes at a time, same as csum_sse2()
+__attribute__((target("avx2")))
+static uint32_t csum_avx2(const void *data, unsigned long len, uint32_t sum)
+{
+	const uint8_t *curr = (const uint8_t*)data;
+	__m256i zero = _mm256_setzero_si256();
+	__m256i acc = zero;
+	__m256i v;
+	uint64_t lanes[4];
+	uint64_t total = sum;
+	int i = 0;
+
+	while(len >= 32)
+	{
+		v = _mm256_loadu_si256((const __m256i*)curr);
+		acc = _mm256_add_epi64(acc, _mm256_unpacklo_epi32(v, zero));
+		acc = _mm256_add_epi64(acc, _mm256_unpackhi_epi32(v, zero));
+		curr += 32;
+		len -= 32;
+	}
+
+	_mm256_storeu_si256((__m256i*)lanes, acc);
+	for(i = 0; i < 4; i++)
+		total += fold64(lanes[i]);
+
+	return csum_generic(curr, len, fold64(total));
+}
+#endif
+
+// Compares func against the reference on random lengths and alignments of buf
+static int csum_check(csum_func func, const uint8_t *buf, unsigned long bufLen)
+{
+	int i = 0;
+	unsigned long offset = 0;
+	unsigned long len = 0;
+	uint32_t start = 0;
+
+	for(i = 0; i < CSUM_CHECK_ROUNDS; i++)
+	{
+		offset = rand() % 64;
+		len = rand() % (bufLen - offset);
+		start = rand() & 0xFFFF;
+
+		if(csum_fold(func(buf + offset, len, start))
+			!= csum_fold(csum_reference(buf + offset, len, start)))
+		{
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int csum_get_impls(struct csum_impl *impls, int max)
+{
+	int count = 0;
+
+	#ifdef CSUM_X86
+	__builtin_cpu_init();
+	if(count < max && __builtin_cpu_supports("avx2"))
+	{
+		impls[count].name = "avx2";
+		impls[count++].func = csum_avx2;
+	}
+	if(count < max && __builtin_cpu_supports("sse2"))
+	{
+		impls[count].name = "sse2";
+		impls[count++].func = csum_sse2;
+	}
+	#endif
+
+	if(count < max)
+	{
+		impls[count].name = "generic";
+		impls[count++].func = csum_generic;
+	}
+
+	return count;
+}
+
+void init_csum(void)
+{
+	uint8_t buf[CSUM_CHECK_SIZE];
+	struct csum_impl impls[CSUM_MAX_IMPLS];
+	int count = 0;
+	int i = 0;
+
+	for(i = 0; i < sizeof(buf); i++)
+		buf[i] = rand();
+
+	// Fastest one that agrees with the reference wins. Thorough checks and
+	// timings are in test/csum_test and test/csum_bench
+	count = csum_get_impls(impls, CSUM_MAX_IMPLS);
+	for(i = 0; i < count - 1; i++)
+	{
+		if(!csum_check(impls[i].func, buf, sizeof(buf)))
+			break;
+
+		arglog(LOG_ALERT, "%s checksum disagrees with reference, not using\n", impls[i].name);
+	}
+
+	csumImpl = impls[i].func;
+	arglog(LOG_DEBUG, "Using %s checksum\n", impls[i].name);
+}
+
+uint32_t csum_partial(const void *data, unsigned long len, uint32_t sum)
+{
+	return csumImpl(data, len, sum);
+}
+
+uint16_t csum_fold(uint32_t sum)
+{
+	sum = (sum >> 16) + (sum & 0xFFFF);
+	sum = (sum >> 16) + (sum & 0xFFFF);
+	return ~sum;
+}
+
@@ -0,0 +1,42 @@
+#ifndef CSUM_H
+#define CSUM_H
+
+#include <stdint.h>
+
+// Bytes and rounds of the quick check each implementation gets at startup
+#define CSUM_CHECK_SIZE 2048
+#define CSUM_CHECK_ROUNDS 64
+
+// Most implementations csum_get_impls() can return
+#define CSUM_MAX_IMPLS 4
+
+typedef uint32_t (*csum_func)(const void *data, unsigned long len, uint32_t sum);
+
+// One checksum implementation, for the tests and benchmarks under test/
+typedef struct csum_impl {
+	const char *name;
+	csum_func func;
+} csum_impl;
+
+// Picks the fastest checksum implementation the CPU supports, after a quick
+// check against csum_reference() on random lengths and alignments. Anything
+// that disagrees is skipped. Until this is called the portable version is
+// used, so it is always safe to checksum
+void init_csum(void);
+
+// Fills impls with up to max implementations the CPU supports, fastest
+// first. The last is always the portable one. Returns how many
+int csum_get_impls(struct csum_impl *impls, int max);
+
+// One 16-bit word at a time. What the others are checked against
+uint32_t csum_reference(const void *data, unsigned long len, uint32_t sum);
+
+// Adds len bytes at data to the running one's complement sum. Words are taken
+// as they sit in memory, so the sum (and the folded result) is in network order
+uint32_t csum_partial(const void *data, unsigned long len, uint32_t sum);
+
+// Folds a running sum to 16 bits and complements it, ready to store in a header
+uint16_t csum_fold(uint32_t sum);
+
+#endif
+
@@ -1,7 +1,16 @@
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <stdarg.h>
+#include <sched.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <linux/if_packet.h>
 
 #include "director.h"
 #include "settings.h"
@@ -19,18 +28,21 @@ bool receiveShouldRun = false;
 pthread_mutex_t cancelLock;
 bool cancelSent = false;
 
-static struct receive_thread_data intData = {
-	.pd = NULL,
-	.dev = "",
-	.ifaceSide = IFACE_INTERNAL,
-	.handler = direct_outbound,
-};
-static struct receive_thread_data extData = {
-	.pd = NULL,
-	.dev = "",
-	.ifaceSide = IFACE_EXTERNAL,
-	.handler = direct_inbound,
-};
+// Becomes readable when the receive threads should stop
+static int stopFd = -1;
+
+// Keeps the external filters in step with our IP
+static pthread_t filterThread = 0;
+
+// One set of workers per interface
+static struct receive_thread_data intData[MAX_WORKERS];
+static struct receive_thread_data extData[MAX_WORKERS];
+static int workerCount = 0;
+
+// AF_XDP state shared by both sides
+static struct xsk_umem umem = { .area = NULL, .fd = -1 };
+static struct xsk_device intXdp = { .progFd = -1, .mapFd = -1, .linkFd = -1 };
+static struct xsk_device extXdp = { .progFd = -1, .mapFd = -1, .linkFd = -1 };
 
 void init_director_locks(void)
 {
@@ -40,26 +52,105 @@ void init_director_locks(void)
 int init_director(struct config_data *config)
 {
 	int ret;
+	int i = 0;
 	char baseIP[INET_ADDRSTRLEN];
 	char mask[INET_ADDRSTRLEN];
 
 	arglog(LOG_DEBUG, "Director init\n");
 
-	// Initialize data and start pcap stuff
-	strncpy(intData.dev, config->intDev, sizeof(intData.dev) - 1);
-	strncpy(extData.dev, config->extDev, sizeof(extData.dev) - 1);
+	if((stopFd = eventfd(0, EFD_NONBLOCK)) < 0)
+	{
+		arglog(LOG_FATAL, "Unable to create shutdown event: %s\n", strerror(errno));
+		return -errno;
+	}
+
+	// Initialize data and start capture
+	workerCount = config->workers;
+	for(i = 0; i < workerCount; i++)
+	{
+		init_thread_data(&intData[i], config->intDev, IFACE_INTERNAL, i, config);
+		init_thread_data(&extData[i], config->extDev, IFACE_EXTERNAL, i, config);
+	}
 
-	arglog(LOG_ALERT, "Internal device is %s, external is %s\n", intData.dev, extData.dev);
+	arglog(LOG_ALERT, "Internal device is %s, external is %s, %i worker(s) each\n",
+		config->intDev, config->extDev, workerCount);
 
-	if((ret = init_pcap_driver(&intData.pd, intData.dev, 1)) < 0)
+	// TUN replaces the internal device entirely, XDP needs both
+	if(config->internalMode == INTERNAL_TUN && config->captureMode == CAPTURE_XDP)
 	{
-		arglog(LOG_FATAL, "Unable to initialize the internal device %s\n", intData.dev);
-		return ret;
+		arglog(LOG_FATAL, "A TUN internal device is not supported with XDP capture\n");
+		return -ARG_CONFIG_BAD;
 	}
-	if((ret = init_pcap_driver(&extData.pd, extData.dev, 0)) < 0)
+
+	if(config->pipeline)
 	{
-		arglog(LOG_FATAL, "Unable to initialize the internal device %s\n", intData.dev);
-		return ret;
+		// XDP transmits from the frame the packet arrived in, which is long
+		// gone by the time a later stage would send it
+		if(config->captureMode == CAPTURE_XDP)
+		{
+			arglog(LOG_FATAL, "Pipelined processing is not supported with XDP capture\n");
+			return -ARG_CONFIG_BAD;
+		}
+
+		for(i = 0; i < workerCount; i++)
+		{
+			if((ret = init_pipeline(&intData[i].pipe, config)) < 0
+				|| (ret = init_pipeline(&extData[i].pipe, config)) < 0)
+			{
+				arglog(LOG_FATAL, "Unable to create pipeline rings\n");
+				return ret;
+			}
+		}
+	}
+
+	for(i = 0; i < workerCount; i++)
+	{
+		if((ret = init_packet_pool(&intData[i].pool, config->poolSize)) < 0
+			|| (ret = init_packet_pool(&extData[i].pool, config->poolSize)) < 0)
+		{
+			arglog(LOG_FATAL, "Unable to create packet pools\n");
+			return ret;
+		}
+	}
+
+	if(config->captureMode == CAPTURE_XDP)
+	{
+		if((ret = init_xdp_driver(config)) < 0)
+		{
+			arglog(LOG_FATAL, "Unable to initialize XDP on %s and %s\n", config->intDev, config->extDev);
+			return ret;
+		}
+	}
+	else
+	{
+		// XDP frames its own packets, everyone else can skip the kernel's ARP for gates
+		if((ret = init_protocol_egress(config->extDev)) < 0)
+			arglog(LOG_ALERT, "Unable to send ARG traffic directly on %s, routing it instead\n", config->extDev);
+
+		for(i = 0; i < workerCount; i++)
+		{
+			if((ret = init_worker_capture(&intData[i], config)) < 0)
+			{
+				arglog(LOG_FATAL, "Unable to initialize the internal device %s\n", config->intDev);
+				return ret;
+			}
+			if((ret = init_worker_capture(&extData[i], config)) < 0)
+			{
+				arglog(LOG_FATAL, "Unable to initialize the external device %s\n", config->extDev);
+				return ret;
+			}
+		}
+	}
+
+	// Everything is open, now we can wait on it
+	for(i = 0; i < workerCount; i++)
+	{
+		if((ret = init_worker_events(&intData[i], config)) < 0
+			|| (ret = init_worker_events(&extData[i], config)) < 0)
+		{
+			arglog(LOG_FATAL, "Unable to set up receive events\n");
+			return ret;
+		}
 	}
 
 	// TBD internal address (doing the base again right now)
@@ -69,21 +160,224 @@ int init_director(struct config_data *config)
 
 	// Enter receive loop
 	receiveShouldRun = true;
-	pthread_create(&intData.thread, NULL, receive_thread, (void*)&intData); // TBD check returns
-	pthread_create(&extData.thread, NULL, receive_thread, (void*)&extData);
+	for(i = 0; i < workerCount; i++)
+	{
+		pthread_create(&intData[i].thread, NULL, receive_thread, (void*)&intData[i]); // TBD check returns
+		pthread_create(&extData[i].thread, NULL, receive_thread, (void*)&extData[i]);
+	}
+
+	// Only packet sockets can have their filter swapped under them
+	if(config->hopFilter && (config->captureMode == CAPTURE_PCAP || config->captureMode == CAPTURE_TPACKET))
+		pthread_create(&filterThread, NULL, hop_filter_thread, NULL); // TBD check return
 	
 	arglog(LOG_DEBUG, "Director initialized\n");
 	return 0;
 }
 
+void init_thread_data(struct receive_thread_data *data, const char *dev, char ifaceSide,
+					  int worker, const struct config_data *config)
+{
+	memset(data, 0, sizeof(struct receive_thread_data));
+
+	data->pd = NULL;
+	data->ring.fd = -1;
+	data->xsk.fd = -1;
+	data->tun.fd = -1;
+	data->epollFd = -1;
+	data->captureMode = config->captureMode;
+	if(ifaceSide == IFACE_INTERNAL && config->internalMode == INTERNAL_TUN)
+		data->captureMode = CAPTURE_TUN;
+
+	strncpy(data->dev, dev, sizeof(data->dev) - 1);
+	data->ifaceSide = ifaceSide;
+	data->handler = (ifaceSide == IFACE_INTERNAL ? direct_outbound : direct_inbound);
+	data->worker = worker;
+	data->sendBatch = config->sendBatch;
+	data->sendFlush = config->sendFlush;
+
+	// Packets into the internal network go straight into this worker's
+	// queue rather than back through the kernel's routing
+	if(ifaceSide == IFACE_EXTERNAL && config->internalMode == INTERNAL_TUN)
+		data->egressTun = &intData[worker].tun;
+}
+
+int init_worker_capture(struct receive_thread_data *data, const struct config_data *config)
+{
+	int ret;
+	int fd;
+	bool is_internal = (data->ifaceSide == IFACE_INTERNAL);
+
+	// Each worker is its own queue, the kernel spreads flows across them
+	if(data->captureMode == CAPTURE_TUN)
+		return init_tun_queue(&data->tun, data->dev);
+
+	if(data->captureMode == CAPTURE_TPACKET)
+	{
+		if((ret = init_ring_driver(&data->ring, data->dev, is_internal, config)) < 0)
+			return ret;
+		fd = data->ring.fd;
+	}
+	else
+	{
+		if((ret = init_pcap_driver(&data->pd, data->dev, is_internal)) < 0)
+			return ret;
+		fd = pcap_fileno(data->pd);
+	}
+
+	// A single worker gets everything anyway
+	if(workerCount > 1)
+		return join_fanout(fd, data->dev, data->ifaceSide);
+
+	return 0;
+}
+
+int capture_fd(const struct receive_thread_data *data)
+{
+	switch(data->captureMode)
+	{
+	case CAPTURE_XDP:
+		return data->xsk.fd;
+	case CAPTURE_TUN:
+		return data->tun.fd;
+	case CAPTURE_TPACKET:
+		return data->ring.fd;
+	default:
+		return pcap_get_selectable_fd(data->pd);
+	}
+}
+
+int init_worker_events(struct receive_thread_data *data, const struct config_data *config)
+{
+	struct epoll_event ev;
+	int fd = capture_fd(data);
+
+	if(fd < 0)
+	{
+		arglog(LOG_FATAL, "No selectable descriptor for %s\n", data->dev);
+		return -ARG_CONFIG_BAD;
+	}
+
+	data->busyPoll = config->busyPoll;
+	if(data->busyPoll)
+	{
+		// Makes every poll() spin in the driver for up to this long before
+		// sleeping. TUN has no driver to spin on
+		if(data->captureMode == CAPTURE_TUN)
+			data->busyPoll = 0;
+		else if(setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &data->busyPoll, sizeof(data->busyPoll)) < 0)
+		{
+			arglog(LOG_FATAL, "Unable to enable busy polling on %s: %s\n", data->dev, strerror(errno));
+			return -ARG_CONFIG_BAD;
+		}
+	}
+
+	if((data->epollFd = epoll_create1(0)) < 0)
+	{
+		arglog(LOG_FATAL, "Unable to create epoll instance: %s\n", strerror(errno));
+		return -errno;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	if(epoll_ctl(data->epollFd, EPOLL_CTL_ADD, fd, &ev) < 0)
+	{
+		arglog(LOG_FATAL, "Unable to wait on %s: %s\n", data->dev, strerror(errno));
+		return -errno;
+	}
+
+	ev.data.fd = stopFd;
+	if(epoll_ctl(data->epollFd, EPOLL_CTL_ADD, stopFd, &ev) < 0)
+	{
+		arglog(LOG_FATAL, "Unable to wait on shutdown event: %s\n", strerror(errno));
+		return -errno;
+	}
+
+	return 0;
+}
+
+void wait_for_frames(struct receive_thread_data *data)
+{
+	struct epoll_event events[2];
+	struct pollfd pfd;
+
+	if(data->busyPoll)
+	{
+		// Never sleep, but let the driver be polled directly on each pass
+		pfd.fd = capture_fd(data);
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		poll(&pfd, 1, 0);
+		return;
+	}
+
+	// Shutdown wakes us through stopFd, so there's no need for a timeout
+	if(epoll_wait(data->epollFd, events, 2, -1) < 0 && errno != EINTR)
+		arglog(LOG_DEBUG, "Wait on %s failed: %s\n", data->dev, strerror(errno));
+}
+
+int dispatch_frames(struct receive_thread_data *data, tpacket_handler handler)
+{
+	int ret;
+
+	switch(data->captureMode)
+	{
+	case CAPTURE_XDP:
+		return xsk_dispatch(&data->port, handler, data);
+	case CAPTURE_TUN:
+		return tun_dispatch(&data->tun, handler, data);
+	case CAPTURE_TPACKET:
+		return tpacket_dispatch(&data->ring, handler, data);
+	default:
+		data->pcapHandler = handler;
+		ret = pcap_dispatch(data->pd, PCAP_DISPATCH_BATCH, handle_pcap_frame, (u_char*)data);
+		if(ret == -1)
+		{
+			arglog(LOG_ALERT, "pcap error on %s: %s\n", data->dev, pcap_geterr(data->pd));
+			return -ARG_INTERNAL_ERROR;
+		}
+		return ret;
+	}
+}
+
+void handle_pcap_frame(u_char *user, const struct pcap_pkthdr *header, const u_char *wireData)
+{
+	struct receive_thread_data *data = (struct receive_thread_data*)user;
+	struct timespec tstamp;
+
+	tstamp.tv_sec = header->ts.tv_sec;
+	tstamp.tv_nsec = header->ts.tv_usec * 1000;
+
+	(*data->pcapHandler)(data, (uint8_t*)wireData, header->caplen, &tstamp);
+}
+
+int join_fanout(int fd, const char *dev, char ifaceSide)
+{
+	int arg;
+	int group;
+
+	// Groups are shared by the whole network namespace, so keep ours apart
+	// from other ARG instances and give each device its own
+	group = ((getpid() & 0x7FFF) << 1) | (ifaceSide == IFACE_INTERNAL);
+
+	// Hash on the flow so all of a connection (and the NAT/hopper state it
+	// touches) stays on one worker. Reassemble fragments so they hash together
+	arg = group | ((PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG) << 16);
+	if(setsockopt(fd, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg)) < 0)
+	{
+		arglog(LOG_FATAL, "Unable to join fanout group %i on %s: %s\n", group, dev, strerror(errno));
+		return -ARG_CONFIG_BAD;
+	}
+
+	return 0;
+}
+
 int init_pcap_driver(pcap_t **pd, char *dev, bool is_internal)
 {
 	char ebuf[PCAP_ERRBUF_SIZE];
 
 	struct bpf_program fp;
 	char filter[MAX_FILTER_LEN];
-	char baseIP[INET_ADDRSTRLEN];
-	char mask[INET_ADDRSTRLEN];
 
 	// Activate pcap
 	*pd = pcap_create(dev, ebuf);
@@ -93,7 +387,9 @@ int init_pcap_driver(pcap_t **pd, char *dev, bool is_internal)
 		return -ARG_CONFIG_BAD;
 	}
 
-	pcap_set_timeout(*pd, 250);
+	// Deliver each packet as it arrives rather than when the buffer fills,
+	// we do our own waiting with epoll
+	pcap_set_immediate_mode(*pd, 1);
 	pcap_set_snaplen(*pd, MAX_PACKET_SIZE);
 	pcap_set_promisc(*pd, 1);
 
@@ -103,26 +399,14 @@ int init_pcap_driver(pcap_t **pd, char *dev, bool is_internal)
 		return -ARG_CONFIG_BAD;
 	}
 
-	// Filter outbound traffic (we only want to get traffic coming to this card)
-	inet_ntop(AF_INET, gate_base_ip(), baseIP, sizeof(baseIP));
-	inet_ntop(AF_INET, gate_mask(), mask, sizeof(mask));
-	if(!is_internal)
-	{
-		// Get ARP traffic about IPs inside our network that doesn't originate from us
-		// and non-ARP traffic that is intended for inside us
-		snprintf(filter, sizeof(filter), "(arp and not src net %s mask %s and dst net %s mask %s) or "
-										 "(not arp and dst net %s mask %s)",
-										 baseIP, mask, baseIP, mask, baseIP, mask);
-	}
-	else
+	if(pcap_setnonblock(*pd, 1, ebuf) == -1)
 	{
-		// For the internal card, we also want to get ARP packets that are for
-		// addresses outside our network. We will respond to them with our own MAC
-		snprintf(filter, sizeof(filter), "(arp and not dst net %s mask %s) or "
-										 "(not arp and src net %s mask %s)",
-										baseIP, mask, baseIP, mask);
+		arglog(LOG_FATAL, "Unable to make pcap non-blocking on %s: %s\n", dev, ebuf);
+		pcap_close(*pd);
+		return -ARG_CONFIG_BAD;
 	}
 
+	build_filter(filter, sizeof(filter), is_internal);
 	arglog(LOG_DEBUG, "Using filter '%s' on %s\n", filter, dev);
     
 	if(pcap_compile(*pd, &fp, filter, 1, PCAP_NETMASK_UNKNOWN) == -1)
@@ -145,156 +429,958 @@ int init_pcap_driver(pcap_t **pd, char *dev, bool is_internal)
 	return 0;
 }
 
-int uninit_director(void)
+int init_ring_driver(struct tpacket_ring *ring, char *dev, bool is_internal, const struct config_data *config)
 {
-	if(pthread_mutex_trylock(&cancelLock) == EBUSY)
-		return 0;
-	
-	if(!cancelSent)
-	{
-		cancelSent = true;
+	int ret;
+	struct bpf_program fp;
+	char filter[MAX_FILTER_LEN];
 
-		arglog(LOG_DEBUG, "Director uninit\n");
+	build_filter(filter, sizeof(filter), is_internal);
+	arglog(LOG_DEBUG, "Using filter '%s' on %s\n", filter, dev);
 
-		// Stop threads
-		pthread_cancel(intData.thread);
-		pthread_cancel(extData.thread);
-		receiveShouldRun = false;
-		join_director();
+	if((ret = compile_filter(&fp, filter)) < 0)
+		return ret;
+
+	ret = init_tpacket_ring(ring, dev, config, &fp);
+	pcap_freecode(&fp);
+
+	return ret;
+}
+
+int init_xdp_driver(const struct config_data *config)
+{
+	int ret;
+	int i = 0;
+	unsigned int frames = config->xskFrames;
+
+	// One umem for both devices, so a packet can leave through the other
+	// side without being copied. Each port owns its own slice of frames
+	if((ret = init_xsk_umem(&umem, 2 * workerCount * frames)) < 0)
+		return ret;
+
+	// Workers map onto device queues, RSS does the spreading
+	if((ret = init_xsk_device(&intXdp, config->intDev, workerCount, config->xskMode)) < 0
+		|| (ret = init_xsk_device(&extXdp, config->extDev, workerCount, config->xskMode)) < 0)
+	{
+		uninit_xdp_driver();
+		return ret;
+	}
 
-		// Kill pcap
-		if(intData.pd != NULL)
+	for(i = 0; i < workerCount; i++)
+	{
+		if((ret = init_xsk_socket(&intData[i].xsk, &intXdp, config->intDev, i, &umem)) < 0
+			|| (ret = init_xsk_socket(&extData[i].xsk, &extXdp, config->extDev, i, &umem)) < 0)
 		{
-			pcap_close(intData.pd);
-			intData.pd = NULL;
+			uninit_xdp_driver();
+			return ret;
 		}
-		if(extData.pd != NULL)
+	}
+
+	// Internal traffic goes out the external side and vice versa. Worker i
+	// is the only one transmitting on queue i of the other device
+	for(i = 0; i < workerCount; i++)
+	{
+		if((ret = init_xsk_port(&intData[i].port, &intData[i].xsk, &extData[i].xsk,
+				config->extDev, 2 * i * frames, frames)) < 0
+			|| (ret = init_xsk_port(&extData[i].port, &extData[i].xsk, &intData[i].xsk,
+				config->intDev, (2 * i + 1) * frames, frames)) < 0)
 		{
-			pcap_close(extData.pd);
-			extData.pd = NULL;
+			uninit_xdp_driver();
+			return ret;
 		}
-	
-		pthread_mutex_unlock(&cancelLock);
-		pthread_mutex_destroy(&cancelLock);
-	
-		arglog(LOG_DEBUG, "Director finished\n");
 	}
 
 	return 0;
 }
 
-void join_director(void)
+void uninit_xdp_driver(void)
+{
+	int i = 0;
+
+	for(i = 0; i < workerCount; i++)
+	{
+		uninit_xsk_port(&intData[i].port);
+		uninit_xsk_port(&extData[i].port);
+		uninit_xsk_socket(&intData[i].xsk);
+		uninit_xsk_socket(&extData[i].xsk);
+	}
+
+	uninit_xsk_device(&intXdp);
+	uninit_xsk_device(&extXdp);
+	uninit_xsk_umem(&umem);
+}
+
+void build_filter(char *filter, int len, bool is_internal)
 {
-	if(extData.thread != 0)
+	char baseIP[INET_ADDRSTRLEN];
+	char mask[INET_ADDRSTRLEN];
+
+	// Filter outbound traffic (we only want to get traffic coming to this card)
+	inet_ntop(AF_INET, gate_base_ip(), baseIP, sizeof(baseIP));
+	inet_ntop(AF_INET, gate_mask(), mask, sizeof(mask));
+	if(!is_internal)
 	{
-		pthread_join(extData.thread, NULL);
-		extData.thread = 0;
+		// Get ARP traffic about IPs inside our network that doesn't originate from us
+		// and non-ARP traffic that is intended for inside us
+		snprintf(filter, len, "(arp and not src net %s mask %s and dst net %s mask %s) or "
+							  "(not arp and dst net %s mask %s)",
+							  baseIP, mask, baseIP, mask, baseIP, mask);
 	}
-	if(intData.thread != 0)
+	else
 	{
-		pthread_join(intData.thread, NULL);
-		intData.thread = 0;
+		// For the internal card, we also want to get ARP packets that are for
+		// addresses outside our network. We will respond to them with our own MAC
+		snprintf(filter, len, "(arp and not dst net %s mask %s) or "
+							  "(not arp and src net %s mask %s)",
+							  baseIP, mask, baseIP, mask);
 	}
 }
 
-void *receive_thread(void *tData)
+// snprintf()s onto the end of filter. Returns false once it no longer fits
+static bool filter_append(char *filter, int len, int *pos, const char *fmt, ...)
 {
-	struct receive_thread_data *data = (struct receive_thread_data*)tData;
-
-	struct pcap_pkthdr header;
-	int frameHeadLen = 0;
-	int frameTailLen = 0;
+	int ret;
+	va_list ap;
 
-	int devIndex = 0;
-	uint8_t hwaddr[ETH_ALEN];
+	if(*pos >= len)
+		return false;
 
-	uint8_t *wireData = NULL;
-	struct packet_data packet;
+	va_start(ap, fmt);
+	ret = vsnprintf(filter + *pos, len - *pos, fmt, ap);
+	va_end(ap);
 
-	// Cache hardware address for ARP
-	if(get_mac_addr(data->dev, hwaddr) < 0)
+	if(ret < 0 || ret >= len - *pos)
 	{
-		arglog(LOG_DEBUG, "Unable to get hardware address of %s\n", data->dev);
-		return (void*)-ARG_CONFIG_BAD;
+		*pos = len;
+		return false;
 	}
 
-	if((devIndex = get_dev_index(data->dev)) < 0)
+	*pos += ret;
+	return true;
+}
+
+// Appends "dst host a or dst host b ..." for each of ips
+static bool filter_append_hosts(char *filter, int len, int *pos, uint8_t ips[][ADDR_SIZE], int count, bool first)
+{
+	int i = 0;
+	char ip[INET_ADDRSTRLEN];
+
+	for(i = 0; i < count; i++)
 	{
-		arglog(LOG_DEBUG, "Unable to get index of device %s\n", data->dev);
-		return (void*)-ARG_CONFIG_BAD;
+		inet_ntop(AF_INET, ips[i], ip, sizeof(ip));
+		if(!filter_append(filter, len, pos, "%sdst host %s", (first && i == 0 ? "" : " or "), ip))
+			return false;
 	}
 
-	// Cache how far to jump in packets
-	if(pcap_datalink(data->pd) == DLT_EN10MB)
+	return true;
+}
+
+int build_hop_filter(char *filter, int len)
+{
+	int i = 0;
+	int pos = 0;
+	bool ok = true;
+	char baseIP[INET_ADDRSTRLEN];
+	char mask[INET_ADDRSTRLEN];
+	char ip[INET_ADDRSTRLEN];
+	uint8_t hops[3][ADDR_SIZE];
+	uint8_t natIPs[MAX_FILTER_HOSTS][ADDR_SIZE];
+	uint8_t gateBases[MAX_FILTER_GATES][ADDR_SIZE];
+	uint8_t gateMasks[MAX_FILTER_GATES][ADDR_SIZE];
+	int natCount = 0;
+	int gateCount = 0;
+
+	inet_ntop(AF_INET, gate_base_ip(), baseIP, sizeof(baseIP));
+	inet_ntop(AF_INET, gate_mask(), mask, sizeof(mask));
+
+	get_hop_window(hops[0], hops[1], hops[2]);
+	natCount = get_nat_gate_ips(natIPs, MAX_FILTER_HOSTS);
+	gateCount = get_gate_networks(gateBases, gateMasks, MAX_FILTER_GATES);
+
+	// ARP is unchanged. Routers need answers for any IP we might use
+	ok = filter_append(filter, len, &pos, "(arp and not src net %s mask %s and dst net %s mask %s)",
+		baseIP, mask, baseIP, mask);
+
+	// Wrapped traffic only ever goes to our current IP. The hops either
+	// side cover clock differences and the moment the filter is swapped
+	ok = ok && filter_append(filter, len, &pos, " or (ip proto %i and ip[((ip[0] & 0xf) << 2) + 1] = %i and (",
+		ARG_PROTO, ARG_WRAPPED_MSG);
+	ok = ok && filter_append_hosts(filter, len, &pos, hops, 3, true);
+	ok = ok && filter_append(filter, len, &pos, "))");
+
+	// Admin messages are sent before the other gate knows our hop key, so
+	// they may be addressed to anything in our range. Only take them from
+	// gates we know of (when there are too many to list, from anyone)
+	if(gateCount != 0)
 	{
-		frameHeadLen = LINK_LAYER_SIZE;
-		frameTailLen = 0;
+		ok = ok && filter_append(filter, len, &pos,
+			" or (ip proto %i and ip[((ip[0] & 0xf) << 2) + 1] != %i and dst net %s mask %s",
+			ARG_PROTO, ARG_WRAPPED_MSG, baseIP, mask);
+
+		if(gateCount > 0)
+		{
+			ok = ok && filter_append(filter, len, &pos, " and (");
+			for(i = 0; i < gateCount; i++)
+			{
+				inet_ntop(AF_INET, gateBases[i], ip, sizeof(ip));
+				inet_ntop(AF_INET, gateMasks[i], mask, sizeof(mask));
+				ok = ok && filter_append(filter, len, &pos, "%ssrc net %s mask %s", (i ? " or " : ""), ip, mask);
+			}
+			ok = ok && filter_append(filter, len, &pos, ")");
+
+			inet_ntop(AF_INET, gate_mask(), mask, sizeof(mask));
+		}
+
+		ok = ok && filter_append(filter, len, &pos, ")");
 	}
+
+	// Everything else is NAT, which uses whatever IP we had when each
+	// connection was created. New connections get the current one
+	ok = ok && filter_append(filter, len, &pos, " or (not arp and not ip proto %i and (", ARG_PROTO);
+	ok = ok && filter_append_hosts(filter, len, &pos, hops, 3, true);
+	if(natCount >= 0)
+		ok = ok && filter_append_hosts(filter, len, &pos, natIPs, natCount, false);
 	else
+		ok = ok && filter_append(filter, len, &pos, " or dst net %s mask %s", baseIP, mask);
+	ok = ok && filter_append(filter, len, &pos, "))");
+
+	return (ok ? 0 : -ENOSPC);
+}
+
+int update_hop_filters(void)
+{
+	int i = 0;
+	int ret;
+	char filter[MAX_HOP_FILTER_LEN];
+	struct bpf_program fp;
+
+	if(build_hop_filter(filter, sizeof(filter)) < 0)
 	{
-		frameHeadLen = 0;
-		frameTailLen = 0;
-		arglog(LOG_DEBUG, "Unable to determine data link type\n");
-		return (void*)-ARG_CONFIG_BAD;
+		arglog(LOG_DEBUG, "Hop filter too long, accepting our whole range\n");
+		build_filter(filter, sizeof(filter), false);
 	}
 
-	// Receive, parse, and pass on to handler
-	arglog(LOG_DEBUG, "Ready to receive packets on %s\n", data->dev);
+	if((ret = compile_filter(&fp, filter)) < 0)
+		return ret;
 
-	while(receiveShouldRun)
+	for(i = 0; i < workerCount; i++)
 	{
-		wireData = (uint8_t*)pcap_next(data->pd, &header);
-		if(wireData == NULL)
-			continue;
+		if((ret = attach_filter(capture_fd(&extData[i]), &fp)) < 0)
+		{
+			arglog(LOG_ALERT, "Unable to swap filter on %s: %s\n", extData[i].dev, strerror(-ret));
+			break;
+		}
+	}
 
-		packet.linkLayerLen = frameHeadLen;
-		packet.data = wireData;
-		packet.len = header.caplen - frameTailLen;
+	pcap_freecode(&fp);
 
-		packet.tstamp.tv_sec = header.ts.tv_sec;
-		packet.tstamp.tv_nsec = header.ts.tv_usec * 1000;
+	return (ret < 0 ? ret : 0);
+}
 
-		if(parse_packet(&packet))
-			continue;
-		
-		if(packet.arp)
-		{
-			// Send back a reply telling them to send their packets here.
-			// The filter ensure we only get ARP packets directed for our
-			// other side, so we don't have to perform any checks here
-			send_arp_reply(&packet, devIndex, hwaddr);
-			continue;
-		}
+void *hop_filter_thread(void *unused)
+{
+	struct pollfd pfd;
 
-		if(!packet.ipv4)
-			continue;
+	arglog(LOG_DEBUG, "Hop filter thread running\n");
 
-		if(data->handler != NULL)
-			(*data->handler)(&packet);
+	pfd.fd = stopFd;
+	pfd.events = POLLIN;
+
+	while(receiveShouldRun)
+	{
+		update_hop_filters();
+
+		// Sleep until just after the next hop, or until shutdown
+		pfd.revents = 0;
+		poll(&pfd, 1, time_to_next_hop() + HOP_FILTER_DELAY);
+	}
+
+	arglog(LOG_DEBUG, "Hop filter thread dying\n");
+
+	return NULL;
+}
+
+int compile_filter(struct bpf_program *fp, const char *filter)
+{
+	pcap_t *dead = NULL;
+
+	// No live handle to compile against when we capture ourselves, so
+	// compile for a generic ethernet link
+	dead = pcap_open_dead(DLT_EN10MB, MAX_PACKET_SIZE);
+	if(dead == NULL)
+	{
+		arglog(LOG_FATAL, "Unable to create pcap handle for filter compilation\n");
+		return -ENOMEM;
+	}
+
+	if(pcap_compile(dead, fp, filter, 1, PCAP_NETMASK_UNKNOWN) == -1)
+	{
+		arglog(LOG_FATAL, "Unable to compile filter: %s\n", pcap_geterr(dead));
+		pcap_close(dead);
+		return -ARG_INTERNAL_ERROR;
+	}
+
+	pcap_close(dead);
+	return 0;
+}
+
+// True if ip is inside our gateway's network
+static bool in_gate_net(const void *ip)
+{
+	return !mask_array_cmp(ADDR_SIZE, gate_mask(), gate_base_ip(), ip);
+}
+
+bool frame_wanted(const struct packet_data *packet, bool is_internal)
+{
+	if(packet_arp(packet))
+	{
+		if(is_internal)
+			return !in_gate_net(packet_arp(packet)->arp_tpa);
+		else
+			return !in_gate_net(packet_arp(packet)->arp_spa) && in_gate_net(packet_arp(packet)->arp_tpa);
+	}
+
+	if(!packet_ipv4(packet))
+		return false;
+
+	if(is_internal)
+		return in_gate_net(&packet_ipv4(packet)->saddr);
+	else
+		return in_gate_net(&packet_ipv4(packet)->daddr);
+}
+
+int xdp_send_hook(void *tData, const struct packet_data *packet)
+{
+	struct receive_thread_data *data = (struct receive_thread_data*)tData;
+	bool toInside;
+
+	if(!packet_ipv4(packet))
+		return 1;
+
+	// Only packets leaving through the other side can use our TX socket,
+	// anything else (replies to admin messages, ARP) goes the normal way
+	toInside = in_gate_net(&packet_ipv4(packet)->daddr);
+	if(toInside != (data->ifaceSide == IFACE_EXTERNAL))
+		return 1;
+
+	return xsk_send(&data->port, packet);
+}
+
+int tun_send_hook(void *tData, const struct packet_data *packet)
+{
+	struct receive_thread_data *data = (struct receive_thread_data*)tData;
+
+	if(!packet_ipv4(packet) || !in_gate_net(&packet_ipv4(packet)->daddr))
+		return 1;
+
+	return tun_write(data->egressTun, packet);
+}
+
+int uninit_director(void)
+{
+	int i = 0;
+
+	if(pthread_mutex_trylock(&cancelLock) == EBUSY)
+		return 0;
+	
+	if(!cancelSent)
+	{
+		cancelSent = true;
+
+		arglog(LOG_DEBUG, "Director uninit\n");
+
+		// Stop threads. Anyone waiting on a capture fd wakes on stopFd
+		receiveShouldRun = false;
+		if(stopFd >= 0)
+			eventfd_write(stopFd, 1);
+		join_director();
+
+		// Kill capture
+		for(i = 0; i < workerCount; i++)
+		{
+			uninit_worker_capture(&intData[i]);
+			uninit_worker_capture(&extData[i]);
+			uninit_pipeline(&intData[i].pipe);
+			uninit_pipeline(&extData[i].pipe);
+		}
+
+		// Packets from these may have been sitting in the pipelines
+		for(i = 0; i < workerCount; i++)
+		{
+			uninit_packet_pool(&intData[i].pool);
+			uninit_packet_pool(&extData[i].pool);
+		}
+
+		if(intData[0].captureMode == CAPTURE_XDP)
+			uninit_xdp_driver();
+		else
+			uninit_protocol_egress();
+
+		if(stopFd >= 0)
+		{
+			close(stopFd);
+			stopFd = -1;
+		}
+	
+		pthread_mutex_unlock(&cancelLock);
+		pthread_mutex_destroy(&cancelLock);
+	
+		arglog(LOG_DEBUG, "Director finished\n");
+	}
+
+	return 0;
+}
+
+void uninit_worker_capture(struct receive_thread_data *data)
+{
+	if(data->pd != NULL)
+	{
+		pcap_close(data->pd);
+		data->pd = NULL;
+	}
+
+	uninit_tpacket_ring(&data->ring);
+	uninit_tun_queue(&data->tun);
+
+	if(data->epollFd >= 0)
+	{
+		close(data->epollFd);
+		data->epollFd = -1;
+	}
+}
+
+void join_director(void)
+{
+	int i = 0;
+
+	if(filterThread != 0)
+	{
+		pthread_join(filterThread, NULL);
+		filterThread = 0;
+	}
+
+	for(i = 0; i < workerCount; i++)
+	{
+		if(extData[i].thread != 0)
+		{
+			pthread_join(extData[i].thread, NULL);
+			extData[i].thread = 0;
+		}
+		if(intData[i].thread != 0)
+		{
+			pthread_join(intData[i].thread, NULL);
+			intData[i].thread = 0;
+		}
+
+		join_pipeline(&extData[i].pipe);
+		join_pipeline(&intData[i].pipe);
+	}
+}
+
+void *receive_thread(void *tData)
+{
+	struct receive_thread_data *data = (struct receive_thread_data*)tData;
+
+	int ret;
+	char error[MAX_ERROR_STR_LEN];
+	tpacket_handler frameHandler = handle_frame;
+	struct pool_stats poolStats;
+
+	// Packets this thread builds (or, pipelined, captures) come from its own buffers
+	set_packet_pool(&data->pool);
+
+	// Cache hardware address for ARP. TUN devices have neither
+	if(data->captureMode != CAPTURE_TUN)
+	{
+		if(get_mac_addr(data->dev, data->hwaddr) < 0)
+		{
+			arglog(LOG_DEBUG, "Unable to get hardware address of %s\n", data->dev);
+			return (void*)-ARG_CONFIG_BAD;
+		}
+
+		if((data->devIndex = get_dev_index(data->dev)) < 0)
+		{
+			arglog(LOG_DEBUG, "Unable to get index of device %s\n", data->dev);
+			return (void*)-ARG_CONFIG_BAD;
+		}
 	}
 
-	arglog(LOG_DEBUG, "Done receiving packets on %s\n", data->dev);
+	// Cache how far to jump in packets. Rings and XDP are always opened on
+	// ethernet devices, TUN hands us bare IP packets
+	if(data->captureMode == CAPTURE_TUN)
+	{
+		data->frameHeadLen = 0;
+	}
+	else if(data->captureMode != CAPTURE_PCAP || pcap_datalink(data->pd) == DLT_EN10MB)
+	{
+		data->frameHeadLen = LINK_LAYER_SIZE;
+	}
+	else
+	{
+		data->frameHeadLen = 0;
+		arglog(LOG_DEBUG, "Unable to determine data link type\n");
+		return (void*)-ARG_CONFIG_BAD;
+	}
+
+	// Whether frames can be wrapped/unwrapped where they landed. libpcap's
+	// buffers are its own, and XDP frames start right at the umem frame
+	if(data->captureMode == CAPTURE_TPACKET || data->captureMode == CAPTURE_TUN)
+		data->frameHeadroom = PACKET_HEADROOM;
+	else if(data->captureMode == CAPTURE_XDP)
+		data->frameHeadroom = 0;
+	else
+		data->frameHeadroom = -1;
+
+	// With pipelining we only capture, the later stages do the rest
+	if(data->pipe.enabled)
+	{
+		if(start_pipeline(data) < 0)
+		{
+			arglog(LOG_DEBUG, "Unable to start pipeline for %s\n", data->dev);
+			return (void*)-ARG_INTERNAL_ERROR;
+		}
+
+		frameHandler = queue_frame;
+	}
+
+	// Without a pipeline, this thread does our sends too
+	if(!data->pipe.enabled)
+	{
+		if(data->egressTun != NULL)
+			set_send_hook(tun_send_hook, data);
+
+		if(init_send_queue(data->sendBatch, data->sendFlush) < 0)
+			arglog(LOG_DEBUG, "Sending unbatched on %s (worker %i)\n", data->dev, data->worker);
+	}
+
+	// Receive, parse, and pass on to handler
+	arglog(LOG_DEBUG, "Ready to receive packets on %s\n", data->dev);
+
+	// Forwarded packets leave straight from our umem
+	if(data->captureMode == CAPTURE_XDP)
+		set_send_hook(xdp_send_hook, data);
+
+	while(receiveShouldRun)
+	{
+		if((ret = dispatch_frames(data, frameHandler)) < 0)
+		{
+			arg_strerror_r(ret, error, sizeof(error));
+			arglog(LOG_ALERT, "Receive on %s failed: %s\n", data->dev, error);
+			break;
+		}
+
+		// End of the burst, push out whatever it produced
+		flush_send_queue();
+
+		// Only sleep once everything ready has been handled
+		if(ret == 0)
+			wait_for_frames(data);
+	}
+
+	set_send_hook(NULL, NULL);
+	uninit_send_queue();
+	set_packet_pool(NULL);
+
+	get_send_stats(&data->sendStats);
+	log_send_stats(data->dev, data->worker, &data->sendStats);
+
+	get_pool_stats(&data->pool, &poolStats);
+	arglog(LOG_DEBUG, "Packet pool on %s (worker %i): %u of %u buffers at most, %lu gets, "
+		"%lu refused, %lu freed by other threads\n",
+		data->dev, data->worker, poolStats.highWater, poolStats.capacity, poolStats.gets,
+		poolStats.exhausted, poolStats.remoteFrees);
+	arglog(LOG_DEBUG, "Done receiving packets on %s (worker %i): %lu frames, %lu bytes, "
+		"%lu ignored, %lu sent, %lu send failures\n",
+		data->dev, data->worker, data->stats.frames, data->stats.bytes, data->stats.ignored,
+		data->sendStats.sent, data->sendStats.failed);
+	if(data->pipe.enabled)
+		arglog(LOG_DEBUG, "Capture stage on %s (worker %i): %lu queued, %lu dropped\n",
+			data->dev, data->worker, data->pipe.capture.processed, data->pipe.capture.dropped);
+
+	return NULL;
+}
+
+void handle_frame(void *tData, uint8_t *frame, unsigned long len, const struct timespec *tstamp)
+{
+	struct receive_thread_data *data = (struct receive_thread_data*)tData;
+	struct packet_data packet;
+
+	packet.linkLayerLen = data->frameHeadLen;
+	packet.data = frame;
+	packet.len = len;
+	packet.tstamp = *tstamp;
+	packet.pool = NULL;
+	if(data->frameHeadroom >= 0)
+	{
+		packet.buf = frame - data->frameHeadroom;
+		packet.bufLen = len + data->frameHeadroom;
+	}
+	else
+	{
+		packet.buf = NULL;
+		packet.bufLen = 0;
+	}
+
+	data->stats.frames++;
+	data->stats.bytes += len;
+
+	if(parse_packet(&packet))
+	{
+		data->stats.ignored++;
+		return;
+	}
+
+	// Nothing has filtered XDP or TUN traffic for us yet
+	if((data->captureMode == CAPTURE_XDP || data->captureMode == CAPTURE_TUN)
+		&& !frame_wanted(&packet, data->ifaceSide == IFACE_INTERNAL))
+	{
+		data->stats.ignored++;
+		return;
+	}
+	
+	if(packet_arp(&packet))
+	{
+		// Send back a reply telling them to send their packets here.
+		// The filter ensure we only get ARP packets directed for our
+		// other side, so we don't have to perform any checks here
+		send_arp_reply(&packet, data->devIndex, data->hwaddr);
+		return;
+	}
+
+	if(!packet_ipv4(&packet))
+	{
+		data->stats.ignored++;
+		return;
+	}
+
+	if(data->handler != NULL)
+		(*data->handler)(&packet);
+}
+
+/***************************
+Pipeline stages
+***************************/
+int init_pipeline(struct pipeline *pipe, const struct config_data *config)
+{
+	int ret;
+
+	memset(pipe, 0, sizeof(struct pipeline));
+	pipe->fullPolicy = config->pipelineFull;
+
+	if((ret = init_spsc_ring(&pipe->classifyRing, config->pipelineRing)) < 0
+		|| (ret = init_spsc_ring(&pipe->workRing, config->pipelineRing)) < 0
+		|| (ret = init_spsc_ring(&pipe->txRing, config->pipelineRing)) < 0
+		|| (ret = init_packet_pool(&pipe->workPool, config->poolSize)) < 0)
+	{
+		uninit_pipeline(pipe);
+		return ret;
+	}
+
+	pipe->enabled = true;
+	return 0;
+}
+
+void uninit_pipeline(struct pipeline *pipe)
+{
+	struct packet_data *packet = NULL;
+
+	// Anything still queued never made it out
+	if(pipe->classifyRing.slots != NULL)
+		while((packet = (struct packet_data*)spsc_pop(&pipe->classifyRing)) != NULL)
+			free_packet(packet);
+	if(pipe->workRing.slots != NULL)
+		while((packet = (struct packet_data*)spsc_pop(&pipe->workRing)) != NULL)
+			free_packet(packet);
+	if(pipe->txRing.slots != NULL)
+		while((packet = (struct packet_data*)spsc_pop(&pipe->txRing)) != NULL)
+			free_packet(packet);
+
+	uninit_spsc_ring(&pipe->classifyRing);
+	uninit_spsc_ring(&pipe->workRing);
+	uninit_spsc_ring(&pipe->txRing);
+
+	// Only once nothing is queued, the rings may have held its packets
+	uninit_packet_pool(&pipe->workPool);
+
+	pipe->enabled = false;
+}
+
+int start_pipeline(struct receive_thread_data *data)
+{
+	struct pipeline *pipe = &data->pipe;
+
+	if(pthread_create(&pipe->classifyThread, NULL, classify_thread, data) != 0
+		|| pthread_create(&pipe->workThread, NULL, work_thread, data) != 0
+		|| pthread_create(&pipe->txThread, NULL, transmit_thread, data) != 0)
+	{
+		arglog(LOG_DEBUG, "Unable to create pipeline threads for %s\n", data->dev);
+		return -ARG_INTERNAL_ERROR;
+	}
+
+	return 0;
+}
+
+void join_pipeline(struct pipeline *pipe)
+{
+	if(pipe->classifyThread != 0)
+	{
+		pthread_join(pipe->classifyThread, NULL);
+		pipe->classifyThread = 0;
+	}
+	if(pipe->workThread != 0)
+	{
+		pthread_join(pipe->workThread, NULL);
+		pipe->workThread = 0;
+	}
+	if(pipe->txThread != 0)
+	{
+		pthread_join(pipe->txThread, NULL);
+		pipe->txThread = 0;
+	}
+}
+
+// Hands item to the next stage. Capture never waits (canWait false), later
+// stages wait for room if the policy says so, which in turn backs up into
+// the capture ring. Returns false if item was not queued and must be freed
+static bool stage_push(struct pipeline *pipe, struct spsc_ring *ring, struct stage_stats *stats,
+					   void *item, bool canWait)
+{
+	if(spsc_push(ring, item))
+		return true;
+
+	stats->stalls++;
+
+	if(canWait && pipe->fullPolicy == PIPELINE_FULL_WAIT)
+	{
+		while(receiveShouldRun)
+		{
+			sched_yield();
+			if(spsc_push(ring, item))
+				return true;
+		}
+	}
+
+	stats->dropped++;
+	return false;
+}
+
+// Backs off while a stage's input ring is empty. Yields for a while to keep
+// latency low under load, then sleeps so idle stages don't burn a core
+static void stage_idle(unsigned int *idleCount)
+{
+	struct timespec pause = { .tv_sec = 0, .tv_nsec = PIPELINE_IDLE_SLEEP };
+
+	if((*idleCount)++ < PIPELINE_IDLE_SPINS)
+		sched_yield();
+	else
+		nanosleep(&pause, NULL);
+}
+
+void queue_frame(void *tData, uint8_t *frame, unsigned long len, const struct timespec *tstamp)
+{
+	struct receive_thread_data *data = (struct receive_thread_data*)tData;
+	struct packet_data wire;
+	struct packet_data *packet = NULL;
+
+	data->stats.frames++;
+	data->stats.bytes += len;
+
+	// Capture buffers go back to the kernel as soon as we return
+	wire.data = frame;
+	wire.len = len;
+	wire.linkLayerLen = data->frameHeadLen;
+	wire.tstamp = *tstamp;
+	wire.buf = NULL;
+	wire.bufLen = 0;
+	wire.pool = NULL;
+
+	// Parsing only reads, so it's done before the copy rather than after.
+	// Anything classify_thread() would throw away isn't worth copying
+	if(parse_packet(&wire) || (!packet_ipv4(&wire) && !packet_arp(&wire)))
+	{
+		data->stats.ignored++;
+		return;
+	}
+
+	packet = copy_packet(&wire);
+	if(packet == NULL)
+	{
+		data->pipe.capture.dropped++;
+		return;
+	}
+
+	packet->tstamp = *tstamp;
+
+	if(!stage_push(&data->pipe, &data->pipe.classifyRing, &data->pipe.capture, packet, false))
+	{
+		free_packet(packet);
+		return;
+	}
+
+	data->pipe.capture.processed++;
+}
+
+void *classify_thread(void *tData)
+{
+	struct receive_thread_data *data = (struct receive_thread_data*)tData;
+	struct pipeline *pipe = &data->pipe;
+	struct packet_data *packet = NULL;
+	unsigned int idle = 0;
+
+	while(receiveShouldRun)
+	{
+		packet = (struct packet_data*)spsc_pop(&pipe->classifyRing);
+		if(packet == NULL)
+		{
+			stage_idle(&idle);
+			continue;
+		}
+
+		idle = 0;
+		pipe->classify.processed++;
+
+		// ARP is answered right here, it never needs the slow path
+		if(packet_arp(packet))
+		{
+			send_arp_reply(packet, data->devIndex, data->hwaddr);
+			free_packet(packet);
+		}
+		else if(!packet_ipv4(packet))
+			free_packet(packet);
+		else if(data->captureMode == CAPTURE_TUN && !frame_wanted(packet, true))
+			free_packet(packet);
+		else if(!stage_push(pipe, &pipe->workRing, &pipe->classify, packet, true))
+			free_packet(packet);
+	}
+
+	arglog(LOG_DEBUG, "Classify stage on %s (worker %i): %lu processed, %lu dropped, %lu stalls\n",
+		data->dev, data->worker, pipe->classify.processed, pipe->classify.dropped, pipe->classify.stalls);
+
+	return NULL;
+}
+
+int pipeline_send_hook(void *tData, const struct packet_data *packet)
+{
+	struct receive_thread_data *data = (struct receive_thread_data*)tData;
+	struct packet_data *copy = NULL;
+
+	// Callers free their packet as soon as the send returns
+	copy = copy_packet(packet);
+	if(copy == NULL)
+		return -ENOMEM;
+
+	if(!stage_push(&data->pipe, &data->pipe.txRing, &data->pipe.work, copy, true))
+	{
+		free_packet(copy);
+		return -ENOBUFS;
+	}
+
+	return 0;
+}
+
+void *work_thread(void *tData)
+{
+	struct receive_thread_data *data = (struct receive_thread_data*)tData;
+	struct pipeline *pipe = &data->pipe;
+	struct packet_data *packet = NULL;
+	struct pool_stats poolStats;
+	unsigned int idle = 0;
+
+	// Everything the handlers send goes through the transmit stage
+	set_send_hook(pipeline_send_hook, data);
+	set_packet_pool(&pipe->workPool);
+
+	while(receiveShouldRun)
+	{
+		packet = (struct packet_data*)spsc_pop(&pipe->workRing);
+		if(packet == NULL)
+		{
+			stage_idle(&idle);
+			continue;
+		}
+
+		idle = 0;
+		pipe->work.processed++;
+
+		if(data->handler != NULL)
+			(*data->handler)(packet);
+
+		free_packet(packet);
+	}
+
+	set_send_hook(NULL, NULL);
+	set_packet_pool(NULL);
+
+	get_pool_stats(&pipe->workPool, &poolStats);
+	arglog(LOG_DEBUG, "Crypto/NAT stage on %s (worker %i): %lu processed, %lu dropped, %lu stalls, "
+		"%u of %u buffers at most, %lu refused\n",
+		data->dev, data->worker, pipe->work.processed, pipe->work.dropped, pipe->work.stalls,
+		poolStats.highWater, poolStats.capacity, poolStats.exhausted);
+
+	return NULL;
+}
+
+void *transmit_thread(void *tData)
+{
+	struct receive_thread_data *data = (struct receive_thread_data*)tData;
+	struct pipeline *pipe = &data->pipe;
+	struct packet_data *packet = NULL;
+	struct send_stats sendStats;
+	unsigned int idle = 0;
+
+	if(data->egressTun != NULL)
+		set_send_hook(tun_send_hook, data);
+
+	if(init_send_queue(data->sendBatch, data->sendFlush) < 0)
+		arglog(LOG_DEBUG, "Sending unbatched on %s (worker %i)\n", data->dev, data->worker);
+
+	while(receiveShouldRun)
+	{
+		packet = (struct packet_data*)spsc_pop(&pipe->txRing);
+		if(packet == NULL)
+		{
+			// Ring has run dry, so the burst is over
+			flush_send_queue();
+			stage_idle(&idle);
+			continue;
+		}
+
+		idle = 0;
+		pipe->transmit.processed++;
+
+		// Ours from here, so the queue can send it without a copy
+		if(send_packet_owned(packet) < 0)
+			pipe->transmit.dropped++;
+	}
+
+	set_send_hook(NULL, NULL);
+	uninit_send_queue();
+
+	get_send_stats(&sendStats);
+	log_send_stats(data->dev, data->worker, &sendStats);
+	arglog(LOG_DEBUG, "Transmit stage on %s (worker %i): %lu processed, %lu failed, %lu bytes sent\n",
+		data->dev, data->worker, pipe->transmit.processed, pipe->transmit.dropped, sendStats.bytes);
 
 	return NULL;
 }
 
-void direct_inbound(const struct packet_data *packet)
+void direct_inbound(struct packet_data *packet)
 {
 	int ret = 0;
 	struct arg_network_info *gate = NULL;
 	char error[MAX_ERROR_STR_LEN];
 	
 	// Is this packet from a connected and authenticated ARG network?
-	gate = get_arg_network(&packet->ipv4->saddr);
+	gate = get_arg_network(&packet_ipv4(packet)->saddr);
 	if(gate != NULL)
 	{
-		if(packet->arg == NULL)
+		if(packet_arg(packet) == NULL)
 		{
 			arglog_result(packet, NULL, 1, 0, "Admin", "bad protocol");
 			return;
 		}
 
-		if(is_admin_msg(packet->arg))
+		if(is_admin_msg(packet_arg(packet)))
 		{
 			if((ret = process_admin_msg(packet, gate)) < 0)
 			{
@@ -312,19 +1398,19 @@ void direct_inbound(const struct packet_data *packet)
 			}
 
 			// Ensure the IPs were correct
-			if(!is_valid_local_ip((uint8_t*)&packet->ipv4->daddr))
+			if(!is_valid_local_ip((uint8_t*)&packet_ipv4(packet)->daddr))
 			{
 				arglog_result(packet, NULL, 1, 0, "Hopper", "Dest IP Incorrect");
-				//invalid_local_ip_direction((uint8_t*)&packet->ipv4->daddr);
+				//invalid_local_ip_direction((uint8_t*)&packet_ipv4(packet)->daddr);
 
 				note_bad_ip(gate);
 				return;
 			}
 			
-			if(!is_valid_ip(gate, (uint8_t*)&packet->ipv4->saddr))
+			if(!is_valid_ip(gate, (uint8_t*)&packet_ipv4(packet)->saddr))
 			{
 				arglog_result(packet, NULL, 1, 0, "Hopper", "Source IP Incorrect");
-				//invalid_ip_direction(gate, (uint8_t*)&packet->ipv4->saddr);
+				//invalid_ip_direction(gate, (uint8_t*)&packet_ipv4(packet)->saddr);
 				note_bad_ip(gate);
 				return;
 			}
@@ -352,14 +1438,14 @@ void direct_inbound(const struct packet_data *packet)
 	}
 }
 
-void direct_outbound(const struct packet_data *packet)
+void direct_outbound(struct packet_data *packet)
 {
 	char error[MAX_ERROR_STR_LEN];
 	int ret;
 	struct arg_network_info *gate = NULL;
 
 	// Who should handle it?
-	gate = get_arg_network(&packet->ipv4->daddr);
+	gate = get_arg_network(&packet_ipv4(packet)->daddr);
 	if(gate != NULL)
 	{
 		// Destined for an ARG network
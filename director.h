@@ -5,28 +5,160 @@
 #include <pthread.h>
 
 #include "protocol.h"
+#include "tpacket.h"
+#include "xsk.h"
+#include "spsc.h"
+#include "tun.h"
+#include "pool.h"
 
 #define MAX_FILTER_LEN 150
 
+// Hop-aware external filters list individual hosts, so need more room.
+// Past these counts we fall back to matching the whole range
+#define MAX_HOP_FILTER_LEN 4096
+#define MAX_FILTER_HOSTS 32
+#define MAX_FILTER_GATES 16
+
+// How long after a hop to swap filters (ms). The next IP is always
+// included, so this only needs to cover scheduling delays
+#define HOP_FILTER_DELAY 5
+
 #define IFACE_EXTERNAL 0
 #define IFACE_INTERNAL 1
 
 struct packet_data;
 
+// Per-worker counters. Only touched by the owning thread
+typedef struct worker_stats {
+	uint64_t frames;
+	uint64_t bytes;
+	uint64_t ignored;
+} worker_stats;
+
+// Counters for one stage of the pipeline. Only written by the stage's own thread
+typedef struct stage_stats {
+	uint64_t processed;
+	uint64_t dropped; // Discarded because the next ring was full (or the send failed)
+	uint64_t stalls; // Times the next ring was found full
+} stage_stats;
+
+// When enabled, a worker's processing is split across threads connected by
+// bounded SPSC rings: capture (the receive thread) -> classify -> crypto/NAT
+// -> transmit. A slow admin message or send then only stalls its own stage
+typedef struct pipeline {
+	bool enabled;
+	int fullPolicy;
+
+	struct spsc_ring classifyRing;
+	struct spsc_ring workRing;
+	struct spsc_ring txRing;
+
+	pthread_t classifyThread;
+	pthread_t workThread;
+	pthread_t txThread;
+
+	struct stage_stats capture;
+	struct stage_stats classify;
+	struct stage_stats work;
+	struct stage_stats transmit;
+
+	// Buffers for packets the crypto/NAT stage builds
+	struct packet_pool workPool;
+} pipeline;
+
 // Structure for passing data to newly created threads
 typedef struct receive_thread_data
 {
 	pcap_t *pd;
+	struct tpacket_ring ring;
+	struct xsk_socket xsk;
+	struct xsk_port port;
+	struct tun_queue tun;
+	int captureMode;
+
+	// Waits on the capture fd and the shutdown event
+	int epollFd;
+	int busyPoll; // Microseconds, 0 if disabled
+
+	// Send queue settings for whichever thread transmits, see init_send_queue()
+	int sendBatch;
+	int sendFlush;
+
+	// Frame handler pcap_dispatch() callbacks pass on to
+	tpacket_handler pcapHandler;
+
+	// Queue packets for the internal network are written to, if it's a TUN device
+	struct tun_queue *egressTun;
+
 	char dev[10];
-	void (*handler)(const struct packet_data*);
+	void (*handler)(struct packet_data*);
 	char ifaceSide;
 	pthread_t thread;
+	int worker;
+
+	struct worker_stats stats;
+	struct send_stats sendStats;
+
+	// Buffers for packets this thread builds
+	struct packet_pool pool;
+
+	struct pipeline pipe;
+
+	// Cached interface details, filled in when the thread starts
+	int devIndex;
+	uint8_t hwaddr[ETH_ALEN];
+	int frameHeadLen;
+	int frameHeadroom; // Writable space in front of frames, -1 if they're read-only
 } receive_thread_data;
 
 // Initialization functions
 void init_director_locks(void);
 int init_director(struct config_data *config);
+void init_thread_data(struct receive_thread_data *data, const char *dev, char ifaceSide,
+					  int worker, const struct config_data *config);
+int init_worker_capture(struct receive_thread_data *data, const struct config_data *config);
+void uninit_worker_capture(struct receive_thread_data *data);
 int init_pcap_driver(pcap_t **pd, char *dev, bool is_internal);
+int init_ring_driver(struct tpacket_ring *ring, char *dev, bool is_internal, const struct config_data *config);
+int init_xdp_driver(const struct config_data *config);
+void uninit_xdp_driver(void);
+
+// Writes packets headed into our network to the TUN device
+int tun_send_hook(void *tData, const struct packet_data *packet);
+
+// Event loop. dispatch_frames() handles whatever is ready without blocking,
+// wait_for_frames() sleeps until there's more (or spins, when busy polling)
+int capture_fd(const struct receive_thread_data *data);
+int init_worker_events(struct receive_thread_data *data, const struct config_data *config);
+void wait_for_frames(struct receive_thread_data *data);
+int dispatch_frames(struct receive_thread_data *data, tpacket_handler handler);
+void handle_pcap_frame(u_char *user, const struct pcap_pkthdr *header, const u_char *wireData);
+
+// Adds a capture socket to this side's PACKET_FANOUT group, spreading
+// flows across the workers
+int join_fanout(int fd, const char *dev, char ifaceSide);
+
+// Creates the capture filter for the given side of the gateway
+void build_filter(char *filter, int len, bool is_internal);
+int compile_filter(struct bpf_program *fp, const char *filter);
+
+// External filter that only accepts wrapped ARG traffic for our previous,
+// current, and next IPs, admin traffic from known gates, and other traffic
+// for IPs NAT is using. Returns negative if it won't fit in len
+int build_hop_filter(char *filter, int len);
+
+// Swaps the hop-aware filter onto every external capture socket
+int update_hop_filters(void);
+
+// Rebuilds the external filters at each hop
+void *hop_filter_thread(void *unused);
+
+// Userspace version of build_filter(), for when the XDP program hands us
+// everything on the queue. Returns true if the frame should be processed
+bool frame_wanted(const struct packet_data *packet, bool is_internal);
+
+// Sends packets out the other side's XDP socket when they are headed that way
+int xdp_send_hook(void *tData, const struct packet_data *packet);
 
 int uninit_director(void);
 
@@ -36,11 +168,28 @@ void join_director(void);
 // Receive data from a given interface
 void *receive_thread(void *tData);
 
+// Parses a single captured frame and passes it on to the interface handler
+void handle_frame(void *tData, uint8_t *frame, unsigned long len, const struct timespec *tstamp);
+
+// Pipelined processing. queue_frame() is the capture stage's handler, the
+// rest run in their own threads started by start_pipeline()
+int init_pipeline(struct pipeline *pipe, const struct config_data *config);
+void uninit_pipeline(struct pipeline *pipe);
+int start_pipeline(struct receive_thread_data *data);
+void join_pipeline(struct pipeline *pipe);
+void queue_frame(void *tData, uint8_t *frame, unsigned long len, const struct timespec *tstamp);
+void *classify_thread(void *tData);
+void *work_thread(void *tData);
+void *transmit_thread(void *tData);
+
+// Queues everything the crypto/NAT stage sends for the transmit stage
+int pipeline_send_hook(void *tData, const struct packet_data *packet);
+
 // Take traffic received on the external interface and process
-void direct_inbound(const struct packet_data *packet);
+void direct_inbound(struct packet_data *packet);
 
 // Take traffic received on the internal interface and process
-void direct_outbound(const struct packet_data *packet);
+void direct_outbound(struct packet_data *packet);
 
 #endif
 
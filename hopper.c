@@ -1,3 +1,6 @@
+// For pthread_rwlockattr_setkind_np()
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <time.h>
 #include <unistd.h>
@@ -17,6 +20,8 @@
 #include "arg_error.h"
 #include "utility.h"
 #include "crypto.h"
+#include "totp.h"
+#include "lpm.h"
 
 /**************************
 IP Hopping data
@@ -24,9 +29,16 @@ IP Hopping data
 static arg_network_info *gateInfo = NULL;
 static pthread_mutex_t networksLock;
 
+// Gates by network, for get_arg_network(). Changed under networksLock.
+// irregularMasks is set if any gate's mask isn't a plain prefix, in which
+// case the index can't be trusted to find it
+static struct lpm_table gateIndex;
+static bool irregularMasks = false;
+
 static pthread_mutex_t ipLock;
 
 static pthread_t connectThread;
+static pthread_t scheduleThread;
 
 void init_hopper_locks(void)
 {
@@ -79,6 +91,45 @@ void init_hopper_finish(void)
 {
 	arglog(LOG_DEBUG, "Starting connection/gateway auth thread\n");
 	pthread_create(&connectThread, NULL, hopper_admin_thread, NULL); // TBD check return
+	pthread_create(&scheduleThread, NULL, hop_schedule_thread, NULL); // TBD check return
+}
+
+void connect_gates_offline(void)
+{
+	struct arg_network_info *gate = NULL;
+
+	pthread_mutex_lock(&networksLock);
+
+	// Pretend every gate sent us our own connection data and time base,
+	// so wrapping works without ever talking to them
+	gate = gateInfo->next;
+	while(gate != NULL)
+	{
+		pthread_mutex_lock(&gate->lock);
+		pthread_rwlock_wrlock(&gate->keyLock);
+
+		memcpy(gate->symKey, gateInfo->symKey, sizeof(gate->symKey));
+		memcpy(gate->iv, gateInfo->iv, sizeof(gate->iv));
+		memcpy(gate->hopKey, gateInfo->hopKey, sizeof(gate->hopKey));
+		gate->hopInterval = gateInfo->hopInterval;
+		gate->timeBase = gateInfo->timeBase;
+
+		sym_key_set(&gate->sym, gate->symKey, sizeof(gate->symKey));
+		negotiate_arg_version(gateInfo, gate, arg_max_version());
+		pthread_rwlock_unlock(&gate->keyLock);
+		refresh_hop_schedule(gate);
+
+		current_time(&gate->lastDataUpdate);
+		gate->proto.connDataAvailable = true;
+		gate->proto.timeBaseAvailable = true;
+		gate->connected = true;
+
+		pthread_mutex_unlock(&gate->lock);
+
+		gate = gate->next;
+	}
+
+	pthread_mutex_unlock(&networksLock);
 }
 
 void uninit_hopper(void)
@@ -92,6 +143,13 @@ void uninit_hopper(void)
 		pthread_join(connectThread, NULL);
 		connectThread = 0;
 	}
+
+	if(scheduleThread != 0)
+	{
+		pthread_cancel(scheduleThread);
+		pthread_join(scheduleThread, NULL);
+		scheduleThread = 0;
+	}
 	
 	pthread_mutex_lock(&networksLock);
 	pthread_mutex_lock(&ipLock);
@@ -104,6 +162,9 @@ void uninit_hopper(void)
 		free(gateInfo);
 		gateInfo = NULL;
 	}
+
+	lpm_free(&gateIndex);
+	irregularMasks = false;
 	
 	pthread_mutex_unlock(&ipLock);
 	pthread_mutex_unlock(&networksLock);
@@ -114,8 +175,32 @@ void uninit_hopper(void)
 	arglog(LOG_DEBUG, "Hopper finished\n");
 }
 
+// Makes gate findable by get_arg_network(). Caller holds networksLock
+static int index_arg_network(struct arg_network_info *gate)
+{
+	int ret;
+	int prefixLen;
+	bool contiguous;
+
+	prefixLen = mask_prefix_len(sizeof(gate->mask), gate->mask, &contiguous);
+	if(!contiguous)
+	{
+		arglog(LOG_ALERT, "Mask for %s is not a prefix, gate lookups will be slower\n", gate->name);
+		irregularMasks = true;
+	}
+
+	if((ret = lpm_insert(&gateIndex, gate->baseIP, prefixLen, gate)) < 0)
+	{
+		arglog(LOG_DEBUG, "Unable to index %s, error %i\n", gate->name, ret);
+		return ret;
+	}
+
+	return 0;
+}
+
 int get_hopper_conf(const struct config_data *config)
 {
+	int ret;
 	struct gate_list *currGateName = NULL;
 
 	struct arg_network_info *currNet = NULL;
@@ -210,13 +295,10 @@ int get_hopper_conf(const struct config_data *config)
 	get_random_bytes(gateInfo->hopKey, sizeof(gateInfo->hopKey));
 	get_random_bytes(gateInfo->symKey, sizeof(gateInfo->symKey));
 
-	cipher_setkey(&gateInfo->cipher, gateInfo->symKey, sizeof(gateInfo->symKey) * 8, POLARSSL_DECRYPT);
-	md_hmac_starts(&gateInfo->md, gateInfo->symKey, sizeof(gateInfo->symKey));
-	
-	if(cipher_get_block_size(&gateInfo->cipher) != AES_BLOCK_SIZE)
+	if((ret = sym_key_set(&gateInfo->sym, gateInfo->symKey, sizeof(gateInfo->symKey))) != 0)
 	{
-		arglog(LOG_DEBUG, "WARNING!!! Cipher block size (%i) is not the same as compiled AES_BLOCK_SIZE (%i)\n",
-			cipher_get_block_size(&gateInfo->cipher), AES_BLOCK_SIZE);
+		arglog(LOG_DEBUG, "Unable to set up symmetric key, error %i\n", ret);
+		return ret;
 	}
 
 	// Rest of hop data
@@ -224,6 +306,52 @@ int get_hopper_conf(const struct config_data *config)
 	gateInfo->hopInterval = config->hopRate;
 	arglog(LOG_DEBUG, "Hop rate set to %lums\n", gateInfo->hopInterval);
 
+	pthread_mutex_lock(&gateInfo->lock);
+	refresh_hop_schedule(gateInfo);
+	pthread_mutex_unlock(&gateInfo->lock);
+
+	// Index everyone, us first so we win any tie
+	if((ret = lpm_init(&gateIndex, ADDR_SIZE)) < 0)
+	{
+		arglog(LOG_DEBUG, "Unable to create gate index\n");
+		return ret;
+	}
+
+	currNet = gateInfo;
+	while(currNet != NULL)
+	{
+		if((ret = index_arg_network(currNet)) < 0)
+			return ret;
+
+		currNet = currNet->next;
+	}
+
+	return 0;
+}
+
+int add_arg_network(struct arg_network_info *gate)
+{
+	int ret;
+
+	pthread_mutex_lock(&networksLock);
+
+	if((ret = index_arg_network(gate)) < 0)
+	{
+		pthread_mutex_unlock(&networksLock);
+		return ret;
+	}
+
+	// Hook it up after us
+	pthread_mutex_lock(&gateInfo->lock);
+	gate->next = gateInfo->next;
+	gate->prev = gateInfo;
+	if(gateInfo->next != NULL)
+		gateInfo->next->prev = gate;
+	gateInfo->next = gate;
+	pthread_mutex_unlock(&gateInfo->lock);
+
+	pthread_mutex_unlock(&networksLock);
+
 	return 0;
 }
 
@@ -267,16 +395,20 @@ void *hopper_admin_thread(void *data)
 			offset = time_offset(&gate->proto.pingSentTime, &curr);
 			if(gate->connected)
 			{
-				int prop = gate->proto.goodIPCount;
-				if(gate->proto.badIPCount != 0)	
-					prop = gate->proto.goodIPCount / gate->proto.badIPCount;
+				// Workers count these without the lock, see note_good_ip()
+				unsigned int good = gate->proto.goodIPCount;
+				unsigned int bad = gate->proto.badIPCount;
+
+				int prop = good;
+				if(bad != 0)
+					prop = good / bad;
 
 				if(MIN_VALID_IP_PROP > prop || offset > MAX_PING_TIME * 1000)
 				{
 					start_time_sync(gateInfo, gate);
 
-					gate->proto.goodIPCount = 0;
-					gate->proto.badIPCount = 0;
+					__sync_lock_test_and_set(&gate->proto.goodIPCount, 0);
+					__sync_lock_test_and_set(&gate->proto.badIPCount, 0);
 				}
 			}
 
@@ -311,6 +443,7 @@ void *hopper_admin_thread(void *data)
 struct arg_network_info *create_arg_network_info(void)
 {
 	struct arg_network_info *newInfo = NULL;
+	pthread_rwlockattr_t rwAttr;
 
 	newInfo = (struct arg_network_info*)malloc(sizeof(struct arg_network_info));
 	if(newInfo == NULL)
@@ -322,16 +455,21 @@ struct arg_network_info *create_arg_network_info(void)
 	// Clear it all out
 	memset(newInfo, 0, sizeof(struct arg_network_info));
 
-	// Init things that need it
+	// Init things that need it. Readers are every packet to or from the
+	// gate, so don't let them starve out a rekey
 	pthread_mutex_init(&newInfo->lock, NULL);
+	pthread_rwlockattr_init(&rwAttr);
+	pthread_rwlockattr_setkind_np(&rwAttr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&newInfo->keyLock, &rwAttr);
+	pthread_rwlockattr_destroy(&rwAttr);
 	rsa_init(&newInfo->rsa, RSA_PKCS_V15, 0);
 
-	cipher_init_ctx(&newInfo->cipher, cipher_info_from_string(SYMMETRIC_ALGO));
-	md_init_ctx(&newInfo->md, md_info_from_string(HASH_ALGO));
-
 	newInfo->hopInterval = UINT32_MAX;
+	hotp_key_set(&newInfo->hops.key, newInfo->hops.keyData, sizeof(newInfo->hops.keyData));
+	refresh_hop_schedule(newInfo);
+	newInfo->protoVersion = ARG_VERSION_HMAC;
 	newInfo->proto.outSeqNum = 1;
-	newInfo->proto.inSeqNum = 0;
+	replay_window_reset(&newInfo->proto.inWindow);
 
 	return newInfo;
 }
@@ -348,10 +486,12 @@ struct arg_network_info *remove_arg_network(struct arg_network_info *network)
 		network->prev->next = network->next;
 
 	pthread_mutex_destroy(&network->lock);
+	pthread_rwlock_destroy(&network->keyLock);
 
 	rsa_free(&network->rsa);
-	md_free_ctx(&network->md);
-	cipher_free_ctx(&network->cipher);
+	sym_key_free(&network->sym);
+	sym_key_free(&network->aeadOut);
+	sym_key_free(&network->aeadIn);
 
 	// Free us
 	free(network);
@@ -406,9 +546,9 @@ void print_network(const struct arg_network_info *network)
 	inet_ntop(AF_INET, network->baseIP, ip, sizeof(ip));
 	inet_ntop(AF_INET, network->mask, mask, sizeof(mask));
 
-	arglog(LOG_INFO, "  %s (%s, %s): %s, latency %i\n", network->name, ip, mask, 
-		network->connected ? "connected" : "disconnected",
-		network->proto.latency);
+	arglog(LOG_INFO, "  %s (%s, %s): %s, latency %i, %lu behind replay window, %lu replays\n",
+		network->name, ip, mask, network->connected ? "connected" : "disconnected",
+		network->proto.latency, network->proto.inWindow.windowDrops, network->proto.inWindow.replays);
 }
 
 void current_ip(uint8_t *ip)
@@ -418,6 +558,59 @@ void current_ip(uint8_t *ip)
 	pthread_mutex_unlock(&ipLock);
 }
 
+void get_hop_window(uint8_t *prev, uint8_t *curr, uint8_t *next)
+{
+	pthread_mutex_lock(&ipLock);
+	generate_ip_corrected(gateInfo, -gateInfo->hopInterval, prev);
+	generate_ip_corrected(gateInfo, 0, curr);
+	generate_ip_corrected(gateInfo, gateInfo->hopInterval, next);
+	pthread_mutex_unlock(&ipLock);
+}
+
+long time_to_next_hop(void)
+{
+	struct timespec now;
+	long offset = 0;
+	long interval = gateInfo->hopInterval;
+
+	if(interval <= 0)
+		interval = 1;
+
+	current_time(&now);
+	offset = time_offset(&gateInfo->timeBase, &now);
+
+	return interval - (offset % interval);
+}
+
+int get_gate_networks(uint8_t bases[][ADDR_SIZE], uint8_t masks[][ADDR_SIZE], int max)
+{
+	int count = 0;
+	struct arg_network_info *curr = NULL;
+
+	pthread_mutex_lock(&networksLock);
+
+	// Skip ourselves
+	curr = gateInfo->next;
+	while(curr != NULL)
+	{
+		if(count == max)
+		{
+			count = -1;
+			break;
+		}
+
+		memcpy(bases[count], curr->baseIP, ADDR_SIZE);
+		memcpy(masks[count], curr->mask, ADDR_SIZE);
+		count++;
+
+		curr = curr->next;
+	}
+
+	pthread_mutex_unlock(&networksLock);
+
+	return count;
+}
+
 bool is_valid_local_ip(const uint8_t *ip)
 {
 	return is_valid_ip(gateInfo, ip);
@@ -426,9 +619,6 @@ bool is_valid_local_ip(const uint8_t *ip)
 bool is_valid_ip(struct arg_network_info *gate, const uint8_t *ip)
 {
 	char ret = 0;
-
-	pthread_mutex_lock(&gate->lock);
-
 	uint8_t genIP[ADDR_SIZE];
 
 	generate_ip_corrected(gate, 0, genIP);
@@ -442,8 +632,6 @@ bool is_valid_ip(struct arg_network_info *gate, const uint8_t *ip)
 		else
 			ret = 0;
 	}
-	
-	pthread_mutex_unlock(&gate->lock);
 
 	return ret;
 }
@@ -479,14 +667,15 @@ int invalid_ip_direction(const arg_network_info *gate, const uint8_t *ip)
 	return dir;
 }
 
+// Any number of workers may count at once, holding only keyLock for reading
 void note_bad_ip(struct arg_network_info *gate)
 {
-	gate->proto.badIPCount++;
+	__sync_fetch_and_add(&gate->proto.badIPCount, 1);
 }
 
 void note_good_ip(struct arg_network_info *gate)
 {
-	gate->proto.goodIPCount++;
+	__sync_fetch_and_add(&gate->proto.goodIPCount, 1);
 }
 
 const uint8_t *gate_base_ip(void)
@@ -501,7 +690,7 @@ const uint8_t *gate_mask(void)
 
 int process_admin_msg(const struct packet_data *packet, struct arg_network_info *srcGate)
 {
-	switch(get_msg_type(packet->arg))
+	switch(get_msg_type(packet_arg(packet)))
 	{
 	case ARG_PING_MSG:
 		return process_arg_ping(gateInfo, srcGate, packet);
@@ -526,11 +715,9 @@ int process_admin_msg(const struct packet_data *packet, struct arg_network_info
 	return 0;
 }
 
-void generate_ip_corrected(const struct arg_network_info *gate, int correction, uint8_t *ip)
+// IP gate has during a hop epoch, given the HOTP value for that epoch
+static void hop_ip_from_bits(const struct arg_network_info *gate, uint32_t bits, uint8_t *ip)
 {
-	struct timespec currTime;
-	current_time(&currTime);
-
 	// Copy in top part of address. baseIP has already been masked to
 	// ensure it is zeros for the portion that changes, so we only have
 	// to copy it in
@@ -538,11 +725,6 @@ void generate_ip_corrected(const struct arg_network_info *gate, int correction,
 
 	// Apply random bits to remainder of IP. If we have fewer bits than
 	// needed for the mask, the extra remain 0. Sorry
-	//arglog(LOG_DEBUG, "Computing IP for %s, correction %i\n", gate->name, correction);
-
-	uint32_t bits = totp(gate->hopKey, sizeof(gate->hopKey), gate->hopInterval,
-		time_offset(&gate->timeBase, &currTime) + correction); 
-
 	int minLen = sizeof(gate->mask) < sizeof(bits) ? sizeof(gate->mask) : sizeof(bits);
 
 	uint8_t *bitIndex = (uint8_t*)&bits;
@@ -554,7 +736,184 @@ void generate_ip_corrected(const struct arg_network_info *gate, int correction,
 	}
 }
 
-int do_arg_wrap(const struct packet_data *packet, struct arg_network_info *destGate)
+// IP gate has during the given hop epoch, with its hop key already set up as key
+static void hop_ip_for_epoch(const struct arg_network_info *gate, const struct hotp_key *key,
+							 unsigned long epoch, uint8_t *ip)
+{
+	uint32_t bits;
+
+	hotp_batch(&key, &epoch, &bits, 1);
+	hop_ip_from_bits(gate, bits, ip);
+}
+
+// Epoch a time offset falls in, the same way totp() divides it up
+static unsigned long hop_epoch(long offset, uint32_t interval)
+{
+	if(interval == 0)
+		interval = 1;
+
+	return (unsigned long)offset / interval;
+}
+
+void refresh_hop_schedule(struct arg_network_info *gate)
+{
+	struct hop_schedule *hops = &gate->hops;
+	struct hotp_key key;
+	const struct hotp_key *keys[HOP_SCHEDULE_SIZE];
+	unsigned long epochs[HOP_SCHEDULE_SIZE];
+	uint32_t bits[HOP_SCHEDULE_SIZE];
+	uint8_t ips[HOP_SCHEDULE_SIZE][ADDR_SIZE];
+	struct timespec now;
+	unsigned long epoch;
+	unsigned long firstEpoch;
+	bool rekeyed;
+	int i = 0;
+
+	current_time(&now);
+	epoch = hop_epoch(time_offset(&gate->timeBase, &now), gate->hopInterval);
+	firstEpoch = (epoch > 0 ? epoch - 1 : 0);
+
+	// Everything is worked out before readers are held off. Only we write the
+	// schedule (callers hold gate->lock), so it can be read here without the seqlock.
+	// Most passes are only moving on in time
+	rekeyed = (memcmp(hops->keyData, gate->hopKey, sizeof(hops->keyData)) != 0);
+	if(rekeyed)
+		hotp_key_set(&key, gate->hopKey, sizeof(hops->keyData));
+	else
+		key = hops->key;
+
+	// Whole schedule at once, so the multi-buffer SHA1 lanes are full
+	for(i = 0; i < HOP_SCHEDULE_SIZE; i++)
+	{
+		keys[i] = &key;
+		epochs[i] = firstEpoch + i;
+	}
+	hotp_batch(keys, epochs, bits, HOP_SCHEDULE_SIZE);
+
+	for(i = 0; i < HOP_SCHEDULE_SIZE; i++)
+		hop_ip_from_bits(gate, bits[i], ips[i]);
+
+	// Readers retry while seq is odd or has moved
+	hops->seq++;
+	__sync_synchronize();
+
+	hops->timeBase = gate->timeBase;
+	hops->hopInterval = gate->hopInterval;
+	if(rekeyed)
+	{
+		memcpy(hops->keyData, gate->hopKey, sizeof(hops->keyData));
+		hops->key = key;
+	}
+	hops->firstEpoch = firstEpoch;
+	memcpy(hops->ips, ips, sizeof(hops->ips));
+	hops->count = HOP_SCHEDULE_SIZE;
+
+	__sync_synchronize();
+	hops->seq++;
+}
+
+// Fills ip from gate's hop schedule if it covers currTime + correction.
+// Returns false if it doesn't
+static bool lookup_hop_schedule(const struct hop_schedule *hops, const struct timespec *currTime,
+								int correction, uint8_t *ip)
+{
+	uint32_t seq;
+	unsigned long index;
+	bool found;
+
+	do
+	{
+		seq = hops->seq;
+		__sync_synchronize();
+
+		index = hop_epoch(time_offset(&hops->timeBase, currTime) + correction, hops->hopInterval)
+			- hops->firstEpoch;
+		found = (!(seq & 1) && index < hops->count);
+		if(found)
+			memcpy(ip, hops->ips[index], ADDR_SIZE);
+
+		__sync_synchronize();
+	} while((seq & 1) || seq != hops->seq);
+
+	return found;
+}
+
+void generate_ip_corrected(const struct arg_network_info *gate, int correction, uint8_t *ip)
+{
+	const struct hop_schedule *hops = &gate->hops;
+	struct hotp_key key;
+	struct timespec timeBase;
+	uint32_t hopInterval;
+	uint32_t seq;
+	struct timespec currTime;
+	current_time(&currTime);
+
+	if(lookup_hop_schedule(hops, &currTime, correction, ip))
+		return;
+
+	// Outside the schedule. Work it out from a consistent copy of what the
+	// schedule was built from, rather than the gate's own fields, which may
+	// be part way through a rekey. Callers (send_arg_wrapped()) can already
+	// hold keyLock for reading, so taking it again here could deadlock
+	// behind a waiting writer
+	do
+	{
+		seq = hops->seq;
+		__sync_synchronize();
+
+		key = hops->key;
+		timeBase = hops->timeBase;
+		hopInterval = hops->hopInterval;
+
+		__sync_synchronize();
+	} while((seq & 1) || seq != hops->seq);
+
+	//arglog(LOG_DEBUG, "Computing IP for %s, correction %i\n", gate->name, correction);
+	hop_ip_for_epoch(gate, &key, hop_epoch(time_offset(&timeBase, &currTime) + correction, hopInterval), ip);
+}
+
+void *hop_schedule_thread(void *data)
+{
+	struct arg_network_info *gate = NULL;
+	uint32_t shortest;
+	long wait;
+
+	arglog(LOG_DEBUG, "Hop schedule thread running\n");
+
+	while(true)
+	{
+		shortest = UINT32_MAX;
+
+		pthread_mutex_lock(&networksLock);
+
+		gate = gateInfo;
+		while(gate != NULL)
+		{
+			pthread_mutex_lock(&gate->lock);
+			refresh_hop_schedule(gate);
+			if(gate->hopInterval < shortest)
+				shortest = gate->hopInterval;
+			pthread_mutex_unlock(&gate->lock);
+
+			gate = gate->next;
+		}
+
+		pthread_mutex_unlock(&networksLock);
+
+		// Back well before the fastest-hopping gate runs off the end of its schedule
+		wait = (long)shortest * (HOP_SCHEDULE_SIZE / 4);
+		if(wait > HOP_SCHEDULE_MAX_WAIT)
+			wait = HOP_SCHEDULE_MAX_WAIT;
+		if(wait < 1)
+			wait = 1;
+
+		usleep(wait * 1000);
+	}
+
+	return NULL;
+}
+
+int do_arg_wrap(struct packet_data *packet, struct arg_network_info *destGate)
 {
 	// Ignore requests to ourselves
 	if(destGate == gateInfo)
@@ -563,15 +922,23 @@ int do_arg_wrap(const struct packet_data *packet, struct arg_network_info *destG
 	return send_arg_wrapped(gateInfo, destGate, packet);
 }
 
-int do_arg_unwrap(const struct packet_data *packet, struct arg_network_info *srcGate)
+int do_arg_unwrap(struct packet_data *packet, struct arg_network_info *srcGate)
 {
 	return process_arg_wrapped(gateInfo, srcGate, packet);
 }
 
 struct arg_network_info *get_arg_network(void const *ip)
 {
-	struct arg_network_info *curr = gateInfo;
+	struct arg_network_info *curr = lpm_lookup(&gateIndex, ip);
+
+	// The index is exact for prefix masks. Anything else has to be
+	// checked the slow way
+	if(curr != NULL && mask_array_cmp(sizeof(curr->baseIP), curr->mask, curr->baseIP, ip) == 0)
+		return curr;
+	if(!irregularMasks)
+		return NULL;
 
+	curr = gateInfo;
 	while(curr != NULL)
 	{
 		if(mask_array_cmp(sizeof(curr->baseIP), curr->mask, curr->baseIP, ip) == 0)
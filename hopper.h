@@ -9,16 +9,35 @@
 #include <polarssl/rsa.h>
 #include <polarssl/entropy.h>
 #include <polarssl/ctr_drbg.h>
-#include <polarssl/cipher.h>
-#include <polarssl/md.h>
 
 #include "utility.h"
 #include "uthash.h"
 #include "crypto.h"
+#include "totp.h"
 #include "packet.h"
 #include "protocol.h"
 #include "settings.h"
 
+// Hop addresses for the epochs around now (the previous one, the current one,
+// and those after), so finding an IP is a table lookup rather than a TOTP.
+// Rebuilt by the hop schedule thread and whenever the hop key or time base
+// change, and published with a seqlock: readers never block, they retry if
+// seq changed under them (or was odd, mid-update) while they read
+typedef struct hop_schedule {
+	uint32_t seq;
+
+	// Copies of what the epochs were worked out from. key is only redone
+	// when hopKey differs from keyData
+	struct timespec timeBase;
+	uint32_t hopInterval;
+	uint8_t keyData[HOP_KEY_SIZE];
+	struct hotp_key key;
+
+	unsigned long firstEpoch; // Epoch of ips[0]
+	int count; // Entries in ips, 0 if nothing is cached
+	uint8_t ips[HOP_SCHEDULE_SIZE][ADDR_SIZE];
+} hop_schedule;
+
 // Structure to hold data on associated ARG networks
 // All times here are given in jiffies for the current system, unless
 // otherwise specified
@@ -35,12 +54,24 @@ typedef struct arg_network_info {
 	// Lock
 	pthread_mutex_t lock;
 
+	// Guards what wrapping and unwrapping read: the keys, IV, version and hop
+	// information below. The data path only ever takes it for reading, so any
+	// number of threads can work on traffic for this gate at once. Anything
+	// changing those takes it for writing, while also holding lock
+	pthread_rwlock_t keyLock;
+
 	// Encryption keys and parameters
 	uint8_t symKey[AES_KEY_SIZE];
 	uint8_t iv[AES_BLOCK_SIZE];
 
-	cipher_context_t cipher;
-	md_context_t md;
+	// symKey, as prepared for AES-CTR and HMAC by the crypto provider
+	struct sym_key sym;
+
+	// Wrapped message format used with this gate (ARG_VERSION_*), and the
+	// AEAD keys for what we send it and what it sends us
+	uint8_t protoVersion;
+	struct sym_key aeadOut;
+	struct sym_key aeadIn;
 
 	rsa_context rsa;
 	entropy_context entropy;
@@ -51,6 +82,9 @@ typedef struct arg_network_info {
 	struct timespec timeBase;
 	uint32_t hopInterval;
 
+	// Addresses the above give around now. See refresh_hop_schedule()
+	struct hop_schedule hops;
+
 	// IP range information
 	uint8_t baseIP[ADDR_SIZE];
 	uint8_t mask[ADDR_SIZE];
@@ -66,15 +100,31 @@ int init_hopper(const struct config_data *config);
 void init_hopper_finish(void);
 void uninit_hopper(void);
 
+// Marks every known gate as connected using our own keys and time base,
+// without any admin traffic. Only for offline replay (see replay.h)
+void connect_gates_offline(void);
+
 // Retreives and sets known ARG network keys/local gateway keys, etc
 int get_hopper_conf(const struct config_data *config);
 
 // Does the initial connect to all of the gateways we know of
 void *hopper_admin_thread(void *data);
 
+// Keeps every gate's hop schedule covering the current time
+void *hop_schedule_thread(void *data);
+
+// Recomputes gate's hop schedule from its current hop key, interval and time
+// base. Caller must hold gate's lock, and call it after changing any of those
+void refresh_hop_schedule(struct arg_network_info *gate);
+
 // Manage the list of ARG networks. NOT synchronzied, caller should claim lock!
 struct arg_network_info *create_arg_network_info(void);
 struct arg_network_info *remove_arg_network(struct arg_network_info *network);
+
+// Adds a newly learned gate after ours, both to the list and to the index
+// get_arg_network() uses. Returns 0 or a negative error, in which case
+// gate is not added
+int add_arg_network(struct arg_network_info *gate);
 void remove_all_associated_arg_networks(void);
 
 void print_associated_networks(void);
@@ -88,6 +138,16 @@ void add_network(void);
 // so checks from that perspective should use is_valid_local_ip()
 void current_ip(uint8_t *ip);
 
+// Gives our IP for the previous, current, and next hop
+void get_hop_window(uint8_t *prev, uint8_t *curr, uint8_t *next);
+
+// Milliseconds until our IP next changes
+long time_to_next_hop(void);
+
+// Copies the base IP and mask of every gate we know of (except ourselves).
+// Returns the number copied, or -1 if there are more than max
+int get_gate_networks(uint8_t bases[][ADDR_SIZE], uint8_t masks[][ADDR_SIZE], int max);
+
 // Returns true if the given IP is valid, false otherwise
 bool is_valid_local_ip(const uint8_t *ip);
 bool is_valid_ip(struct arg_network_info *gate, const uint8_t *ip);
@@ -112,16 +172,20 @@ int process_admin_msg(const struct packet_data *packet, struct arg_network_info
 
 // Generates the current IP for the given gate, based on the current time plus
 // a given correction factor. Correction may be positive (in the future) or negative.
+// Takes no locks; answered from the hop schedule, unless the time asked for
+// isn't covered by it
 void generate_ip_corrected(const struct arg_network_info *gate, int correction, uint8_t *ip);
 
 // Wraps the given packet for the appropriate ARG network and signs it.
 // Returns false if the packet is not destined for a known
-// ARG network or another error occurs during processing
-int do_arg_wrap(const struct packet_data *packet, struct arg_network_info *destGate);
+// ARG network or another error occurs during processing.
+// Writable packets are wrapped in place and no longer hold the original
+int do_arg_wrap(struct packet_data *packet, struct arg_network_info *destGate);
 
 // Unwraps the given packet.
-// Returns false if the signature fails to match or another error occurs during processing
-int do_arg_unwrap(const struct packet_data *packet, struct arg_network_info *srcGate);
+// Returns false if the signature fails to match or another error occurs during processing.
+// Writable packets are decrypted in place and end up holding the inner packet
+int do_arg_unwrap(struct packet_data *packet, struct arg_network_info *srcGate);
 
 // Returns pointer to the ARG network the give IP belongs to
 struct arg_network_info *get_arg_network(void const *ip);
@@ -3,6 +3,8 @@
 #endif
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include <time.h>
 
 #include "settings.h"
@@ -10,6 +12,11 @@
 #include "director.h"
 #include "arg_error.h"
 #include "nat.h"
+#include "replay.h"
+#include "csum.h"
+#include "totp.h"
+#include "crypto.h"
+#include "antireplay.h"
 
 // Signal handler
 #ifdef HAVE_SIGNAL_H
@@ -21,8 +28,9 @@ void sig_handler(int signum)
 }
 #endif
 
-// Called when the module is initialized
-static int arg_init(char *configPath, char *gateName)
+// Called when the module is initialized. If replayPath is given, the
+// director is left off and the pcap file is replayed instead
+static int arg_init(char *configPath, char *gateName, char *replayPath, unsigned int loops)
 {
 	struct config_data conf;
 	time_t rawtime;
@@ -40,6 +48,12 @@ static int arg_init(char *configPath, char *gateName)
 	init_protocol_locks();
 	init_director_locks();
 
+	// Before anything might checksum a packet
+	init_csum();
+
+	// Before any hop addresses are worked out
+	init_totp();
+
 	// Read in main config
 	strncpy(conf.file, configPath, sizeof(conf.file) - 1);
 	if(read_config(&conf))
@@ -52,6 +66,16 @@ static int arg_init(char *configPath, char *gateName)
 	if(gateName != NULL)
 		strncpy(conf.ourGateName, gateName, sizeof(conf.ourGateName) - 1);
 
+	// Before any keys are set up
+	if(init_crypto(conf.cryptoProvider))
+	{
+		release_config(&conf);
+		return -ARG_CONFIG_BAD;
+	}
+
+	set_replay_window_size(conf.replayWindow);
+	set_log_results(conf.logResults);
+
 	// Init various components
 	if(init_hopper(&conf))
 	{
@@ -72,6 +96,13 @@ static int arg_init(char *configPath, char *gateName)
 		return -ARG_CONFIG_BAD;
 	}
 
+	if(replayPath != NULL)
+	{
+		connect_gates_offline();
+		release_config(&conf);
+		return run_replay(replayPath, loops);
+	}
+
 	// Hook network communication to listen for instructions
 	if(init_director(&conf))
 	{
@@ -112,6 +143,10 @@ static void arg_exit(void)
 
 int main(int argc, char *argv[])
 {
+	int opt;
+	char *replayPath = NULL;
+	unsigned int loops = 1;
+
 	#ifdef HAVE_SIGNAL_H
 	// Set up signal handler
 	struct sigaction action;
@@ -124,19 +159,36 @@ int main(int argc, char *argv[])
 	//sigaction (SIGTERM, &action, NULL);
 	#endif
 
-	if(argc != 2 && argc != 3)
+	while((opt = getopt(argc, argv, "r:n:")) != -1)
+	{
+		switch(opt)
+		{
+		case 'r':
+			replayPath = optarg;
+			break;
+		case 'n':
+			loops = atoi(optarg);
+			break;
+		default:
+			replayPath = NULL;
+			argc = 0;
+		}
+	}
+
+	if(argc - optind != 1 && argc - optind != 2)
 	{
-		arglog(LOG_DEBUG, "Usage: %s <conf path> [<gate name>]\n", argv[0]);
+		arglog(LOG_DEBUG, "Usage: %s [-r <pcap file> [-n <loops>]] <conf path> [<gate name>]\n", argv[0]);
 		return 1;
 	}
 
-	if(argc == 2)
-		arg_init(argv[1], NULL);
+	if(argc - optind == 1)
+		arg_init(argv[optind], NULL, replayPath, loops);
 	else
-		arg_init(argv[1], argv[2]);
+		arg_init(argv[optind], argv[optind + 1], replayPath, loops);
 	
 	// Run, waiting patiently
-	join_director();
+	if(replayPath == NULL)
+		join_director();
 	
 	arg_exit();
 	
@@ -0,0 +1,103 @@
+#include <stdlib.h>
+#include <errno.h>
+
+#include "lpm.h"
+
+int lpm_init(struct lpm_table *table, int addrLen)
+{
+	table->addrLen = addrLen;
+	table->root = (struct lpm_node*)calloc(1, sizeof(struct lpm_node));
+	if(table->root == NULL)
+		return -ENOMEM;
+
+	return 0;
+}
+
+static void lpm_free_node(struct lpm_node *node)
+{
+	int i = 0;
+
+	for(i = 0; i < LPM_FANOUT; i++)
+	{
+		if(node->children[i] != NULL)
+			lpm_free_node(node->children[i]);
+	}
+
+	free(node);
+}
+
+void lpm_free(struct lpm_table *table)
+{
+	if(table->root != NULL)
+		lpm_free_node(table->root);
+	table->root = NULL;
+}
+
+int lpm_insert(struct lpm_table *table, const void *prefix, int prefixLen, void *value)
+{
+	const uint8_t *bytes = (const uint8_t*)prefix;
+	struct lpm_node *node = table->root;
+	struct lpm_node *child = NULL;
+	int depth = 0;
+	int first = 0;
+	int count = 0;
+	int i = 0;
+
+	if(node == NULL || value == NULL || prefixLen < 0 || prefixLen > table->addrLen * 8)
+		return -EINVAL;
+
+	// Level holding the last bit of the prefix. /0 expands over all of the root
+	depth = (prefixLen > 0 ? (prefixLen - 1) / LPM_STRIDE : 0);
+
+	for(i = 0; i < depth; i++)
+	{
+		child = node->children[bytes[i]];
+		if(child == NULL)
+		{
+			child = (struct lpm_node*)calloc(1, sizeof(struct lpm_node));
+			if(child == NULL)
+				return -ENOMEM;
+
+			// Lookups may follow the pointer as soon as it's stored
+			__sync_synchronize();
+			node->children[bytes[i]] = child;
+		}
+
+		node = child;
+	}
+
+	// Every entry of the level the prefix covers, unless something longer is there
+	count = 1 << ((depth + 1) * LPM_STRIDE - prefixLen);
+	first = bytes[depth] & ~(count - 1);
+	for(i = first; i < first + count; i++)
+	{
+		if(node->values[i] == NULL || node->lens[i] < prefixLen)
+		{
+			node->lens[i] = prefixLen;
+			node->values[i] = value;
+		}
+	}
+
+	return 0;
+}
+
+void *lpm_lookup(const struct lpm_table *table, const void *addr)
+{
+	const uint8_t *bytes = (const uint8_t*)addr;
+	const struct lpm_node *node = table->root;
+	void *best = NULL;
+	void *value = NULL;
+	int i = 0;
+
+	for(i = 0; node != NULL && i < table->addrLen; i++)
+	{
+		value = node->values[bytes[i]];
+		if(value != NULL)
+			best = value;
+
+		node = node->children[bytes[i]];
+	}
+
+	return best;
+}
+
@@ -0,0 +1,47 @@
+#ifndef LPM_H
+#define LPM_H
+
+#include <stdint.h>
+
+// Address bits consumed by each level of the trie
+#define LPM_STRIDE 8
+#define LPM_FANOUT (1 << LPM_STRIDE)
+
+// One level of the trie, covering the next LPM_STRIDE bits of an address
+typedef struct lpm_node {
+	// Value of the longest prefix ending at this level that covers each entry
+	void *values[LPM_FANOUT];
+	struct lpm_node *children[LPM_FANOUT];
+
+	// Length of the prefix behind each value. Only inserts look at this
+	uint8_t lens[LPM_FANOUT];
+} lpm_node;
+
+// Longest-prefix-match table, a multibit trie with prefixes expanded out to
+// the end of their level. A lookup is one array access per byte of address,
+// however many prefixes there are.
+//
+// Lookups take no locks and may run alongside an insert. Inserts must be
+// serialized by the caller. Nothing is removed short of lpm_free(), so
+// lookups never see memory go away under them
+typedef struct lpm_table {
+	int addrLen;
+	struct lpm_node *root;
+} lpm_table;
+
+// Sets up an empty table for addrLen-byte addresses. Returns 0 or -ENOMEM
+int lpm_init(struct lpm_table *table, int addrLen);
+
+// Frees everything in table. No lookups may be running
+void lpm_free(struct lpm_table *table);
+
+// Maps the first prefixLen bits of prefix to value, which may not be NULL.
+// Where a prefix of the same length is already present, it stays. Returns
+// 0, -EINVAL for a bad length, or -ENOMEM
+int lpm_insert(struct lpm_table *table, const void *prefix, int prefixLen, void *value);
+
+// Value of the longest prefix covering addr, NULL if there's none
+void *lpm_lookup(const struct lpm_table *table, const void *addr);
+
+#endif
+
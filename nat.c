@@ -52,12 +52,14 @@ void uninit_nat(void)
 	arglog(LOG_DEBUG, "NAT finished\n");
 }
 
-int do_nat_inbound_rewrite(const struct packet_data *packet)
+int do_nat_inbound_rewrite(struct packet_data *packet)
 {
 	int ret;
 
-	struct packet_data *newPacket = NULL;
-	const struct iphdr *iph = packet->ipv4;
+	struct packet_data *newPacket = packet;
+	struct packet_data *copy = NULL;
+	const struct iphdr *iph = packet_ipv4(packet);
+	char inPacketID[MAX_PACKET_ID_SIZE] = "";
 
 	uint16_t port = 0;
 	
@@ -102,39 +104,46 @@ int do_nat_inbound_rewrite(const struct packet_data *packet)
 
 	pthread_mutex_unlock(&natTableLock);
 
-	// Change destination addr to the correct internal IP and port
-	newPacket = copy_packet(packet);
-	if(newPacket == NULL)
+	// Rewritten in place, so remember what it was
+	if(log_enabled(LOG_RESULTS))
+		create_packet_id(packet, inPacketID, sizeof(inPacketID));
+
+	// Only copy if we aren't allowed to touch the original
+	if(packet_headroom(packet) < 0)
 	{
-		arglog(LOG_DEBUG, "Unable to allocate memory for rewriten packet\n");
-		return -ENOMEM;
+		copy = copy_packet(packet);
+		if(copy == NULL)
+		{
+			arglog(LOG_DEBUG, "Unable to allocate memory for rewriten packet\n");
+			return -ENOMEM;
+		}
+
+		newPacket = copy;
 	}
 
-	memcpy((void*)&newPacket->ipv4->daddr, e->intIP, ADDR_SIZE);
-	set_dest_port(newPacket, e->intPort);
-	
-	// Fix checksums
-	udp_csum(newPacket);
-	tcp_csum(newPacket);
+	// Change destination addr to the correct internal IP and port
+	rewrite_dest(newPacket, e->intIP, e->intPort);
 
 	if((ret = send_packet(newPacket)) >= 0)
 	{
 		// Success
 		ret = 0;
-		arglog_result(packet, newPacket, 1, 1, "NAT", "rewrite");
+		arglog_result_id(inPacketID, newPacket, 1, 1, "NAT", "rewrite");
 	}
 
-	free_packet(newPacket);
+	free_packet(copy);
 
 	return ret;
 }
 
-int do_nat_outbound_rewrite(const struct packet_data *packet)
+int do_nat_outbound_rewrite(struct packet_data *packet)
 {
 	int ret;
 
-	struct packet_data *newPacket = NULL;
-	const struct iphdr *iph = packet->ipv4;
+	struct packet_data *newPacket = packet;
+	struct packet_data *copy = NULL;
+	const struct iphdr *iph = packet_ipv4(packet);
+	char inPacketID[MAX_PACKET_ID_SIZE] = "";
 	
 	uint16_t port = 0;
 
@@ -186,29 +195,34 @@ int do_nat_outbound_rewrite(const struct packet_data *packet)
 
 	pthread_mutex_unlock(&natTableLock);
 	
-	// Change source addr to the correct external IP and port
-	newPacket = copy_packet(packet);
-	if(newPacket == NULL)
+	// Rewritten in place, so remember what it was
+	if(log_enabled(LOG_RESULTS))
+		create_packet_id(packet, inPacketID, sizeof(inPacketID));
+
+	// Only copy if we aren't allowed to touch the original
+	if(packet_headroom(packet) < 0)
 	{
-		arglog(LOG_DEBUG, "Unable to rewrite packet\n");
-		return -ENOMEM;
+		copy = copy_packet(packet);
+		if(copy == NULL)
+		{
+			arglog(LOG_DEBUG, "Unable to rewrite packet\n");
+			return -ENOMEM;
+		}
+
+		newPacket = copy;
 	}
-	
-	memcpy((void*)&newPacket->ipv4->saddr, e->gateIP, ADDR_SIZE);
-	set_source_port(newPacket, e->gatePort);
 
-	// Fix checksums
-	udp_csum(newPacket);
-	tcp_csum(newPacket);
+	// Change source addr to the correct external IP and port
+	rewrite_source(newPacket, e->gateIP, e->gatePort);
 
 	if((ret = send_packet(newPacket)) >= 0)
 	{
 		// Success
 		ret = 0;
-		arglog_result(packet, newPacket, 0, 1, "NAT", "rewrite");
+		arglog_result_id(inPacketID, newPacket, 0, 1, "NAT", "rewrite");
 	}
 	
-	free_packet(newPacket);
+	free_packet(copy);
 
 	return ret;
 }
@@ -261,7 +275,7 @@ void print_nat_entry(const struct nat_entry *entry)
 
 struct nat_entry_bucket *create_nat_bucket(const struct packet_data *packet, const int key)
 {
-	const struct iphdr *iph = packet->ipv4;
+	const struct iphdr *iph = packet_ipv4(packet);
 	struct nat_entry_bucket *bucket = NULL;
 
 	// Create new bucket
@@ -285,7 +299,7 @@ struct nat_entry_bucket *create_nat_bucket(const struct packet_data *packet, con
 
 struct nat_entry *create_nat_entry(const struct packet_data *packet, struct nat_entry_bucket *bucket)
 {
-	const struct iphdr *iph = packet->ipv4;
+	const struct iphdr *iph = packet_ipv4(packet);
 
 	struct nat_entry *e = (struct nat_entry*)malloc(sizeof(struct nat_entry));
 	if(e == NULL)
@@ -387,6 +401,44 @@ struct nat_entry *remove_nat_entry(struct nat_entry *e)
 	return next;
 }
 
+int get_nat_gate_ips(uint8_t ips[][ADDR_SIZE], int max)
+{
+	int i = 0;
+	int count = 0;
+	struct nat_entry_bucket *b = NULL;
+	struct nat_entry *e = NULL;
+
+	pthread_mutex_lock(&natTableLock);
+
+	for(b = natTable; b != NULL && count >= 0; b = (struct nat_entry_bucket*)b->hh.next)
+	{
+		for(e = b->first; e != NULL; e = e->next)
+		{
+			// Most connections share a handful of IPs, only list each once
+			for(i = 0; i < count; i++)
+			{
+				if(memcmp(ips[i], e->gateIP, ADDR_SIZE) == 0)
+					break;
+			}
+
+			if(i < count)
+				continue;
+
+			if(count == max)
+			{
+				count = -1;
+				break;
+			}
+
+			memcpy(ips[count++], e->gateIP, ADDR_SIZE);
+		}
+	}
+
+	pthread_mutex_unlock(&natTableLock);
+
+	return count;
+}
+
 void *nat_cleanup_thread(void *data)
 {
 	arglog(LOG_DEBUG, "NAT cleanup thread running\n");
@@ -53,13 +53,19 @@ void uninit_nat(void);
 // Re-writes the given packet based on data in
 // the NAT table and returns true. If it is unable
 // to (i.e., there is no coresponding entry), false is returned.
-int do_nat_inbound_rewrite(const struct packet_data *packet);
+// Writable packets are rewritten in place
+int do_nat_inbound_rewrite(struct packet_data *packet);
 
 // Re-writes the given packet based on data in
 // the NAT table and returns true. If needed, a new
 // entry is created in the table based on the current IP
 // If it is unable to rewrite, false is returned.
-int do_nat_outbound_rewrite(const struct packet_data *packet);
+// Writable packets are rewritten in place
+int do_nat_outbound_rewrite(struct packet_data *packet);
+
+// Copies each distinct gateway IP that NAT connections are using. Returns
+// the number copied, or -1 if there are more than max
+int get_nat_gate_ips(uint8_t ips[][ADDR_SIZE], int max);
 
 // Displays all the data in the NAT table
 void print_nat_table(void);
@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <net/if_arp.h>
+#include <net/route.h>
+
+#include "neighbor.h"
+#include "settings.h"
+#include "utility.h"
+#include "arg_error.h"
+
+int init_neighbor_cache(struct neighbor_cache *cache, const char *dev)
+{
+	FILE *routeFile = NULL;
+	char line[MAX_CONF_LINE];
+	char iface[IFNAMSIZ + 1];
+	unsigned int dest, gateway, flags, mask;
+
+	memset(cache, 0, sizeof(struct neighbor_cache));
+	strncpy(cache->dev, dev, sizeof(cache->dev) - 1);
+
+	if((cache->sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+	{
+		arglog(LOG_DEBUG, "Unable to create socket for neighbor lookups\n");
+		return -errno;
+	}
+
+	// Remember which routes go out this device, so we know whether to resolve
+	// the destination itself or the gateway in front of it
+	routeFile = fopen("/proc/net/route", "r");
+	if(routeFile == NULL)
+	{
+		arglog(LOG_DEBUG, "Unable to read routing table: %s\n", strerror(errno));
+		return 0;
+	}
+
+	// Skip header
+	if(fgets(line, sizeof(line), routeFile) == NULL)
+	{
+		fclose(routeFile);
+		return 0;
+	}
+
+	while(cache->routeCount < MAX_NEIGHBOR_ROUTES && fgets(line, sizeof(line), routeFile) != NULL)
+	{
+		if(sscanf(line, "%16s %x %x %x %*d %*d %*d %x", iface, &dest, &gateway, &flags, &mask) != 5)
+			continue;
+
+		if(strcmp(iface, dev) != 0 || !(flags & RTF_UP))
+			continue;
+
+		cache->routes[cache->routeCount].dest = dest;
+		cache->routes[cache->routeCount].mask = mask;
+		cache->routes[cache->routeCount].gateway = (flags & RTF_GATEWAY) ? gateway : 0;
+		cache->routeCount++;
+	}
+
+	fclose(routeFile);
+
+	arglog(LOG_DEBUG, "Found %i routes through %s\n", cache->routeCount, dev);
+	return 0;
+}
+
+void uninit_neighbor_cache(struct neighbor_cache *cache)
+{
+	if(cache->sock > 0)
+	{
+		close(cache->sock);
+		cache->sock = 0;
+	}
+}
+
+// Picks the most specific route for ip and returns the address to resolve
+static uint32_t next_hop(const struct neighbor_cache *cache, uint32_t ip)
+{
+	int i = 0;
+	int best = -1;
+
+	for(i = 0; i < cache->routeCount; i++)
+	{
+		if((ip & cache->routes[i].mask) != cache->routes[i].dest)
+			continue;
+
+		if(best < 0 || ntohl(cache->routes[i].mask) > ntohl(cache->routes[best].mask))
+			best = i;
+	}
+
+	if(best < 0 || cache->routes[best].gateway == 0)
+		return ip;
+	else
+		return cache->routes[best].gateway;
+}
+
+int neighbor_lookup(struct neighbor_cache *cache, const uint8_t *ip, uint8_t *mac)
+{
+	struct timespec now;
+	struct arpreq req;
+	struct sockaddr_in *addr = NULL;
+	struct neighbor_entry *entry = NULL;
+	uint32_t hop;
+
+	memcpy(&hop, ip, sizeof(hop));
+	hop = next_hop(cache, hop);
+
+	current_time(&now);
+
+	entry = &cache->entries[(ntohl(hop) ^ (ntohl(hop) >> 8)) & (NEIGHBOR_CACHE_SIZE - 1)];
+	if(entry->valid && entry->ip == hop && time_offset(&now, &entry->expires) > 0)
+	{
+		memcpy(mac, entry->mac, ETH_ALEN);
+		return 0;
+	}
+
+	// Ask the kernel
+	memset(&req, 0, sizeof(req));
+	addr = (struct sockaddr_in*)&req.arp_pa;
+	addr->sin_family = AF_INET;
+	addr->sin_addr.s_addr = hop;
+	snprintf(req.arp_dev, sizeof(req.arp_dev), "%s", cache->dev);
+
+	if(ioctl(cache->sock, SIOCGARP, &req) < 0 || !(req.arp_flags & ATF_COM))
+	{
+		entry->valid = false;
+		return -ARG_ENTRY_NOT_FOUND;
+	}
+
+	entry->ip = hop;
+	memcpy(entry->mac, req.arp_ha.sa_data, ETH_ALEN);
+	current_time_plus(&entry->expires, NEIGHBOR_CACHE_TIME * 1000);
+	entry->valid = true;
+
+	memcpy(mac, entry->mac, ETH_ALEN);
+	return 0;
+}
+
@@ -0,0 +1,57 @@
+#ifndef NEIGHBOR_H
+#define NEIGHBOR_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include <net/if.h>
+#include <netinet/if_ether.h>
+
+#include "packet.h"
+
+// Number of routes we keep for a device and entries in the per-thread
+// neighbor cache (must be a power of 2)
+#define MAX_NEIGHBOR_ROUTES 16
+#define NEIGHBOR_CACHE_SIZE 256
+
+// Seconds a resolved MAC is trusted before asking the kernel again
+#define NEIGHBOR_CACHE_TIME 30
+
+// Route through a device, as read from /proc/net/route
+typedef struct neighbor_route {
+	uint32_t dest;
+	uint32_t mask;
+	uint32_t gateway;
+} neighbor_route;
+
+typedef struct neighbor_entry {
+	uint32_t ip;
+	uint8_t mac[ETH_ALEN];
+	struct timespec expires;
+	bool valid;
+} neighbor_entry;
+
+// Resolves IPs to the MAC of the next hop out of a device, for anything that
+// transmits frames itself rather than through the kernel's IP stack.
+// NOT synchronized, each sending thread should have its own
+typedef struct neighbor_cache {
+	char dev[IFNAMSIZ];
+	int sock;
+
+	struct neighbor_route routes[MAX_NEIGHBOR_ROUTES];
+	int routeCount;
+
+	struct neighbor_entry entries[NEIGHBOR_CACHE_SIZE];
+} neighbor_cache;
+
+int init_neighbor_cache(struct neighbor_cache *cache, const char *dev);
+void uninit_neighbor_cache(struct neighbor_cache *cache);
+
+// Finds the MAC of the next hop for ip (network order). Returns 0 if found,
+// negative if the kernel has no complete entry yet. In that case the packet
+// should be sent normally, which triggers resolution for the next one
+int neighbor_lookup(struct neighbor_cache *cache, const uint8_t *ip, uint8_t *mac);
+
+#endif
+
@@ -1,3 +1,6 @@
+// For sendmmsg()
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -10,93 +13,152 @@
 #include <net/if.h>
 #include <netinet/ether.h>
 #include <linux/if_packet.h>
+#include <sys/uio.h>
 
 #include <polarssl/md5.h>
 
 #include "packet.h"
+#include "csum.h"
 #include "arg_error.h"
 #include "protocol.h"
+#include "settings.h"
+#include "tpacket.h"
+#include "pool.h"
+#include "utility.h"
+
+// Packets waiting to go out together, see init_send_queue()
+typedef struct send_queue {
+	int batch;
+	int64_t flushNs;
+
+	// When the oldest waiting packet (of either kind) was queued
+	struct timespec first;
+
+	// IP packets for sendmmsg() on the raw socket. Packets handed over with
+	// send_packet_owned() are sent from where they sit and freed once flushed,
+	// anything else is copied into its slot's buffer
+	int count;
+	struct mmsghdr msgs[MAX_SEND_BATCH];
+	struct iovec iov[MAX_SEND_BATCH];
+	struct sockaddr_in addrs[MAX_SEND_BATCH];
+	struct packet_data *owned[MAX_SEND_BATCH];
+	uint8_t bufs[MAX_SEND_BATCH][SEND_SLOT_SIZE];
+
+	// Frames for specific devices. A ring with fd < 0 couldn't be
+	// created, frames for that device are sent immediately
+	struct tpacket_tx_ring rings[MAX_SEND_DEVICES];
+	int ringCount;
+	unsigned int ringPending;
+	uint64_t ringBytes;
+} send_queue;
+
+// Per-thread replacement for the raw socket, see set_send_hook()
+static __thread send_hook threadSendHook = NULL;
+static __thread void *threadSendHookArg = NULL;
+
+static __thread struct send_stats threadSendStats;
+
+// Each thread sends on its own sockets
+static __thread int ipSock = 0;
+static __thread int linkSock = 0;
+static __thread struct send_queue *threadSendQueue = NULL;
+
+// Where this thread's packets come from, see set_packet_pool()
+static __thread struct packet_pool *threadPool = NULL;
 
 int parse_packet(struct packet_data *packet)
 {
-	packet->eth = NULL;
-	packet->ipv4 = NULL;
-	packet->udp = NULL;
-	packet->tcp = NULL;
-	packet->icmp = NULL;
-	packet->arp = NULL;
-	packet->arg = NULL;
-	
-	packet->unknown_data = NULL;
+	struct iphdr *iph = NULL;
+	uint16_t proto = 0;
+	uint16_t offset = packet->linkLayerLen;
+
+	packet->layers = 0;
+	packet->transOffset = 0;
+	packet->unknownOffset = offset;
 	packet->unknown_len = 0;
 
+	if(packet->len < packet->linkLayerLen)
+		return -ARG_PACKET_PARSE_ERROR;
+
 	if(sizeof(struct ethhdr) == packet->linkLayerLen)
 	{
-		packet->eth = (struct ethhdr*)packet->data;
-		
-		if(ntohs(packet->eth->h_proto) == ETH_P_IP)
-		{
-			packet->ipv4 = (struct iphdr*)(packet->data + packet->linkLayerLen);
-			packet->unknown_data = (void*)((uint8_t*)packet->ipv4 + packet->ipv4->ihl * 4);
-		}
-		else if(ntohs(packet->eth->h_proto) == ETH_P_ARP)
+		packet->layers |= PKT_ETH;
+		proto = ntohs(((struct ethhdr*)packet->data)->h_proto);
+
+		if(proto == ETH_P_IP)
+			packet->layers |= PKT_IPV4;
+		else if(proto == ETH_P_ARP)
 		{
-			packet->arp = (struct ether_arp*)(packet->data + packet->linkLayerLen);
-			packet->unknown_data = (void*)((uint8_t*)packet->arp + sizeof(struct ether_arp));
+			packet->layers |= PKT_ARP;
+			packet->unknownOffset = offset + sizeof(struct ether_arp);
 		}
-		else if(ntohs(packet->eth->h_proto) == ETH_P_IPV6)
-		{
+		else if(proto == ETH_P_IPV6)
 			arglog(LOG_ALERT, "IPv6, sad day. Not handled\n");
-		}
 	}
 	else
 	{
 		// Assume IP
-		packet->ipv4 = (struct iphdr*)(packet->data + packet->linkLayerLen);
-		packet->unknown_data = (void*)((uint8_t*)packet->ipv4 + packet->ipv4->ihl * 4);
+		packet->layers |= PKT_IPV4;
 	}
 
-	// Parse IP packets further
-	if(packet->ipv4 != NULL)
+	// Parse IP packets further. Everything here comes off the wire, so no
+	// header may claim more than len, which is what was actually received
+	if(packet->layers & PKT_IPV4)
 	{
-		if(packet->ipv4->version != 4)
+		if(offset + sizeof(struct iphdr) > packet->len)
+			return -ARG_PACKET_PARSE_ERROR;
+
+		iph = (struct iphdr*)(packet->data + offset);
+		offset += iph->ihl * 4;
+		packet->unknownOffset = offset;
+
+		if(iph->version != 4 || iph->ihl < 5)
 			return -ARG_PACKET_PARSE_ERROR;
 
-		// Back up the packet length to skip the padding. If there is none/we're just ipv4,
-		// this step should have no impact
-		packet->len = packet->linkLayerLen + ntohs(packet->ipv4->tot_len);
+		// Back up the packet length to skip the padding. Never grow it
+		if(packet->linkLayerLen + ntohs(iph->tot_len) > packet->len)
+			return -ARG_PACKET_PARSE_ERROR;
+		packet->len = packet->linkLayerLen + ntohs(iph->tot_len);
 
-		void *transStart = (void*)((uint8_t*)packet->ipv4 + packet->ipv4->ihl*4);
+		if(offset > packet->len)
+			return -ARG_PACKET_PARSE_ERROR;
 
-		switch(packet->ipv4->protocol)
+		switch(iph->protocol)
 		{
 		case ARG_PROTO:
-			packet->arg = (struct arghdr*)transStart;
-			packet->unknown_data = (uint8_t*)transStart + sizeof(struct arghdr);
+			packet->layers |= PKT_ARG;
+			if(offset + ARG_DATA_HDR_LEN > packet->len)
+				return -ARG_PACKET_PARSE_ERROR;
+			packet->unknownOffset = offset + arg_hdr_len((struct arghdr*)(packet->data + offset));
 			break;
 
 		case TCP_PROTO:
-			packet->tcp = (struct tcphdr*)transStart;
-			packet->unknown_data = (uint8_t*)transStart + packet->tcp->doff * 4;
+			packet->layers |= PKT_TCP;
+			if(offset + sizeof(struct tcphdr) > packet->len)
+				return -ARG_PACKET_PARSE_ERROR;
+			packet->unknownOffset = offset + ((struct tcphdr*)(packet->data + offset))->doff * 4;
 			break;
 
 		case UDP_PROTO:
-			packet->udp = (struct udphdr*)transStart;
-			packet->unknown_data = (uint8_t*)transStart + sizeof(struct udphdr);
+			packet->layers |= PKT_UDP;
+			packet->unknownOffset = offset + sizeof(struct udphdr);
 			break;
 
 		case ICMP_PROTO:
-			packet->icmp = (struct icmphdr*)transStart;
-			packet->unknown_data = (uint8_t*)transStart + sizeof(struct icmphdr);
+			packet->layers |= PKT_ICMP;
+			packet->unknownOffset = offset + sizeof(struct icmphdr);
 			break;
-
-		default:
-			packet->unknown_data = (uint8_t*)transStart;
 		}
+
+		packet->transOffset = offset;
 	}
-	
+
+	// Transport headers (TCP options, the full ARG header) must fit too
+	if(packet->unknownOffset > packet->len)
+		return -ARG_PACKET_PARSE_ERROR;
+
 	// Ensure this length is correct
-	packet->unknown_len = packet->len - (packet->unknown_data - packet->data);
+	packet->unknown_len = packet->len - packet->unknownOffset;
 
 	return 0;
 }
@@ -107,7 +169,7 @@ void create_packet_id(const struct packet_data *packet, char *buf, int buflen)
 	char dIP[INET_ADDRSTRLEN];
 
 	// Can only work with IPv4 packets
-	if(packet->ipv4 == NULL)
+	if(packet_ipv4(packet) == NULL)
 	{
 		snprintf(buf, buflen, "Unable to generate ID");
 		return;
@@ -122,44 +184,44 @@ void create_packet_id(const struct packet_data *packet, char *buf, int buflen)
 
 	md5_starts(&ctx);
 
-	if(packet->ipv4)
+	if(packet_ipv4(packet))
 	{
 		//arglog(LOG_DEBUG, "Components:\n");
 
 		// IPv4 header except the checksum, ID, fragmentation, and TTL
 		// Reall this is the first 4 bytes, protocol, and everything after the checksum
-		md5_update(&ctx, (uint8_t*)packet->ipv4, 4);
-		md5_update(&ctx, &packet->ipv4->protocol, sizeof(packet->ipv4->protocol));
+		md5_update(&ctx, (uint8_t*)packet_ipv4(packet), 4);
+		md5_update(&ctx, &packet_ipv4(packet)->protocol, sizeof(packet_ipv4(packet)->protocol));
 
 		int sizeToCheck = 10;
-		md5_update(&ctx, (uint8_t*)packet->ipv4 + sizeToCheck + sizeof(packet->ipv4->check),
-			packet->ipv4->ihl*4 - sizeToCheck - sizeof(packet->ipv4->check));
+		md5_update(&ctx, (uint8_t*)packet_ipv4(packet) + sizeToCheck + sizeof(packet_ipv4(packet)->check),
+			packet_ipv4(packet)->ihl*4 - sizeToCheck - sizeof(packet_ipv4(packet)->check));
 
 		// Transport layer
-		if(packet->tcp)
+		if(packet_tcp(packet))
 		{
 			sizeToCheck = 16;
-			md5_update(&ctx, (uint8_t*)packet->tcp, sizeToCheck);
-			md5_update(&ctx, (uint8_t*)packet->tcp + sizeToCheck + sizeof(packet->tcp->check),
-				packet->tcp->doff*4 - sizeToCheck - sizeof(packet->tcp->check));
+			md5_update(&ctx, (uint8_t*)packet_tcp(packet), sizeToCheck);
+			md5_update(&ctx, (uint8_t*)packet_tcp(packet) + sizeToCheck + sizeof(packet_tcp(packet)->check),
+				packet_tcp(packet)->doff*4 - sizeToCheck - sizeof(packet_tcp(packet)->check));
 		}
-		else if(packet->udp)
+		else if(packet_udp(packet))
 		{
 			sizeToCheck = 6;
-			md5_update(&ctx, (uint8_t*)packet->udp, sizeToCheck);
+			md5_update(&ctx, (uint8_t*)packet_udp(packet), sizeToCheck);
 		}
-		else if(packet->icmp)
+		else if(packet_icmp(packet))
 		{
 			sizeToCheck = 2;
-			md5_update(&ctx, (uint8_t*)packet->icmp, sizeToCheck);
+			md5_update(&ctx, (uint8_t*)packet_icmp(packet), sizeToCheck);
 		}
-		else if(packet->arg)
+		else if(packet_arg(packet))
 		{
-			md5_update(&ctx, (uint8_t*)packet->arg, sizeof(struct arghdr));
+			md5_update(&ctx, (uint8_t*)packet_arg(packet), arg_hdr_len(packet_arg(packet)));
 		}
 
 		// Remainder
-		md5_update(&ctx, packet->unknown_data, packet->unknown_len);
+		md5_update(&ctx, packet_unknown(packet), packet->unknown_len);
 	}
 	else
 	{
@@ -176,10 +238,10 @@ void create_packet_id(const struct packet_data *packet, char *buf, int buflen)
 	md5sum[sizeof(md5sum) - 1] = '\0';
 
 	// Add rest of label for the IP packet
-	inet_ntop(AF_INET, &packet->ipv4->saddr, sIP, sizeof(sIP));
-	inet_ntop(AF_INET, &packet->ipv4->daddr, dIP, sizeof(dIP));
+	inet_ntop(AF_INET, &packet_ipv4(packet)->saddr, sIP, sizeof(sIP));
+	inet_ntop(AF_INET, &packet_ipv4(packet)->daddr, dIP, sizeof(dIP));
 	snprintf(buf, buflen, "p:%i s:%s:%i d:%s:%i hash:%s",
-		packet->ipv4->protocol, sIP, get_source_port(packet), dIP, get_dest_port(packet), md5sum);
+		packet_ipv4(packet)->protocol, sIP, get_source_port(packet), dIP, get_dest_port(packet), md5sum);
 }
 
 int get_mac_addr(const char *dev, uint8_t *mac)
@@ -225,9 +287,26 @@ int get_dev_index(char *dev)
 	return if_idx.ifr_ifindex;
 }
 
+void set_packet_pool(struct packet_pool *pool)
+{
+	threadPool = pool;
+}
+
 struct packet_data *create_packet(int len)
 {
 	struct packet_data *c = NULL;
+
+	// Exhausted pools are a hard limit, don't fall back
+	if(threadPool != NULL && len <= POOL_DATA_SIZE)
+	{
+		if((c = pool_get(threadPool, (len > 0 ? len : 0))) == NULL)
+			return NULL;
+
+		memset(c->data, 0, c->len);
+		parse_packet(c);
+		return c;
+	}
+
 	c = (struct packet_data*)malloc(sizeof(struct packet_data));
 	if(c == NULL)
 	{
@@ -237,6 +316,8 @@ struct packet_data *create_packet(int len)
 
 	c->len = 0;
 	c->linkLayerLen = 0;
+	c->data = NULL;
+	c->pool = NULL;
 	
 	if(len > 0)
 	{
@@ -250,13 +331,38 @@ struct packet_data *create_packet(int len)
 		}
 	}
 
+	c->buf = c->data;
+	c->bufLen = c->len;
+
 	parse_packet(c);
 	return c;
 }
 
+// Headers are found by offset, so a copy's layout is the same as the original's
+static void copy_layout(struct packet_data *c, const struct packet_data *packet)
+{
+	c->linkLayerLen = packet->linkLayerLen;
+	c->transOffset = packet->transOffset;
+	c->unknownOffset = packet->unknownOffset;
+	c->unknown_len = packet->unknown_len;
+	c->layers = packet->layers;
+	c->tstamp = packet->tstamp;
+}
+
 struct packet_data *copy_packet(const struct packet_data *packet)
 {
 	struct packet_data *c = NULL;
+
+	if(threadPool != NULL && packet->len <= POOL_DATA_SIZE)
+	{
+		if((c = pool_get(threadPool, packet->len)) == NULL)
+			return NULL;
+
+		copy_layout(c, packet);
+		memcpy(c->data, packet->data, c->len);
+		return c;
+	}
+
 	c = (struct packet_data*)malloc(sizeof(struct packet_data));
 	if(c == NULL)
 	{
@@ -273,105 +379,457 @@ struct packet_data *copy_packet(const struct packet_data *packet)
 	}
 
 	c->len = packet->len;
-	c->linkLayerLen = packet->linkLayerLen;
+	c->buf = c->data;
+	c->bufLen = c->len;
+	c->pool = NULL;
+	copy_layout(c, packet);
 	memcpy(c->data, packet->data, c->len);
+	return c;
+}
 
-	parse_packet(c);
+long packet_headroom(const struct packet_data *packet)
+{
+	if(packet->buf == NULL)
+		return -1;
+
+	return packet->data - packet->buf;
+}
+
+struct packet_data *copy_packet_headroom(const struct packet_data *packet, unsigned int headroom)
+{
+	struct packet_data *c = NULL;
+
+	// Pooled packets always have room
+	if(threadPool != NULL && headroom <= PACKET_HEADROOM && packet->len <= POOL_DATA_SIZE)
+		return copy_packet(packet);
+
+	c = create_packet(headroom + packet->len);
+	if(c == NULL)
+		return NULL;
+
+	c->data += headroom;
+	c->len = packet->len;
+	copy_layout(c, packet);
+	memcpy(c->data, packet->data, c->len);
 	return c;
 }
 
 void free_packet(struct packet_data *packet)
 {
+	if(packet != NULL && packet->pool != NULL)
+	{
+		pool_put(packet, packet->pool == threadPool);
+		return;
+	}
+
 	if(packet != NULL)
 	{
-		if(packet->data != NULL)
+		// data may have been moved into the headroom
+		if(packet->buf != NULL)
 		{
-			free(packet->data);
+			free(packet->buf);
 		}
 
 		free(packet);
 	}
 }
 
-int send_packet_on(int dev_index, const struct packet_data *packet)
+// Index of bucket v belongs in for the send histograms
+static int send_hist_bucket(uint64_t v)
 {
-	static int sock = 0;
-	struct sockaddr_ll addr;
+	int bucket = 0;
 
-	if(sock <= 0)
+	while(v > 1 && bucket < SEND_HIST_BUCKETS - 1)
 	{
-		sock = socket(AF_PACKET, SOCK_RAW, IPPROTO_RAW);
-		if(sock < 0)
+		v >>= 1;
+		bucket++;
+	}
+
+	return bucket;
+}
+
+int init_send_queue(int batch, int flushUsec)
+{
+	int i = 0;
+	struct send_queue *queue = NULL;
+
+	if(threadSendQueue != NULL)
+		uninit_send_queue();
+
+	if(batch <= 1)
+		return 0;
+
+	queue = (struct send_queue*)calloc(1, sizeof(struct send_queue));
+	if(queue == NULL)
+	{
+		arglog(LOG_DEBUG, "Unable to allocate send queue\n");
+		return -ENOMEM;
+	}
+
+	queue->batch = (batch > MAX_SEND_BATCH ? MAX_SEND_BATCH : batch);
+	queue->flushNs = (int64_t)flushUsec * 1000;
+
+	// Every message always refers to the same slot. Where its iov points
+	// depends on the packet, see send_ip_packet()
+	for(i = 0; i < MAX_SEND_BATCH; i++)
+	{
+		queue->msgs[i].msg_hdr.msg_iov = &queue->iov[i];
+		queue->msgs[i].msg_hdr.msg_iovlen = 1;
+		queue->msgs[i].msg_hdr.msg_name = &queue->addrs[i];
+		queue->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+	}
+
+	threadSendQueue = queue;
+	return 0;
+}
+
+void uninit_send_queue(void)
+{
+	int i = 0;
+	struct send_queue *queue = threadSendQueue;
+
+	if(queue == NULL)
+		return;
+
+	flush_send_queue();
+
+	for(i = 0; i < queue->ringCount; i++)
+		uninit_tpacket_tx_ring(&queue->rings[i]);
+
+	threadSendQueue = NULL;
+	free(queue);
+}
+
+void flush_send_queue(void)
+{
+	int i = 0;
+	int ret;
+	int sent = 0;
+	struct timespec now;
+	struct send_queue *queue = threadSendQueue;
+
+	if(queue == NULL || (queue->count == 0 && queue->ringPending == 0))
+		return;
+
+	current_time(&now);
+	threadSendStats.flushes++;
+	threadSendStats.batchHist[send_hist_bucket(queue->count + queue->ringPending)]++;
+	threadSendStats.latencyHist[send_hist_bucket(time_offset_ns(&queue->first, &now) / 1000)]++;
+
+	while(sent < queue->count)
+	{
+		ret = sendmmsg(ipSock, queue->msgs + sent, queue->count - sent, 0);
+		if(ret <= 0)
 		{
-			arglog(LOG_DEBUG, "Unable to create raw socket for sending\n");
-			return sock;
+			// sendmmsg() stops at the first failure. Skip it, as a lone sendto() would
+			arglog(LOG_DEBUG, "Batched send failed, errno %i. Msg size %lu\n",
+				errno, (unsigned long)queue->iov[sent].iov_len);
+			threadSendStats.failed++;
+			sent++;
+			continue;
+		}
+
+		for(i = sent; i < sent + ret; i++)
+			threadSendStats.bytes += queue->iov[i].iov_len;
+		threadSendStats.sent += ret;
+		sent += ret;
+	}
+
+	for(i = 0; i < queue->count; i++)
+	{
+		free_packet(queue->owned[i]);
+		queue->owned[i] = NULL;
+	}
+	queue->count = 0;
+
+	for(i = 0; i < queue->ringCount; i++)
+	{
+		if(queue->rings[i].pending == 0)
+			continue;
+
+		ret = queue->rings[i].pending;
+		if(tpacket_tx_flush(&queue->rings[i]) < 0)
+		{
+			arglog(LOG_DEBUG, "TX ring flush failed on dev %i: %i\n", queue->rings[i].ifindex, errno);
+			threadSendStats.failed += ret;
 		}
+		else
+			threadSendStats.sent += ret;
+	}
+
+	// Can't tell which ring a failure was on, close enough
+	threadSendStats.bytes += queue->ringBytes;
+	queue->ringPending = 0;
+	queue->ringBytes = 0;
+}
+
+// Notes when the first packet of a batch arrived
+static void send_queue_start(struct send_queue *queue)
+{
+	if(queue->count == 0 && queue->ringPending == 0)
+		current_time(&queue->first);
+}
+
+// Flushes the queue if it's full or has been waiting too long
+static void send_queue_check(struct send_queue *queue)
+{
+	struct timespec now;
+
+	if(queue->count + queue->ringPending >= queue->batch)
+	{
+		flush_send_queue();
+		return;
+	}
+
+	current_time(&now);
+	if(time_offset_ns(&queue->first, &now) >= queue->flushNs)
+		flush_send_queue();
+}
+
+// Finds (or opens) this thread's TX ring for the device
+static struct tpacket_tx_ring *send_queue_ring(struct send_queue *queue, int dev_index)
+{
+	int i = 0;
+	int ret;
+	struct tpacket_tx_ring *ring = NULL;
+
+	for(i = 0; i < queue->ringCount; i++)
+	{
+		if(queue->rings[i].ifindex == dev_index)
+			return (queue->rings[i].fd >= 0 ? &queue->rings[i] : NULL);
+	}
+
+	if(queue->ringCount >= MAX_SEND_DEVICES)
+		return NULL;
+
+	ring = &queue->rings[queue->ringCount++];
+	if((ret = init_tpacket_tx_ring(ring, dev_index, MAX_SEND_BATCH * 2)) < 0)
+	{
+		arglog(LOG_DEBUG, "Unable to create TX ring on dev %i (%i), sending directly\n", dev_index, ret);
+		return NULL;
 	}
 
-	if(!packet->eth)
+	return ring;
+}
+
+int send_packet_on(int dev_index, const struct packet_data *packet)
+{
+	struct sockaddr_ll addr;
+	struct send_queue *queue = threadSendQueue;
+	struct tpacket_tx_ring *ring = NULL;
+	int ret;
+
+	if(!packet_eth(packet))
 	{
 		arglog(LOG_ALERT, "Packtes may only be sent on a specific interface when ethernet header is given\n");
 		return -ARG_INTERNAL_ERROR;
 	}
 
+	if(queue != NULL && (ring = send_queue_ring(queue, dev_index)) != NULL)
+	{
+		send_queue_start(queue);
+
+		ret = tpacket_tx_queue(ring, packet->data, packet->len);
+		if(ret == -ENOBUFS)
+		{
+			// Kernel hasn't finished with the last lot yet
+			flush_send_queue();
+			send_queue_start(queue);
+			ret = tpacket_tx_queue(ring, packet->data, packet->len);
+		}
+
+		if(ret == 0)
+		{
+			queue->ringPending++;
+			queue->ringBytes += packet->len;
+			send_queue_check(queue);
+			return 0;
+		}
+	}
+
+	if(linkSock <= 0)
+	{
+		linkSock = socket(AF_PACKET, SOCK_RAW, IPPROTO_RAW);
+		if(linkSock < 0)
+		{
+			arglog(LOG_DEBUG, "Unable to create raw socket for sending\n");
+			return linkSock;
+		}
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sll_family = AF_PACKET;
+	addr.sll_protocol = htons(ETH_P_IP);
 	addr.sll_ifindex = dev_index;
 	addr.sll_halen = ETH_ALEN;
-	memcpy(addr.sll_addr, packet->eth->h_dest, sizeof(addr.sll_addr));
+	memcpy(addr.sll_addr, packet_eth(packet)->h_dest, ETH_ALEN);
 
-	if(sendto(sock, (uint8_t*)packet->data, packet->len, 0, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+	if(sendto(linkSock, (uint8_t*)packet->data, packet->len, 0, (struct sockaddr*)&addr, sizeof(addr)) < 0)
 	{
 		arglog(LOG_DEBUG, "Send failed on dev %i: %i\n", dev_index, errno);
+		threadSendStats.failed++;
 		return -errno;
 	}
 
+	threadSendStats.sent++;
+	threadSendStats.bytes += packet->len;
 	return 0;
 }
 
-int send_packet(const struct packet_data *packet)
+void set_send_hook(send_hook hook, void *arg)
+{
+	threadSendHook = hook;
+	threadSendHookArg = arg;
+}
+
+bool has_send_hook(void)
+{
+	return threadSendHook != NULL;
+}
+
+void get_send_stats(struct send_stats *stats)
+{
+	*stats = threadSendStats;
+}
+
+// Formats a histogram as "<bucket start>:<count>" for each non-empty bucket
+static void format_send_hist(const uint64_t *hist, char *buf, int buflen)
+{
+	int i = 0;
+	int pos = 0;
+	int ret;
+
+	buf[0] = '\0';
+	for(i = 0; i < SEND_HIST_BUCKETS && pos < buflen; i++)
+	{
+		if(hist[i] == 0)
+			continue;
+
+		ret = snprintf(buf + pos, buflen - pos, " %lu:%lu", 1UL << i, (unsigned long)hist[i]);
+		if(ret < 0)
+			break;
+		pos += ret;
+	}
+}
+
+void log_send_stats(const char *dev, int worker, const struct send_stats *stats)
+{
+	char batches[SEND_HIST_BUCKETS * 24];
+	char latency[SEND_HIST_BUCKETS * 24];
+
+	if(stats->flushes == 0)
+		return;
+
+	format_send_hist(stats->batchHist, batches, sizeof(batches));
+	format_send_hist(stats->latencyHist, latency, sizeof(latency));
+	arglog(LOG_DEBUG, "Send queue on %s (worker %i): %lu flushes, %.1f packets per flush\n",
+		dev, worker, stats->flushes, (double)(stats->sent + stats->failed) / stats->flushes);
+	arglog(LOG_DEBUG, "  batch sizes:%s\n", batches);
+	arglog(LOG_DEBUG, "  oldest wait (usec):%s\n", latency);
+}
+
+// Sends packet out the raw socket (or the hook). If owned is given it is
+// packet, and is freed once it has been sent
+static int send_ip_packet(const struct packet_data *packet, struct packet_data *owned)
 {
-	static int sock = 0;
 	struct sockaddr_in dest_addr;
+	struct send_queue *queue = threadSendQueue;
 	int len = 0;
+	int ret;
+
+	if(threadSendHook != NULL && (ret = (*threadSendHook)(threadSendHookArg, packet)) <= 0)
+	{
+		if(ret < 0)
+			threadSendStats.failed++;
+		else
+		{
+			threadSendStats.sent++;
+			threadSendStats.bytes += packet->len - packet->linkLayerLen;
+		}
+		free_packet(owned);
+		return ret;
+	}
 
 	//arglog(LOG_DEBUG, "Sending packet:");
 	//printRaw(packet->len, packet->data);
 
-	if(sock <= 0)
+	if(ipSock <= 0)
 	{
-		sock = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
-		if(sock < 0)
+		ipSock = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
+		if(ipSock < 0)
 		{
 			arglog(LOG_DEBUG, "Unable to create raw socket for sending\n");
-			return sock;
+			free_packet(owned);
+			return ipSock;
 		}
 	}
 
 	dest_addr.sin_family = AF_INET;
 	dest_addr.sin_port = htons(get_dest_port(packet));
-	dest_addr.sin_addr.s_addr = packet->ipv4->daddr;
+	dest_addr.sin_addr.s_addr = packet_ipv4(packet)->daddr;
 
-	if(packet->ipv4)
-		len = ntohs(packet->ipv4->tot_len);
+	if(packet_ipv4(packet))
+		len = ntohs(packet_ipv4(packet)->tot_len);
 	else
 		len = packet->len - packet->linkLayerLen;
 
-	if(sendto(sock, (uint8_t*)packet->data + packet->linkLayerLen, len,
+	if(queue != NULL && (owned != NULL || len <= SEND_SLOT_SIZE))
+	{
+		send_queue_start(queue);
+
+		if(owned != NULL)
+			queue->iov[queue->count].iov_base = packet->data + packet->linkLayerLen;
+		else
+		{
+			memcpy(queue->bufs[queue->count], packet->data + packet->linkLayerLen, len);
+			queue->iov[queue->count].iov_base = queue->bufs[queue->count];
+		}
+		queue->iov[queue->count].iov_len = len;
+		queue->addrs[queue->count] = dest_addr;
+		queue->owned[queue->count] = owned;
+		queue->count++;
+
+		send_queue_check(queue);
+		return 0;
+	}
+
+	// Too big to queue. Keep ordering by sending everything ahead of it first
+	flush_send_queue();
+
+	if(sendto(ipSock, (uint8_t*)packet->data + packet->linkLayerLen, len,
 		0, (struct sockaddr*)&dest_addr, sizeof(dest_addr)) < 0)
 	{
-		arglog(LOG_DEBUG, "Normal send failed, errno %i. Msg size %i\n", errno, len);
-		return -errno;
+		ret = -errno;
+		arglog(LOG_DEBUG, "Normal send failed, errno %i. Msg size %i\n", -ret, len);
+		threadSendStats.failed++;
+		free_packet(owned);
+		return ret;
 	}
 
+	threadSendStats.sent++;
+	threadSendStats.bytes += len;
+	free_packet(owned);
 	return 0;
 }
 
+int send_packet(const struct packet_data *packet)
+{
+	return send_ip_packet(packet, NULL);
+}
+
+int send_packet_owned(struct packet_data *packet)
+{
+	return send_ip_packet(packet, packet);
+}
+
 int send_arp_reply(const struct packet_data *packet, int devIndex, const uint8_t *hwaddr)
 {
 	int ret;
 	struct packet_data *reply = NULL;
+	struct ethhdr *eth = NULL;
 	char ip[INET_ADDRSTRLEN];
 
-	if(!packet->arp || ntohs(packet->arp->ea_hdr.ar_op) != ARPOP_REQUEST)
+	if(!packet_arp(packet) || ntohs(packet_arp(packet)->ea_hdr.ar_op) != ARPOP_REQUEST)
 		return -1;
 
 	reply = create_packet(sizeof(struct ethhdr) + sizeof(struct ether_arp));
@@ -383,27 +841,27 @@ int send_arp_reply(const struct packet_data *packet, int devIndex, const uint8_t
 
 	// Build reply
 	reply->linkLayerLen = sizeof(struct ethhdr);
-	reply->eth = (struct ethhdr*)reply->data;
-	reply->eth->h_proto = htons(ETH_P_ARP);
-	memcpy(reply->eth->h_dest, packet->arp->arp_sha, sizeof(reply->eth->h_dest));
-	memcpy(reply->eth->h_source, hwaddr, sizeof(reply->eth->h_source));
+	eth = (struct ethhdr*)reply->data;
+	eth->h_proto = htons(ETH_P_ARP);
+	memcpy(eth->h_dest, packet_arp(packet)->arp_sha, sizeof(eth->h_dest));
+	memcpy(eth->h_source, hwaddr, sizeof(eth->h_source));
 	
 	parse_packet(reply);
-	reply->arp->ea_hdr.ar_hrd = htons(ARPHRD_ETHER); // Ethernet
-	reply->arp->ea_hdr.ar_pro = htons(ETH_P_IP); // IP 
-	reply->arp->ea_hdr.ar_hln = sizeof(packet->arp->arp_sha); // 6-byte MACs 
-	reply->arp->ea_hdr.ar_pln = ADDR_SIZE; // IP address size
-	reply->arp->ea_hdr.ar_op = htons(ARPOP_REPLY); // ARP Reply
+	packet_arp(reply)->ea_hdr.ar_hrd = htons(ARPHRD_ETHER); // Ethernet
+	packet_arp(reply)->ea_hdr.ar_pro = htons(ETH_P_IP); // IP 
+	packet_arp(reply)->ea_hdr.ar_hln = sizeof(packet_arp(packet)->arp_sha); // 6-byte MACs 
+	packet_arp(reply)->ea_hdr.ar_pln = ADDR_SIZE; // IP address size
+	packet_arp(reply)->ea_hdr.ar_op = htons(ARPOP_REPLY); // ARP Reply
 
-	memcpy(reply->arp->arp_sha, hwaddr, sizeof(reply->arp->arp_sha)); // Our MAC
-	memcpy(reply->arp->arp_spa, packet->arp->arp_tpa, sizeof(reply->arp->arp_spa)); // We're whatever IP they asked for
-	memcpy(reply->arp->arp_tha, packet->arp->arp_sha, sizeof(reply->arp->arp_tha)); // To the sender of the request
-	memcpy(reply->arp->arp_tpa, packet->arp->arp_spa, sizeof(reply->arp->arp_tpa));
+	memcpy(packet_arp(reply)->arp_sha, hwaddr, sizeof(packet_arp(reply)->arp_sha)); // Our MAC
+	memcpy(packet_arp(reply)->arp_spa, packet_arp(packet)->arp_tpa, sizeof(packet_arp(reply)->arp_spa)); // We're whatever IP they asked for
+	memcpy(packet_arp(reply)->arp_tha, packet_arp(packet)->arp_sha, sizeof(packet_arp(reply)->arp_tha)); // To the sender of the request
+	memcpy(packet_arp(reply)->arp_tpa, packet_arp(packet)->arp_spa, sizeof(packet_arp(reply)->arp_tpa));
 
 	// Whew, that was a lot of work
 	if((ret = send_packet_on(devIndex, reply)) >= 0)
 	{
-		inet_ntop(AF_INET, packet->arp->arp_tpa, ip, sizeof(ip));
+		inet_ntop(AF_INET, packet_arp(packet)->arp_tpa, ip, sizeof(ip));
 		arglog(LOG_DEBUG, "Sent ARP reply for %s\n", ip);
 	}
 	else
@@ -423,109 +881,179 @@ void tcp_csum(struct packet_data *packet)
 
 void udp_csum(struct packet_data *packet)
 {
-	if(!packet->udp)
+	if(!packet_udp(packet))
 		return;
 	
 	#ifdef COMPUTE_CHECKSUMS
 	csum_with_psuedo(packet);
 	#else
-	packet->udp->check = 0;
+	packet_udp(packet)->check = 0;
 	#endif
 }
 
 void csum_with_psuedo(struct packet_data *packet)
 {
-	if(!packet->ipv4 || (!packet->tcp && !packet->udp))
+	struct iphdr *iph = packet_ipv4(packet);
+	struct tcphdr *tcp = packet_tcp(packet);
+	struct udphdr *udp = packet_udp(packet);
+
+	if(!iph || (!tcp && !udp))
 		return;
 
-	// Because we need to include the psuedo header and packets may be fairly long,
-	// manually add up each part, rather than consolidating down. May help memory usage
-	// and speed for large packets
 	uint32_t sum = 0;
-	
-	// Transport layer itself
-	uint16_t *curr = NULL;
-	int i = 0;
 	uint32_t len = 0;
-	if(packet->tcp)
+	uint16_t check = 0;
+	void *l4 = NULL;
+
+	if(tcp)
 	{
-		packet->tcp->check = 0;
-		curr = (uint16_t*)packet->tcp;
-		len = ntohs(packet->ipv4->tot_len) - packet->ipv4->ihl * 4;
+		tcp->check = 0;
+		l4 = tcp;
+		len = ntohs(iph->tot_len) - iph->ihl * 4;
 	}
 	else
 	{
-		packet->udp->check = 0;
-		curr = (uint16_t*)packet->udp;
-		len = ntohs(packet->udp->len);
+		udp->check = 0;
+		l4 = udp;
+		len = ntohs(udp->len);
 	}
 
-	i = len;
-	while(i > 1)
-	{
-		sum += (uint32_t)ntohs(*curr);
-		i -= 2;
-		curr++;
-	}
+	// Psuedo header: IPs (adjacent in the IP header), protocol, and length.
+	// Everything is summed in network order, so the result can be stored as-is
+	sum = htons(iph->protocol) + htons(len);
+	sum = csum_partial(&iph->saddr, 2 * ADDR_SIZE, sum);
 
-	if(i == 1)
-		sum += (uint32_t)ntohs(*curr) & 0xFF00;
-	
-	// IPs
-	sum += ntohs((packet->ipv4->saddr >> 16) & 0xFFFF);
-	sum += ntohs(packet->ipv4->saddr & 0xFFFF);
-	
-	sum += ntohs((packet->ipv4->daddr >> 16) & 0xFFFF);
-	sum += ntohs(packet->ipv4->daddr & 0xFFFF);
+	// Transport layer itself
+	check = csum_fold(csum_partial(l4, len, sum));
 
-	// Protocol and length
-	sum += (uint32_t)packet->ipv4->protocol;
-	sum += (uint32_t)len;
+	if(tcp)
+		tcp->check = check;
+	else
+		udp->check = (check == 0 ? 0xFFFF : check);
+}
+
+void ip_csum(struct iphdr *iph)
+{
+	iph->check = 0;
+	iph->check = csum_fold(csum_partial(iph, iph->ihl * 4, 0));
+}
+
+// Folds the change of count 16-bit words from old to new into a one's complement
+// checksum: HC' = ~(~HC + ~m + m') (RFC 1624, eqn. 3). Byte order doesn't matter
+// as long as everything is in the same one
+static uint16_t csum_update(uint16_t check, const uint16_t *old, const uint16_t *new, int count)
+{
+	int i = 0;
+	uint32_t sum = (uint16_t)~check;
+
+	for(i = 0; i < count; i++)
+	{
+		sum += (uint16_t)~old[i];
+		sum += new[i];
+	}
 
-	// Finalize sum and complement. First two steps carry in any overflow
 	sum = (sum >> 16) + (sum & 0xFFFF);
 	sum = (sum >> 16) + (sum & 0xFFFF);
 
-	if(packet->tcp)
-		packet->tcp->check = ~((uint16_t)htons(sum));
+	return ~sum;
+}
+
+// Shared by rewrite_source() and rewrite_dest(). addr and portField point
+// into the packet, and portField is NULL if there's no TCP/UDP header
+static void rewrite_addr_port(struct packet_data *packet, uint32_t *addr, uint16_t *portField,
+							  const uint8_t *ip, uint16_t port)
+{
+	uint16_t old[3];
+	uint16_t new[3];
+	uint16_t *check = NULL;
+
+	memcpy(old, addr, ADDR_SIZE);
+	memcpy(new, ip, ADDR_SIZE);
+
+	// The address is part of the IP header and the TCP/UDP pseudo-header
+	packet_ipv4(packet)->check = csum_update(packet_ipv4(packet)->check, old, new, 2);
+	memcpy(addr, ip, ADDR_SIZE);
+
+	if(portField == NULL)
+		return;
+
+	old[2] = *portField;
+	new[2] = htons(port);
+	*portField = new[2];
+
+	if(packet_tcp(packet))
+		check = &packet_tcp(packet)->check;
 	else
-		packet->udp->check = ~((uint16_t)htons(sum));
+		check = &packet_udp(packet)->check;
+
+	// 0 means a UDP sender didn't checksum, leave it that way. A computed
+	// 0 goes out as all ones instead
+	if(packet_udp(packet) && *check == 0)
+		return;
+
+	*check = csum_update(*check, old, new, 3);
+	if(packet_udp(packet) && *check == 0)
+		*check = 0xFFFF;
+}
+
+void rewrite_source(struct packet_data *packet, const uint8_t *ip, uint16_t port)
+{
+	uint16_t *portField = NULL;
+
+	if(packet_tcp(packet))
+		portField = &packet_tcp(packet)->source;
+	else if(packet_udp(packet))
+		portField = &packet_udp(packet)->source;
+
+	rewrite_addr_port(packet, &packet_ipv4(packet)->saddr, portField, ip, port);
+}
+
+void rewrite_dest(struct packet_data *packet, const uint8_t *ip, uint16_t port)
+{
+	uint16_t *portField = NULL;
+
+	if(packet_tcp(packet))
+		portField = &packet_tcp(packet)->dest;
+	else if(packet_udp(packet))
+		portField = &packet_udp(packet)->dest;
+
+	rewrite_addr_port(packet, &packet_ipv4(packet)->daddr, portField, ip, port);
 }
 
 uint16_t get_source_port(const struct packet_data *packet)
 {
-	if(packet->tcp)
-		return ntohs(packet->tcp->source);
-	else if(packet->udp)
-		return ntohs(packet->udp->source);
+	if(packet_tcp(packet))
+		return ntohs(packet_tcp(packet)->source);
+	else if(packet_udp(packet))
+		return ntohs(packet_udp(packet)->source);
 	else
 		return 0;
 }
 
 uint16_t get_dest_port(const struct packet_data *packet)
 {
-	if(packet->tcp)
-		return ntohs(packet->tcp->dest);
-	else if(packet->udp)
-		return ntohs(packet->udp->dest);
+	if(packet_tcp(packet))
+		return ntohs(packet_tcp(packet)->dest);
+	else if(packet_udp(packet))
+		return ntohs(packet_udp(packet)->dest);
 	else
 		return 0;
 }
 
 void set_source_port(struct packet_data *packet, const uint16_t port)
 {
-	if(packet->tcp)
-		packet->tcp->source = htons(port);
-	else if(packet->udp)
-		packet->udp->source = htons(port);
+	if(packet_tcp(packet))
+		packet_tcp(packet)->source = htons(port);
+	else if(packet_udp(packet))
+		packet_udp(packet)->source = htons(port);
 }
 
 void set_dest_port(struct packet_data *packet, const uint16_t port)
 {
 	// Find port numbers for appropriate protocol
-	if(packet->tcp)
-		packet->tcp->dest = htons(port);
-	else if(packet->udp)
-		packet->udp->dest = htons(port);
+	if(packet_tcp(packet))
+		packet_tcp(packet)->dest = htons(port);
+	else if(packet_udp(packet))
+		packet_udp(packet)->dest = htons(port);
 }
 
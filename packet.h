@@ -19,10 +19,25 @@
 
 #define LINK_LAYER_SIZE 14
 
+// Room kept in front of packets we build and, where the capture method
+// allows, frames we receive. Enough to prepend an ethernet header, the outer
+// IPv4 header, and an arghdr without moving anything
+#define PACKET_HEADROOM 192
+
+// Largest packet a thread's send queue holds, anything bigger is sent immediately
+#define SEND_SLOT_SIZE 2048
+
+// Devices each thread may have a TX ring open on
+#define MAX_SEND_DEVICES 4
+
+// Buckets in the send queue histograms. Bucket i counts values in [2^i, 2^(i+1))
+#define SEND_HIST_BUCKETS 16
+
 // Size of IPv4 addresses (bytes)
 #define ADDR_SIZE sizeof(__be32)
 
 struct arghdr;
+struct packet_pool;
 
 // Taken from the #if 0'd out part of ethhdr
 // It's removed there because it can be variable sized... we're not handling that case
@@ -33,46 +48,158 @@ typedef struct arp_data {
 	uint8_t ar_tip[ADDR_SIZE];
 } arp_data;
 
-// The basic packet used throughout ARG. Pointers point into the main data section,
-// allowing easy parsing of all parts
+// Headers parse_packet() found, see packet_data.layers
+#define PKT_ETH 0x01
+#define PKT_IPV4 0x02
+#define PKT_ARP 0x04
+#define PKT_TCP 0x08
+#define PKT_UDP 0x10
+#define PKT_ICMP 0x20
+#define PKT_ARG 0x40
+
+// The basic packet used throughout ARG. Headers are found by their offset from
+// data (see the packet_* accessors below), so the descriptor stays a single
+// cache line and remains valid if data is moved or copied elsewhere
 typedef struct packet_data
 {
+	uint8_t *data;
+
+	// Memory data lives in, which may have headroom in front of data for
+	// prepending headers. NULL if data must not be modified (ie, it belongs
+	// to libpcap). pool is NULL unless it came from a packet_pool
+	uint8_t *buf;
+	struct packet_pool *pool;
+
 	unsigned long len;
-	int linkLayerLen;
+	uint32_t bufLen;
+	uint32_t unknown_len; // Length of unparsed data
 
 	struct timespec tstamp;
 
-	struct ethhdr *eth;
-	struct iphdr *ipv4;
-	struct tcphdr *tcp;
-	struct udphdr *udp;
-	struct icmphdr *icmp;
-	struct ether_arp *arp;
-	struct arghdr *arg;
+	// The network header (IPv4 or ARP) starts right after the link layer,
+	// transport (TCP, UDP, ICMP, or ARG) at transOffset. unknownOffset is the
+	// first part of data we didn't parse
+	uint16_t linkLayerLen;
+	uint16_t transOffset;
+	uint16_t unknownOffset;
+	uint16_t layers;
+} packet_data;
 
-	uint8_t *unknown_data; // Pointer to first part of data we didn't parse
-	unsigned long unknown_len; // Length of unparsed data
+// Headers of a parsed packet, or NULL if it doesn't have that layer
+static inline struct ethhdr *packet_eth(const struct packet_data *packet)
+{
+	return (packet->layers & PKT_ETH) ? (struct ethhdr*)packet->data : NULL;
+}
 
-	uint8_t *data;
-} packet_data;
+static inline struct iphdr *packet_ipv4(const struct packet_data *packet)
+{
+	return (packet->layers & PKT_IPV4) ? (struct iphdr*)(packet->data + packet->linkLayerLen) : NULL;
+}
+
+static inline struct ether_arp *packet_arp(const struct packet_data *packet)
+{
+	return (packet->layers & PKT_ARP) ? (struct ether_arp*)(packet->data + packet->linkLayerLen) : NULL;
+}
+
+static inline struct tcphdr *packet_tcp(const struct packet_data *packet)
+{
+	return (packet->layers & PKT_TCP) ? (struct tcphdr*)(packet->data + packet->transOffset) : NULL;
+}
+
+static inline struct udphdr *packet_udp(const struct packet_data *packet)
+{
+	return (packet->layers & PKT_UDP) ? (struct udphdr*)(packet->data + packet->transOffset) : NULL;
+}
+
+static inline struct icmphdr *packet_icmp(const struct packet_data *packet)
+{
+	return (packet->layers & PKT_ICMP) ? (struct icmphdr*)(packet->data + packet->transOffset) : NULL;
+}
+
+static inline struct arghdr *packet_arg(const struct packet_data *packet)
+{
+	return (packet->layers & PKT_ARG) ? (struct arghdr*)(packet->data + packet->transOffset) : NULL;
+}
 
-// Initializes a packet structure, ensuring the pointers are in the correct
-// locations based on the data there. IE, if an IP packet has protocol 6, tcp
-// points to the start of the TCP header after this function completes
+// First part of data we didn't parse
+static inline uint8_t *packet_unknown(const struct packet_data *packet)
+{
+	return packet->data + packet->unknownOffset;
+}
+
+// Initializes a packet structure, ensuring the offsets are in the correct
+// locations based on the data there. IE, if an IP packet has protocol 6,
+// packet_tcp() returns the start of the TCP header after this function completes.
+// Only needs to be called again if the headers themselves change
 int parse_packet(struct packet_data *packet);
 
 // Creates a string to "unique" (hopefully) ID a packet
 void create_packet_id(const struct packet_data *packet, char *buf, int buflen);
 
-// Create or copy new packets
+// Create or copy new packets. With a pool set, packets come from it and
+// only fail to if the pool is exhausted (packets too large to pool are
+// still malloc()'d). Packets may be freed by any thread. Copies keep the
+// original's parsed layout, so it must have been through parse_packet()
 struct packet_data *create_packet(int len);
 struct packet_data *copy_packet(const struct packet_data *packet);
 void free_packet(struct packet_data *packet);
 
+// Bytes that may be written in front of data, or -1 if the packet is read-only
+long packet_headroom(const struct packet_data *packet);
+
+// Copies packet into one with at least headroom bytes in front of its data
+struct packet_data *copy_packet_headroom(const struct packet_data *packet, unsigned int headroom);
+
+// Has create_packet() and copy_packet() in the calling thread use pool,
+// or malloc() again if NULL
+void set_packet_pool(struct packet_pool *pool);
+
 // Sends a packet into the network
 int send_packet(const struct packet_data *packet);
+
+// Same, but takes packet over and frees it once it's gone (even on failure).
+// Lets a send queue batch it from where it sits rather than copying it
+int send_packet_owned(struct packet_data *packet);
 int send_packet_on(int dev_index, const struct packet_data *packet);
 
+// Lets a thread take over sending its own packets (ie, straight onto an
+// AF_XDP ring). The hook returns 0 if it sent the packet, negative on error,
+// and positive if the packet should go out the normal raw socket instead.
+// Only affects the calling thread, pass NULL to go back to normal sending
+typedef int (*send_hook)(void *arg, const struct packet_data *packet);
+void set_send_hook(send_hook hook, void *arg);
+bool has_send_hook(void);
+
+// Counts of packets sent by the calling thread. Each thread also gets its
+// own sockets, so workers never contend on a send
+typedef struct send_stats {
+	uint64_t sent;
+	uint64_t bytes;
+	uint64_t failed;
+
+	// Each flush of the send queue, by number of packets sent together
+	// and by how long the oldest of them waited (microseconds)
+	uint64_t flushes;
+	uint64_t batchHist[SEND_HIST_BUCKETS];
+	uint64_t latencyHist[SEND_HIST_BUCKETS];
+} send_stats;
+void get_send_stats(struct send_stats *stats);
+
+// Logs the send queue histograms (if the queue was used)
+void log_send_stats(const char *dev, int worker, const struct send_stats *stats);
+
+// Gives the calling thread a send queue. Packets that would go out the raw
+// sockets are held (see send_packet_owned()) or copied in instead and sent
+// together, IP packets with one
+// sendmmsg() and frames on a specific device through a TPACKET TX ring.
+// The queue is flushed once batch packets are waiting, once the oldest has
+// waited flushUsec, or when the thread calls flush_send_queue() (ie, at the
+// end of each burst it receives). Sends report success when queued, failures
+// only show up in the stats. A batch of 1 or less leaves sends unqueued
+int init_send_queue(int batch, int flushUsec);
+void uninit_send_queue(void);
+void flush_send_queue(void);
+
 // To be transparent we need to know how to respond to ethernet ARP requests.
 // This actually answers them
 int send_arp_reply(const struct packet_data *packet, int devIndex, const uint8_t *hwaddr);
@@ -87,6 +214,13 @@ int get_dev_index(char *dev);
 void tcp_csum(struct packet_data *packet);
 void udp_csum(struct packet_data *packet);
 void csum_with_psuedo(struct packet_data *packet);
+void ip_csum(struct iphdr *iph);
+
+// Replace the source or destination address and port in place, patching the
+// IP and TCP/UDP checksums from the old and new words (RFC 1624) rather than
+// summing the whole packet again. ip is in network order, port in host order
+void rewrite_source(struct packet_data *packet, const uint8_t *ip, uint16_t port);
+void rewrite_dest(struct packet_data *packet, const uint8_t *ip, uint16_t port);
 
 // Get and set port numbers transparently, whether we have a TCP or UDP packet
 uint16_t get_source_port(const struct packet_data *packet);
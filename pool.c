@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/mman.h>
+
+#include "pool.h"
+#include "utility.h"
+#include "arg_error.h"
+
+// Huge pages are 2MB on everything we run on
+#define POOL_HUGE_PAGE (2UL << 20)
+
+int init_packet_pool(struct packet_pool *pool, unsigned int capacity)
+{
+	unsigned int i = 0;
+	size_t len = 0;
+
+	memset(pool, 0, sizeof(struct packet_pool));
+
+	if(capacity == 0)
+		return -ARG_CONFIG_BAD;
+
+	// Fewer TLB misses on huge pages, but they may not be reserved
+	len = (size_t)capacity * sizeof(struct pool_buf);
+	len = (len + POOL_HUGE_PAGE - 1) & ~(POOL_HUGE_PAGE - 1);
+	pool->bufs = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+	if(pool->bufs == MAP_FAILED)
+	{
+		pool->bufs = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	}
+	if(pool->bufs == MAP_FAILED)
+	{
+		arglog(LOG_DEBUG, "Unable to map %u packet buffers: %s\n", capacity, strerror(errno));
+		pool->bufs = NULL;
+		return -ENOMEM;
+	}
+	pool->mapLen = len;
+
+	for(i = 0; i < capacity; i++)
+	{
+		pool->bufs[i].owner = pool;
+		pool->bufs[i].next = (i + 1 < capacity ? &pool->bufs[i + 1] : NULL);
+	}
+
+	pool->free = &pool->bufs[0];
+	pool->freeCount = capacity;
+	pool->stats.capacity = capacity;
+
+	return 0;
+}
+
+void uninit_packet_pool(struct packet_pool *pool)
+{
+	if(pool->bufs != NULL)
+	{
+		munmap(pool->bufs, pool->mapLen);
+		pool->bufs = NULL;
+	}
+
+	pool->free = NULL;
+	pool->freeCount = 0;
+	pool->returned = NULL;
+}
+
+// Moves everything other threads have given back onto the free list
+static void reclaim_returned(struct packet_pool *pool)
+{
+	struct pool_buf *buf = NULL;
+	struct pool_buf *next = NULL;
+
+	buf = __atomic_exchange_n(&pool->returned, NULL, __ATOMIC_ACQUIRE);
+	while(buf != NULL)
+	{
+		next = buf->next;
+		buf->next = pool->free;
+		pool->free = buf;
+		pool->freeCount++;
+		buf = next;
+	}
+}
+
+struct packet_data *pool_get(struct packet_pool *pool, unsigned long len)
+{
+	struct pool_buf *buf = NULL;
+	unsigned int out;
+
+	if(pool->bufs == NULL || len > POOL_DATA_SIZE)
+		return NULL;
+
+	if(pool->free == NULL)
+		reclaim_returned(pool);
+
+	if(pool->free == NULL)
+	{
+		pool->stats.exhausted++;
+		return NULL;
+	}
+
+	buf = pool->free;
+	pool->free = buf->next;
+	pool->freeCount--;
+
+	pool->stats.gets++;
+	out = pool->stats.capacity - pool->freeCount;
+	if(out > pool->stats.highWater)
+		pool->stats.highWater = out;
+
+	buf->packet.pool = pool;
+	buf->packet.buf = buf->space;
+	buf->packet.bufLen = sizeof(buf->space);
+	buf->packet.data = buf->space + PACKET_HEADROOM;
+	buf->packet.len = len;
+	buf->packet.linkLayerLen = 0;
+
+	return &buf->packet;
+}
+
+void pool_put(struct packet_data *packet, bool isOwner)
+{
+	struct pool_buf *buf = (struct pool_buf*)packet;
+	struct packet_pool *pool = buf->owner;
+	struct pool_buf *head = NULL;
+
+	if(isOwner)
+	{
+		buf->next = pool->free;
+		pool->free = buf;
+		pool->freeCount++;
+		return;
+	}
+
+	// Only the owner ever takes from returned, and it takes the whole list,
+	// so a plain CAS push can't suffer ABA
+	head = __atomic_load_n(&pool->returned, __ATOMIC_RELAXED);
+	do
+	{
+		buf->next = head;
+	} while(!__atomic_compare_exchange_n(&pool->returned, &head, buf, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	__atomic_fetch_add(&pool->remoteFrees, 1, __ATOMIC_RELAXED);
+}
+
+void get_pool_stats(struct packet_pool *pool, struct pool_stats *stats)
+{
+	*stats = pool->stats;
+	stats->remoteFrees = __atomic_load_n(&pool->remoteFrees, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,66 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "packet.h"
+#include "spsc.h"
+
+// Largest packet a pool buffer holds (not counting headroom). Anything
+// bigger is malloc()'d as before
+#define POOL_DATA_SIZE 2048
+
+// One buffer. The packet descriptor lives in the buffer with its data, so
+// taking a packet from the pool is a single pointer pop
+typedef struct pool_buf {
+	struct packet_data packet;
+	struct packet_pool *owner;
+	struct pool_buf *next;
+
+	uint8_t space[PACKET_HEADROOM + POOL_DATA_SIZE] __attribute__((aligned(CACHE_LINE_SIZE)));
+} pool_buf;
+
+typedef struct pool_stats {
+	unsigned int capacity;
+	unsigned int highWater; // Most buffers out at once
+	uint64_t gets;
+	uint64_t exhausted; // Gets refused because every buffer was out
+	uint64_t remoteFrees; // Buffers given back by other threads
+} pool_stats;
+
+// Fixed set of packet buffers belonging to one thread. Only the owner takes
+// buffers out, but any thread may free them: those go onto a lock-free stack
+// that the owner reclaims in one go when it runs out
+typedef struct packet_pool {
+	struct pool_buf *bufs;
+	size_t mapLen;
+
+	// Owner only
+	struct pool_buf *free;
+	unsigned int freeCount;
+	struct pool_stats stats;
+
+	// Pushed to by other threads
+	struct pool_buf *returned __attribute__((aligned(CACHE_LINE_SIZE)));
+	uint64_t remoteFrees;
+} packet_pool;
+
+// Maps capacity buffers up front (on huge pages if available), so nothing
+// is allocated while packets flow. Safe to uninit a pool that failed to init
+int init_packet_pool(struct packet_pool *pool, unsigned int capacity);
+void uninit_packet_pool(struct packet_pool *pool);
+
+// Takes a packet with room for len bytes of data from the pool. Only the
+// owning thread may call this. Returns NULL if len won't fit or the pool
+// is exhausted
+struct packet_data *pool_get(struct packet_pool *pool, unsigned long len);
+
+// Returns a pooled packet to the pool it came from. isOwner says whether
+// the caller is the thread that owns that pool
+void pool_put(struct packet_data *packet, bool isOwner);
+
+// Only exact when called by the owner
+void get_pool_stats(struct packet_pool *pool, struct pool_stats *stats);
+
+#endif
@@ -4,17 +4,136 @@
 #include <arpa/inet.h>
 #include <pthread.h>
 
-#include <polarssl/cipher.h>
-#include <polarssl/md.h>
 
 #include "protocol.h"
 #include "arg_error.h"
 #include "crypto.h"
 #include "hopper.h"
+#include "neighbor.h"
+
+// Device ARG traffic leaves by when sent at L2. Index is 0 if disabled
+static int egressIndex = 0;
+static uint8_t egressHwaddr[ETH_ALEN];
+
+// Only needed the first time we talk to each gate (or once its MAC expires),
+// so all threads share it
+static struct neighbor_cache egressNeighbors;
+static pthread_mutex_t egressLock;
 
 void init_protocol_locks(void)
 {
+	pthread_mutex_init(&egressLock, NULL);
+}
+
+int init_protocol_egress(const char *dev)
+{
+	int ret;
+	char name[IFNAMSIZ];
+
+	strncpy(name, dev, sizeof(name) - 1);
+	name[sizeof(name) - 1] = '\0';
+
+	if((ret = get_mac_addr(name, egressHwaddr)) < 0)
+		return ret;
+
+	if((ret = init_neighbor_cache(&egressNeighbors, name)) < 0)
+		return ret;
+
+	if((ret = get_dev_index(name)) < 0)
+	{
+		uninit_neighbor_cache(&egressNeighbors);
+		return ret;
+	}
+
+	egressIndex = ret;
+	arglog(LOG_DEBUG, "ARG traffic will be sent directly out %s (index %i)\n", name, egressIndex);
+
+	return 0;
+}
+
+void uninit_protocol_egress(void)
+{
+	if(egressIndex == 0)
+		return;
+
+	pthread_mutex_lock(&egressLock);
+	egressIndex = 0;
+	uninit_neighbor_cache(&egressNeighbors);
+	pthread_mutex_unlock(&egressLock);
+}
+
+// Finds the MAC packets to remote should be framed for. Any number of senders
+// may call this at once: the cached MAC is read as a seqlock, and only
+// rewritten under egressLock
+static int gate_hwaddr(struct arg_network_info *remote, const uint8_t *ip, uint8_t *mac)
+{
+	int ret;
+	bool fresh;
+	uint32_t seq;
+	struct timespec now;
+
+	current_time(&now);
+	do
+	{
+		seq = remote->proto.hwaddrSeq;
+		__sync_synchronize();
+
+		fresh = (remote->proto.hwaddrKnown && time_offset(&now, &remote->proto.hwaddrExpires) > 0);
+		if(fresh)
+			memcpy(mac, remote->proto.hwaddr, ETH_ALEN);
+
+		__sync_synchronize();
+	} while((seq & 1) || seq != remote->proto.hwaddrSeq);
+
+	if(fresh)
+		return 0;
+
+	pthread_mutex_lock(&egressLock);
+
+	if(egressIndex != 0)
+		ret = neighbor_lookup(&egressNeighbors, ip, mac);
+	else
+		ret = -ARG_ENTRY_NOT_FOUND;
+
+	// Readers retry while seq is odd or has moved
+	remote->proto.hwaddrSeq++;
+	__sync_synchronize();
+
+	if(ret < 0)
+		remote->proto.hwaddrKnown = false;
+	else
+	{
+		memcpy(remote->proto.hwaddr, mac, ETH_ALEN);
+		current_time_plus(&remote->proto.hwaddrExpires, NEIGHBOR_CACHE_TIME * 1000);
+		remote->proto.hwaddrKnown = true;
+	}
+
+	__sync_synchronize();
+	remote->proto.hwaddrSeq++;
+
+	pthread_mutex_unlock(&egressLock);
+
+	return (ret < 0 ? ret : 0);
+}
+
+// Sends a packet from create_arg_packet() out the external device at L2.
+// Returns positive if that isn't possible and it should be sent normally
+static int send_arg_frame(struct arg_network_info *remote, struct packet_data *packet)
+{
+	// Threads that send elsewhere (AF_XDP, the pipeline) handle framing themselves
+	if(egressIndex == 0 || packet_eth(packet) == NULL || has_send_hook())
+		return 1;
+
+	// Unknown yet. Routing normally gets the kernel to resolve it for next time
+	if(gate_hwaddr(remote, (uint8_t*)&packet_ipv4(packet)->daddr, packet_eth(packet)->h_dest) < 0)
+		return 1;
+
+	memcpy(packet_eth(packet)->h_source, egressHwaddr, ETH_ALEN);
 
+	// The kernel no longer fills in the IP checksum for us
+	ip_csum(packet_ipv4(packet));
+
+	return send_packet_on(egressIndex, packet);
 }
 
 void start_time_sync(struct arg_network_info *local, struct arg_network_info *remote)
@@ -141,6 +260,7 @@ int process_arg_ping(struct arg_network_info *local,
 				if(diff < -LARGE_TIMEBASE_CHANGE || diff > LARGE_TIMEBASE_CHANGE)
 					arglog(LOG_ALERT, "Time base changed by %i milliseconds. Connection may be unstable\n", diff);
 
+				pthread_rwlock_wrlock(&remote->keyLock);
 				if(remote->timeBase.tv_sec > 0)
 				{
 					arglog(LOG_DEBUG, "Setting average time base for %s (was %li %li, new %li %li)\n", remote->name, remote->timeBase.tv_sec, remote->timeBase.tv_nsec, newBase.tv_sec, newBase.tv_nsec);
@@ -152,15 +272,17 @@ int process_arg_ping(struct arg_network_info *local,
 					remote->timeBase.tv_sec = newBase.tv_sec;
 					remote->timeBase.tv_nsec = newBase.tv_nsec;
 				}
+				pthread_rwlock_unlock(&remote->keyLock);
+				refresh_hop_schedule(remote);
 				
 				// Average in latency
 				if(remote->proto.latency > 0)
 				{
-					// We heavily prefer our previous latency here because new hops will result in a doubled
-					// latency, due to the new ARP being sent. If the hop rate is fast, then this will occur
-					// often and we can anticipate the generally high delay. Otherwise, the low latency will
-					// be the typical value. Either way, we want to go towards the more common value and ignore
-					// the outliers either way.
+					// We heavily prefer our previous latency here because new hops can result in a doubled
+					// latency, due to the new ARP being sent (when we can't send at L2, see send_arg_frame()).
+					// If the hop rate is fast, then this will occur often and we can anticipate the generally
+					// high delay. Otherwise, the low latency will be the typical value. Either way, we want
+					// to go towards the more common value and ignore the outliers either way.
 					remote->proto.latency = remote->proto.latency * .75 + latency * .25;
 				}
 				else
@@ -305,8 +427,14 @@ int process_arg_conn_data_resp(struct arg_network_info *local,
 	if(msg->len == sizeof(struct arg_conn_data))
 	{
 		pthread_mutex_lock(&remote->lock);
+		pthread_rwlock_wrlock(&remote->keyLock);
 		
 		connData = (struct arg_conn_data*)msg->data;
+
+		// A new key means they started over, and their window expects our
+		// sequence numbers to be in the first epoch again
+		if(memcmp(remote->symKey, connData->symKey, sizeof(remote->symKey)))
+			remote->proto.outEpochBase = remote->proto.outSeqNum >> 32;
 		
 		memcpy(remote->symKey, connData->symKey, sizeof(remote->symKey));
 		memcpy(remote->iv, connData->iv, sizeof(remote->iv));
@@ -315,8 +443,10 @@ int process_arg_conn_data_resp(struct arg_network_info *local,
 		remote->hopInterval = ntohl(connData->hopInterval);
 
 		// Initialize AES/SHA for this new data
-		cipher_setkey(&remote->cipher, remote->symKey, sizeof(remote->symKey) * 8, POLARSSL_ENCRYPT);
-		md_hmac_starts(&remote->md, remote->symKey, sizeof(remote->symKey));
+		sym_key_set(&remote->sym, remote->symKey, sizeof(remote->symKey));
+		negotiate_arg_version(local, remote, packet_arg(packet)->version);
+		pthread_rwlock_unlock(&remote->keyLock);
+		refresh_hop_schedule(remote);
 
 		current_time(&remote->lastDataUpdate);
 
@@ -491,11 +621,13 @@ int process_arg_trust(struct arg_network_info *local,
 		mask_array(sizeof(newGate->baseIP), newGate->baseIP, newGate->mask, newGate->baseIP);
 
 		// Hook it up
-		pthread_mutex_lock(&local->lock);
-		newGate->next = local->next;
-		newGate->prev = local;
-		local->next = newGate;
-		pthread_mutex_unlock(&local->lock);
+		if((ret = add_arg_network(newGate)) < 0)
+		{
+			arglog(LOG_ALERT, "Failed to add %s, got error %i\n", newGate->name, ret);
+			remove_arg_network(newGate);
+			free_arg_msg(msg);
+			return ret;
+		}
 
 		arglog(LOG_INFO, "Added %s as a new gate\n", newGate->name);
 		start_connection(local, newGate);
@@ -514,86 +646,415 @@ int process_arg_trust(struct arg_network_info *local,
 	return status;
 }
 
+// Checks the sequence number and signature of packet. recheckSeq is set if the
+// sequence number can only be accepted once the contents are known to be new
+// connection data (see process_arg_packet())
+static int verify_arg_packet(struct arg_network_info *local,
+							 struct arg_network_info *remote,
+							 const struct packet_data *packet,
+							 bool *recheckSeq)
+{
+	int ret;
+	uint16_t argLen;
+	uint32_t seq = ntohl(packet_arg(packet)->seq);
+	unsigned int sigLen;
+	unsigned int macLen;
+	uint8_t hash[SHA1_HASH_SIZE];
+	uint8_t mac[SYM_HMAC_SIZE];
+	struct iovec iov[3];
+	static const uint8_t zeroSig[RSA_SIG_SIZE] = {0};
+	const struct arghdr *arg = packet_arg(packet);
+
+	*recheckSeq = false;
+
+	// Look at the sequence number and see if it could be new. It's only
+	// recorded once the packet is known to be authentic, so forgeries can't
+	// push the window past real traffic
+	//arglog(LOG_DEBUG, "seq num in %u\n", packet_arg(packet)->seq);
+	if(replay_window_check(&remote->proto.inWindow, seq) < 0)
+	{
+		if(packet_arg(packet)->type == ARG_CONN_DATA_REQ_MSG || packet_arg(packet)->type == ARG_CONN_DATA_RESP_MSG)
+		{
+			// IF this is an initial data send, then they must be using a new IV (compared to
+			// what we have currently). We will check once everything is decrypted
+			*recheckSeq = true;
+		}
+		else
+		{
+			// Fail, already seen or too far behind
+			arglog(LOG_DEBUG, "Sequence number %u replayed or outside window\n", seq);
+			return -ARG_SEQ_BAD;
+		}
+	}
+
+	// Never trust the length beyond what we actually received
+	argLen = ntohs(packet_arg(packet)->len);
+	if(argLen < arg_hdr_len(packet_arg(packet)) || (uint8_t*)packet_arg(packet) + argLen > packet->data + packet->len)
+	{
+		arglog(LOG_DEBUG, "ARG length %u runs past end of packet\n", argLen);
+		return -ARG_MSG_SIZE_BAD;
+	}
+
+	// Wrapped packets must be in the version we agreed on, so nobody can pick
+	// a weaker one for us. Callers hold keyLock, so it can't change under us
+	if(packet_arg(packet)->type == ARG_WRAPPED_MSG && packet_arg(packet)->version != remote->protoVersion)
+	{
+		arglog(LOG_DEBUG, "Wrapped packet version %u from %s, expected %u\n",
+			packet_arg(packet)->version, remote->name, remote->protoVersion);
+		return -ARG_MSG_UNEXPECTED;
+	}
+	
+	// Version 3 is authenticated as it's decrypted, and recorded in the window
+	// then, see process_arg_wrapped()
+	if(packet_arg(packet)->type == ARG_WRAPPED_MSG && packet_arg(packet)->version == ARG_VERSION_AEAD)
+		return 0;
+
+	// Signature is taken with its own bytes zeroed. Rather than copy the packet
+	// to clear them, feed the digest around them
+	sigLen = arg_sig_len(arg);
+	iov[0].iov_base = (void*)arg;
+	iov[0].iov_len = (uint8_t*)arg->sig - (uint8_t*)arg;
+	iov[1].iov_base = (void*)zeroSig;
+	iov[1].iov_len = sigLen;
+	iov[2].iov_base = (void*)(arg->sig + sigLen);
+	iov[2].iov_len = argLen - iov[0].iov_len - sigLen;
+
+	if(arg->type == ARG_WRAPPED_MSG)
+	{
+		if(!remote->connected)
+		{
+			arglog(LOG_DEBUG, "%s is not connected, discarding packet\n", remote->name);
+			return -ARG_NOT_CONNECTED;
+		}
+		
+		// Check hmac with remote symmetric key. The compact header only
+		// has room for the first part of it, the full one leaves the rest zeroed
+		sym_hmac_iov(&remote->sym, iov, 3, mac);
+		macLen = (sigLen < sizeof(mac) ? sigLen : sizeof(mac));
+		if(memcmp(mac, arg->sig, macLen) || memcmp(zeroSig, arg->sig + macLen, sigLen - macLen))
+		{
+			arglog(LOG_DEBUG, "Unable to verify hmac\n");
+			return -ARG_SIG_CHECK_FAILED;
+		}
+	}
+	else
+	{
+		// Check private key signature
+		crypto_sha1_iov(iov, 3, hash);
+		if((ret = rsa_pkcs1_verify(&remote->rsa, RSA_PUBLIC, SIG_RSA_SHA1,
+			sizeof(hash), hash, (uint8_t*)arg->sig)) != 0 )
+		{
+			arglog(LOG_DEBUG, "Unable to verify signature, error %i\n", ret);
+			return -ARG_SIG_CHECK_FAILED;
+		}
+	}
+
+	// Authentic. A reused sequence number on connection data waits on process_arg_packet()
+	if(!*recheckSeq && replay_window_update(&remote->proto.inWindow, seq) < 0)
+	{
+		arglog(LOG_DEBUG, "Sequence number %u replayed or outside window\n", seq);
+		return -ARG_SEQ_BAD;
+	}
+
+	return 0;
+}
+
+// Runs the symmetric cipher over len bytes of in, as seeded for this packet's
+// sequence number. in and out may be the same (CTR mode)
+static void arg_symmetric_crypt(struct arg_network_info *keyGate, const struct arghdr *arg,
+								const uint8_t *in, size_t len, uint8_t *out)
+{
+	int i = 0;
+	int ret;
+	uint8_t nounce[AES_BLOCK_SIZE];
+
+	memcpy(nounce, keyGate->iv, sizeof(nounce));
+	for(i = 0; i < sizeof(arg->seq); i++)
+		nounce[i] ^= ((arg->seq >> (i * 8)) & 0xFF);
+
+	// Whole payload at once
+	if((ret = sym_ctr(&keyGate->sym, nounce, in, len, out)) != 0)
+		arglog(LOG_DEBUG, "Symmetric crypt failed, error %i\n", ret);
+}
+
+// AEAD nonce: the sender's IV with the full 64-bit sequence number folded into
+// the end. Only the low half is sent; the receiver's replay window tells it the
+// rest, as with IPsec extended sequence numbers. Each direction has its own key,
+// so a nonce is never reused while seq advances, even after the wire seq wraps
+static void arg_aead_nonce(const struct arg_network_info *sender, uint64_t seq, uint8_t *nonce)
+{
+	int i = 0;
+
+	memcpy(nonce, sender->iv, SYM_AEAD_NONCE_SIZE);
+	for(i = 0; i < sizeof(seq); i++)
+		nonce[SYM_AEAD_NONCE_SIZE - 1 - i] ^= (seq >> (i * 8)) & 0xFF;
+}
+
+uint8_t arg_max_version(void)
+{
+	return crypto_has_aead() ? ARG_VERSION_AEAD : ARG_VERSION_COMPACT;
+}
+
+// Derives the key for traffic from sender to receiver: HMAC(sender key, receiver key)
+static int derive_aead_key(struct arg_network_info *sender, const struct arg_network_info *receiver,
+						   struct sym_key *key)
+{
+	int ret;
+	uint8_t derived[SYM_HMAC_SIZE];
+
+	if((ret = sym_hmac(&sender->sym, receiver->symKey, sizeof(receiver->symKey), derived)) != 0)
+		return ret;
+
+	ret = sym_key_set(key, derived, AES_KEY_SIZE);
+	memset(derived, 0, sizeof(derived));
+	return ret;
+}
+
+void negotiate_arg_version(struct arg_network_info *local,
+						   struct arg_network_info *remote,
+						   uint8_t theirVersion)
+{
+	uint8_t version = arg_max_version();
+
+	if(theirVersion < version)
+		version = theirVersion;
+	if(version < ARG_VERSION_HMAC)
+		version = ARG_VERSION_HMAC;
+
+	if(version == ARG_VERSION_AEAD
+		&& (derive_aead_key(local, remote, &remote->aeadOut) != 0
+			|| derive_aead_key(remote, local, &remote->aeadIn) != 0))
+	{
+		arglog(LOG_ALERT, "Unable to derive AEAD keys for %s\n", remote->name);
+		version = ARG_VERSION_COMPACT;
+	}
+
+	if(version != ARG_VERSION_AEAD)
+	{
+		sym_key_free(&remote->aeadOut);
+		sym_key_free(&remote->aeadIn);
+	}
+
+	remote->protoVersion = version;
+	arglog(LOG_DEBUG, "Using version %i wrapped packets with %s\n", remote->protoVersion, remote->name);
+}
+
+// Turns packet into a wrapped ARG packet for remote, in place. The outer
+// ethernet, IPv4, and ARG headers go into the headroom in front of the inner
+// IP packet, which is encrypted where it sits. Caller must hold remote's keyLock
+// and have checked there are ARG_WRAP_HEADROOM bytes in front of the inner packet
+static void wrap_arg_packet(struct arg_network_info *local,
+							struct arg_network_info *remote,
+							struct packet_data *packet)
+{
+	bool compact = (remote->protoVersion >= ARG_VERSION_COMPACT);
+	unsigned int hdrLen = (compact ? ARG_DATA_HDR_LEN : ARG_HDR_LEN);
+	unsigned int outerLen = LINK_LAYER_SIZE + sizeof(struct iphdr) + hdrLen;
+	uint8_t *inner = packet->data + packet->linkLayerLen;
+	unsigned long innerLen = packet->len - packet->linkLayerLen;
+	uint8_t *start = inner - outerLen;
+	struct ethhdr *eth = (struct ethhdr*)start;
+	struct iphdr *iph = (struct iphdr*)(start + LINK_LAYER_SIZE);
+	struct arghdr *arg = (struct arghdr*)(start + LINK_LAYER_SIZE + sizeof(struct iphdr));
+	uint8_t nonce[SYM_AEAD_NONCE_SIZE];
+	uint8_t mac[SYM_HMAC_SIZE];
+	uint64_t seq;
+	int ret;
+
+	memset(start, 0, outerLen);
+
+	// Addresses are filled in by send_arg_frame(), if it can be sent at L2
+	eth->h_proto = htons(ETH_P_IP);
+
+	iph->version = 4;
+	iph->ihl = 5;
+	iph->ttl = 32;
+	iph->protocol = ARG_PROTO;
+	iph->tot_len = htons(sizeof(struct iphdr) + hdrLen + innerLen);
+	generate_ip_corrected(local, 0, (uint8_t*)&iph->saddr);
+	generate_ip_corrected(remote, 0, (uint8_t*)&iph->daddr);
+
+	arg->version = remote->protoVersion;
+	arg->type = ARG_WRAPPED_MSG;
+	arg->len = htons(hdrLen + innerLen);
+	seq = __sync_fetch_and_add(&remote->proto.outSeqNum, 1);
+	arg->seq = htonl((uint32_t)seq);
+
+	if(arg->version == ARG_VERSION_AEAD)
+	{
+		// One pass, header authenticated along with the packet. Their window
+		// started over when their current key arrived, so count from there
+		arg_aead_nonce(local, seq - ((uint64_t)remote->proto.outEpochBase << 32), nonce);
+		if((ret = sym_aead_seal(&remote->aeadOut, nonce, (uint8_t*)arg, ARG_AEAD_AAD_LEN,
+			inner, innerLen, inner, arg->sig)) != 0)
+		{
+			arglog(LOG_DEBUG, "AEAD seal failed, error %i\n", ret);
+		}
+	}
+	else
+	{
+		// Symmetric encryption with remote symmetric key
+		arg_symmetric_crypt(remote, arg, inner, innerLen, inner);
+
+		// HMAC using local symmetric key, over the header with the signature zeroed.
+		// The compact header only has room for the first part of it
+		sym_hmac(&local->sym, (uint8_t*)arg, hdrLen + innerLen, mac);
+		memcpy(arg->sig, mac, (compact ? ARG_TAG_SIZE : sizeof(mac)));
+	}
+
+	packet->data = start;
+	packet->len = outerLen + innerLen;
+	packet->linkLayerLen = LINK_LAYER_SIZE;
+	parse_packet(packet);
+}
+
 // "Normal" packets between gateways
 int send_arg_wrapped(struct arg_network_info *local,
 					  struct arg_network_info *remote,
-					  const struct packet_data *packet)
+					  struct packet_data *packet)
 {
 	int ret;
-	struct argmsg msg;
-	struct packet_data *newPacket = NULL;
+	char inPacketID[MAX_PACKET_ID_SIZE] = "";
+	struct packet_data *copy = NULL;
+	struct packet_data *wrapped = packet;
 
-	pthread_mutex_lock(&remote->lock);
+	pthread_rwlock_rdlock(&remote->keyLock);
 	
 	// Must be connected
 	if(!remote->connected)
 	{
 		arglog(LOG_DEBUG, "Refusing to wrap packet, %s is not authenticated/connected\n", remote->name);
-		pthread_mutex_unlock(&remote->lock);
+		pthread_rwlock_unlock(&remote->keyLock);
 		return -ARG_NOT_CONNECTED;
 	}
-	
-	// Create message containing packet data
-	msg.len = packet->len - packet->linkLayerLen;
-	msg.data = packet->data + packet->linkLayerLen;
-	
-	if((ret = create_arg_packet(local, remote, ARG_WRAPPED_MSG, &msg, &newPacket)) < 0)
+
+	// The original is about to be overwritten
+	if(log_enabled(LOG_RESULTS))
+		create_packet_id(packet, inPacketID, sizeof(inPacketID));
+
+	// Wrap where it sits if we can, otherwise it takes one copy to get room
+	if(packet_headroom(packet) < (long)ARG_WRAP_HEADROOM - packet->linkLayerLen)
 	{
-		arglog(LOG_DEBUG, "Unable to wrap packet\n");
-		return ret;
+		copy = copy_packet_headroom(packet, ARG_WRAP_HEADROOM);
+		if(copy == NULL)
+		{
+			arglog(LOG_DEBUG, "Unable to wrap packet\n");
+			pthread_rwlock_unlock(&remote->keyLock);
+			return -ENOMEM;
+		}
+
+		wrapped = copy;
 	}
+
+	wrap_arg_packet(local, remote, wrapped);
 	
-	if((ret = send_packet(newPacket)) >= 0)
-		arglog_result(packet, newPacket, 0, 1, "Hopper", "wrapped");
+	if((ret = send_arg_frame(remote, wrapped)) > 0)
+		ret = send_packet(wrapped);
+	if(ret >= 0)
+		arglog_result_id(inPacketID, wrapped, 0, 1, "Hopper", "wrapped");
 
-	free_packet(newPacket);
-	pthread_mutex_unlock(&remote->lock);
+	free_packet(copy);
+	pthread_rwlock_unlock(&remote->keyLock);
 
 	return ret;
 }
 
 int process_arg_wrapped(struct arg_network_info *local,
 						 struct arg_network_info *remote,
-						 const struct packet_data *packet)
+						 struct packet_data *packet)
 {
 	int ret = 0;
-	struct argmsg *msg = NULL;
-	struct packet_data *newPacket = NULL;
-
-	pthread_mutex_lock(&remote->lock);
+	bool recheckSeq = false;
+	uint16_t innerLen;
+	uint8_t nonce[SYM_AEAD_NONCE_SIZE];
+	char inPacketID[MAX_PACKET_ID_SIZE] = "";
+	struct packet_data *copy = NULL;
+	struct packet_data *inner = packet;
+
+	pthread_rwlock_rdlock(&remote->keyLock);
 	
 	// Must be connected
 	if(!remote->connected)
 	{
-		pthread_mutex_unlock(&remote->lock);
+		pthread_rwlock_unlock(&remote->keyLock);
 		return -ARG_NOT_CONNECTED;
 	}
 
-	if((ret = process_arg_packet(local, remote, packet, &msg)))
+	if((ret = verify_arg_packet(local, remote, packet, &recheckSeq)))
 	{
-		pthread_mutex_unlock(&remote->lock);
+		pthread_rwlock_unlock(&remote->keyLock);
 		return ret;
 	}
-	
-	// Just need to send this message on as a packet
-	newPacket = create_packet(msg->len);
-	if(newPacket == NULL)
+
+	innerLen = ntohs(packet_arg(packet)->len) - arg_hdr_len(packet_arg(packet));
+	if(innerLen == 0)
 	{
-		arglog(LOG_DEBUG, "Unable to create new packet to drop into internal network\n");
-		free_arg_msg(msg);
-		pthread_mutex_unlock(&remote->lock);
-		return -ENOMEM;
+		pthread_rwlock_unlock(&remote->keyLock);
+		return -ARG_MSG_SIZE_BAD;
 	}
 
-	memcpy(newPacket->data, msg->data, msg->len);
-	parse_packet(newPacket);
-	if((ret = send_packet(newPacket)) >= 0)
-		arglog_result(packet, newPacket, 1, 1, "Hopper", "unwrapped");
+	if(log_enabled(LOG_RESULTS))
+		create_packet_id(packet, inPacketID, sizeof(inPacketID));
 
-	pthread_mutex_unlock(&remote->lock);
+	// Decrypt where it sits if we're allowed to touch it
+	if(packet_headroom(packet) < 0)
+	{
+		copy = copy_packet(packet);
+		if(copy == NULL)
+		{
+			arglog(LOG_DEBUG, "Unable to create new packet to drop into internal network\n");
+			pthread_rwlock_unlock(&remote->keyLock);
+			return -ENOMEM;
+		}
 
-	free_arg_msg(msg);
-	free_packet(newPacket);
+		inner = copy;
+	}
+
+	// Decrypt, then send on from where the inner packet starts
+	if(packet_arg(inner)->version == ARG_VERSION_AEAD)
+	{
+		// Authenticated here rather than in verify_arg_packet()
+		arg_aead_nonce(remote, replay_window_extend(&remote->proto.inWindow, ntohl(packet_arg(inner)->seq)), nonce);
+		if((ret = sym_aead_open(&remote->aeadIn, nonce, (uint8_t*)packet_arg(inner), ARG_AEAD_AAD_LEN,
+			packet_unknown(inner), innerLen, packet_unknown(inner), packet_arg(inner)->sig)) != 0)
+		{
+			arglog(LOG_DEBUG, "Unable to open AEAD packet from %s, error %i\n", remote->name, ret);
+			pthread_rwlock_unlock(&remote->keyLock);
+			free_packet(copy);
+			return ret;
+		}
+
+		if((ret = replay_window_update(&remote->proto.inWindow, ntohl(packet_arg(inner)->seq))) < 0)
+		{
+			arglog(LOG_DEBUG, "Sequence number %u replayed or outside window\n", ntohl(packet_arg(inner)->seq));
+			pthread_rwlock_unlock(&remote->keyLock);
+			free_packet(copy);
+			return ret;
+		}
+	}
+	else
+	{
+		// Symmetric decrypt using local symmetric key
+		arg_symmetric_crypt(local, packet_arg(inner), packet_unknown(inner), innerLen, packet_unknown(inner));
+	}
+
+	inner->data = packet_unknown(inner);
+	inner->len = innerLen;
+	inner->linkLayerLen = 0;
+	if((ret = parse_packet(inner)) < 0 || !packet_ipv4(inner))
+	{
+		arglog(LOG_DEBUG, "Unable to parse unwrapped packet, dropping\n");
+		pthread_rwlock_unlock(&remote->keyLock);
+		free_packet(copy);
+		return -ARG_PACKET_PARSE_ERROR;
+	}
+
+	if((ret = send_packet(inner)) >= 0)
+		arglog_result_id(inPacketID, inner, 1, 1, "Hopper", "unwrapped");
+
+	pthread_rwlock_unlock(&remote->keyLock);
+
+	free_packet(copy);
 
 	return ret;
 }
@@ -609,7 +1070,9 @@ int send_arg_packet(struct arg_network_info *local,
 	if((ret = create_arg_packet(local, remote, type, msg, &packet)) < 0)
 		return ret;
 
-	if((ret = send_packet(packet)) >= 0)
+	if((ret = send_arg_frame(remote, packet)) > 0)
+		ret = send_packet(packet);
+	if(ret >= 0)
 		arglog_result(originalPacket, packet, 0, 1, "Admin", logMsg);
 	else
 		arglog(LOG_DEBUG, "Failed to send ARG packet\n");
@@ -624,36 +1087,35 @@ int create_arg_packet(struct arg_network_info *local,
 					 int type, const struct argmsg *msg,
 					 struct packet_data **packetOut)
 {
-	int i = 0;
-	int blockSize;
-	size_t ilen;
-	size_t olen;
-
 	int ret;
 	struct packet_data *packet = NULL;
 	uint16_t fullLen = 0;
 	uint8_t hash[SHA1_HASH_SIZE];
 
-	uint8_t nounce[AES_BLOCK_SIZE];
-
 	// Create packet we will build within, giving it plenty of extra space (encryption padding and such)
 	fullLen = 20 + ARG_HDR_LEN;
 	if(msg != NULL)
 		fullLen += msg->len;
 	fullLen += local->rsa.len;
-	packet = create_packet(fullLen);
+	packet = create_packet(LINK_LAYER_SIZE + fullLen);
 	if(packet == NULL)
 	{
 		arglog(LOG_DEBUG, "Unable to allocate space for ARG packet\n");
 		return -ENOMEM;
 	}
+
+	// Leave room for an ethernet header, in case it can be sent at L2.
+	// Addresses are filled in by send_arg_frame()
+	packet->linkLayerLen = LINK_LAYER_SIZE;
+	((struct ethhdr*)packet->data)->h_proto = htons(ETH_P_IP);
+	parse_packet(packet);
 	
 	// IP header
-	packet->ipv4->version = 4;
-	packet->ipv4->ihl = 5;
-	packet->ipv4->ttl = 32;
-	packet->ipv4->tos = 0;
-	packet->ipv4->protocol = ARG_PROTO;
+	packet_ipv4(packet)->version = 4;
+	packet_ipv4(packet)->ihl = 5;
+	packet_ipv4(packet)->ttl = 32;
+	packet_ipv4(packet)->tos = 0;
+	packet_ipv4(packet)->protocol = ARG_PROTO;
 
 	// We only jump forward by a quarter of the latency here for a few reasons.
 	// First, without any adjustment at all we should work even with a latency of half
@@ -661,20 +1123,25 @@ int create_arg_packet(struct arg_network_info *local,
 	// due to the frequent ARPs that take just as long as actual packets (in the real world,
 	// they would take negligible time). As a result, latency is often much higher than
 	// it needs to be, but /4 always puts us into a safe realm.
-	generate_ip_corrected(local, 0, (uint8_t*)&packet->ipv4->saddr);
-	generate_ip_corrected(remote, 0, (uint8_t*)&packet->ipv4->daddr);
+	generate_ip_corrected(local, 0, (uint8_t*)&packet_ipv4(packet)->saddr);
+	generate_ip_corrected(remote, 0, (uint8_t*)&packet_ipv4(packet)->daddr);
 
-	packet->ipv4->id = 0;
-	packet->ipv4->frag_off = 0;
-	packet->ipv4->tot_len = htons(packet->ipv4->ihl * 4);
-	packet->ipv4->check = 0;
+	packet_ipv4(packet)->id = 0;
+	packet_ipv4(packet)->frag_off = 0;
+	// Claim the whole buffer for now; trimmed once the ARG length is known
+	packet_ipv4(packet)->tot_len = htons(fullLen);
+	packet_ipv4(packet)->check = 0;
 
 	parse_packet(packet);
 
 	// Basic info
-	packet->arg->version = 1;
-	packet->arg->type = type;
-	packet->arg->seq = htonl(remote->proto.outSeqNum++);
+	// Admin packets tell the other end what we can do
+	if(type == ARG_WRAPPED_MSG)
+		packet_arg(packet)->version = ARG_VERSION_HMAC;
+	else
+		packet_arg(packet)->version = arg_max_version();
+	packet_arg(packet)->type = type;
+	packet_arg(packet)->seq = htonl((uint32_t)__sync_fetch_and_add(&remote->proto.outSeqNum, 1));
 	
 	// Encrypt
 	if(msg != NULL)
@@ -688,27 +1155,8 @@ int create_arg_packet(struct arg_network_info *local,
 			}
 
 			// Symmetric encryption with remote symmetric key
-			memcpy(nounce, remote->iv, sizeof(nounce));
-			for(i = 0; i < sizeof(packet->arg->seq); i++)
-				nounce[i] ^= ((packet->arg->seq >> (i * 8)) & 0xFF);
-			cipher_reset(&remote->cipher, nounce);
-
-			blockSize = cipher_get_block_size(&remote->cipher);
-
-			packet->arg->len = 0;
-
-			for(i = 0; i < msg->len; i += blockSize)
-			{
-				ilen = (size_t)(msg->len - i);
-				if(ilen > blockSize)
-					ilen = blockSize;
-
-				cipher_update(&remote->cipher, msg->data + i, ilen, packet->unknown_data + i, &olen);
-			
-				packet->arg->len += olen;
-			}
-
-			packet->arg->len = htons(packet->arg->len + ARG_HDR_LEN);
+			arg_symmetric_crypt(remote, packet_arg(packet), msg->data, msg->len, packet_unknown(packet));
+			packet_arg(packet)->len = htons(msg->len + ARG_HDR_LEN);
 		}
 		else
 		{
@@ -721,35 +1169,33 @@ int create_arg_packet(struct arg_network_info *local,
 			}
 
 			// RSA encryption with destination public key
-			packet->arg->len = htons((uint16_t)remote->rsa.len + ARG_HDR_LEN);
+			packet_arg(packet)->len = htons((uint16_t)remote->rsa.len + ARG_HDR_LEN);
 			rsa_pkcs1_encrypt(&remote->rsa, ctr_drbg_random, &local->ctr_drbg, RSA_PUBLIC,
-				msg->len, msg->data, packet->unknown_data);
+				msg->len, msg->data, packet_unknown(packet));
 		}
 	}
 	else
-		packet->arg->len = htons(ARG_HDR_LEN);
+		packet_arg(packet)->len = htons(ARG_HDR_LEN);
 
-	packet->len = ntohs(packet->ipv4->tot_len) + ntohs(packet->arg->len);
-	packet->ipv4->tot_len = htons(packet->len);
+	packet->len = packet->linkLayerLen + packet_ipv4(packet)->ihl * 4 + ntohs(packet_arg(packet)->len);
+	packet_ipv4(packet)->tot_len = htons(packet->len - packet->linkLayerLen);
 
 	// Reparse, now that we've added in ARG informatino
 	parse_packet(packet);
 	
-	//arglog(LOG_DEBUG, "seq num out %u\n", packet->arg->seq);
+	//arglog(LOG_DEBUG, "seq num out %u\n", packet_arg(packet)->seq);
 
 	if(type == ARG_WRAPPED_MSG)
 	{
 		// HMAC using local symmetric key
-		md_hmac_starts(&local->md, local->symKey, sizeof(local->symKey));
-		md_hmac_update(&local->md, (uint8_t*)packet->arg, ntohs(packet->arg->len));
-		md_hmac_finish(&local->md, packet->arg->sig);
+		sym_hmac(&local->sym, (uint8_t*)packet_arg(packet), ntohs(packet_arg(packet)->len), packet_arg(packet)->sig);
 	}
 	else
 	{
 		// Sign with private key
-		sha1((uint8_t*)packet->arg, ntohs(packet->arg->len), hash);
+		crypto_sha1((uint8_t*)packet_arg(packet), ntohs(packet_arg(packet)->len), hash);
 		if((ret = rsa_pkcs1_sign(&local->rsa, NULL, NULL, RSA_PRIVATE, SIG_RSA_SHA1,
-			sizeof(hash), hash, packet->arg->sig)) != 0)
+			sizeof(hash), hash, packet_arg(packet)->sig)) != 0)
 		{
 			arglog(LOG_DEBUG, "Unable to sign, error %i\n", ret);
 			free_packet(packet);
@@ -766,132 +1212,49 @@ int process_arg_packet(struct arg_network_info *local,
 						const struct packet_data *packet,
 						struct argmsg **msg)
 {
-	int i = 0;
-	int blockSize;
-	size_t ilen;
-	size_t olen;
-
-	uint8_t hash[SHA1_HASH_SIZE];
-	uint8_t nounce[AES_BLOCK_SIZE];
-
-	char recheckSeq = 0;
-
 	int ret;
 	size_t len;
 	uint16_t argLen;
-
-	struct packet_data *newPacket = NULL;
+	bool recheckSeq = false;
 	struct argmsg *out = NULL;
 
-	// Look at the sequence number and see if it makes sense
-	//arglog(LOG_DEBUG, "seq num in %u\n", packet->arg->seq);
-	if(ntohl(packet->arg->seq) > remote->proto.inSeqNum
-		|| (ntohl(packet->arg->seq) < SEQ_NUM_WRAP_ALLOWANCE
-			&& remote->proto.inSeqNum > UINT16_MAX - SEQ_NUM_WRAP_ALLOWANCE))
-	{
-		remote->proto.inSeqNum = ntohl(packet->arg->seq);
-	}
-	else if(packet->arg->type == ARG_CONN_DATA_REQ_MSG || packet->arg->type == ARG_CONN_DATA_RESP_MSG)
-	{
-		// IF this is an initial data send, then they must be using a new IV (compared to
-		// what we have currently). We will check once everything is decrypted
-		recheckSeq = 1;
-	}
-	else
-	{
-		// Fail, sequence numbers should always advance (except for wrap-around)
-		arglog(LOG_DEBUG, "Sequence number not monotonic (got %u, should be > %u)\n",
-			ntohl(packet->arg->seq), remote->proto.inSeqNum);
-		return -ARG_SEQ_BAD;
-	}
-	
-	// Duplicate packet so we can remove the hash and check
-	newPacket = copy_packet(packet);
-	if(newPacket == NULL)
-	{
-		arglog(LOG_DEBUG, "Unable to duplicate packet for checking\n");
-		return -ENOMEM;
-	}
+	// AEAD is only understood by process_arg_wrapped()
+	if(packet_arg(packet)->type == ARG_WRAPPED_MSG && packet_arg(packet)->version == ARG_VERSION_AEAD)
+		return -ARG_MSG_UNEXPECTED;
 
-	argLen = ntohs(newPacket->arg->len);
-	
-	memset(newPacket->arg->sig, 0, sizeof(newPacket->arg->sig));
-	if(newPacket->arg->type == ARG_WRAPPED_MSG)
-	{
-		if(!remote->connected)
-		{
-			arglog(LOG_DEBUG, "%s is not connected, discarding packet\n", remote->name);
-			free_packet(newPacket);
-			return -ARG_NOT_CONNECTED;
-		}
-		
-		// Check hmac with remote symmetric key
-		md_hmac_starts(&remote->md, remote->symKey, sizeof(remote->symKey));
-		md_hmac_update(&remote->md, (uint8_t*)newPacket->arg, ntohs(newPacket->arg->len));
-		md_hmac_finish(&remote->md, newPacket->arg->sig);
-		
-		if(memcmp(newPacket->arg->sig, packet->arg->sig, sizeof(newPacket->arg->sig)))
-		{
-			arglog(LOG_DEBUG, "Unable to verify hmac\n");
-			free_packet(newPacket);
-			return -ARG_SIG_CHECK_FAILED;
-		}
-	}
-	else
-	{
-		// Check private key signature
-		sha1((uint8_t*)newPacket->arg, argLen, hash);
-		if((ret = rsa_pkcs1_verify(&remote->rsa, RSA_PUBLIC, SIG_RSA_SHA1,
-			sizeof(hash), hash, packet->arg->sig)) != 0 )
-		{
-			arglog(LOG_DEBUG, "Unable to verify signature, error %i\n", ret);
-			free_packet(newPacket);
-			return -ARG_SIG_CHECK_FAILED;
-		}
-	}
+	// Same as the data path, so a reset below can't race its window updates
+	pthread_rwlock_rdlock(&remote->keyLock);
+	ret = verify_arg_packet(local, remote, packet, &recheckSeq);
+	pthread_rwlock_unlock(&remote->keyLock);
+	if(ret < 0)
+		return ret;
+
+	argLen = ntohs(packet_arg(packet)->len);
 
 	// Decrypt
-	if(argLen > ARG_HDR_LEN)
+	if(argLen > arg_hdr_len(packet_arg(packet)))
 	{
 		out = create_arg_msg(argLen);
 		if(out == NULL)
 		{
 			arglog(LOG_DEBUG, "Unable to allocate space to write decrypted message\n");
-			free_packet(newPacket);
 			return -ENOMEM;
 		}
 
-		if(newPacket->arg->type == ARG_WRAPPED_MSG || newPacket->arg->type == ARG_TRUST_DATA_MSG)
+		if(packet_arg(packet)->type == ARG_WRAPPED_MSG || packet_arg(packet)->type == ARG_TRUST_DATA_MSG)
 		{
 			// Symmetric decrypt using local symmetric key
-			memcpy(nounce, local->iv, sizeof(nounce));
-			for(i = 0; i < sizeof(newPacket->arg->seq); i++)
-				nounce[i] ^= ((newPacket->arg->seq >> (i * 8)) & 0xFF);
-			cipher_reset(&local->cipher, nounce);
-
-			blockSize = cipher_get_block_size(&local->cipher);
-
-			out->len = 0;
-
-			for(i = 0; i < argLen - ARG_HDR_LEN; i += blockSize)
-			{
-				ilen = (size_t)(argLen - ARG_HDR_LEN - i);
-				if(ilen > blockSize)
-					ilen = blockSize;
-
-				cipher_update(&local->cipher, packet->unknown_data + i, ilen, out->data + i, &olen);
-				out->len += olen;
-			}
+			out->len = argLen - arg_hdr_len(packet_arg(packet));
+			arg_symmetric_crypt(local, packet_arg(packet), packet_unknown(packet), out->len, out->data);
 		}
 		else
 		{
 			// Decrypt with local private key
 			if((ret = rsa_pkcs1_decrypt(&local->rsa, RSA_PRIVATE, &len,
-				newPacket->unknown_data, out->data, out->len)) != 0)
+				packet_unknown(packet), out->data, out->len)) != 0)
 			{
 				arglog(LOG_DEBUG, "Unable to decrypt packet contents, error %i\n", ret);
 				free_arg_msg(out);
-				free_packet(newPacket);
 				return -ARG_DECRYPT_FAILED;
 			}
 
@@ -912,23 +1275,26 @@ int process_arg_packet(struct arg_network_info *local,
 	{
 		if(*msg == NULL)
 		{
-			arglog(LOG_DEBUG, "Failing sequence number check because message is null (got %u, should be > %u)\n",
-				ntohl(packet->arg->seq), remote->proto.inSeqNum);
+			arglog(LOG_DEBUG, "Failing sequence number check because message is null (got %u)\n",
+				ntohl(packet_arg(packet)->seq));
 			return -ARG_SEQ_BAD;
 		}
 
 		if(memcmp(((struct arg_conn_data*)out->data)->iv, remote->iv, sizeof(remote->iv)) == 0)
 		{
-			arglog(LOG_DEBUG, "Failing sequence number check because IV did not change in new connection data (replay?) (got %u, should be > %u)\n",
-				ntohl(packet->arg->seq), remote->proto.inSeqNum);
+			arglog(LOG_DEBUG, "Failing sequence number check because IV did not change in new connection data (replay?) (got %u)\n",
+				ntohl(packet_arg(packet)->seq));
 			return -ARG_SEQ_BAD;
 		}
 		
-		arglog(LOG_DEBUG, "Resetting sequence number for %s\n", remote->name);
-		remote->proto.inSeqNum = 0;
+		// Workers update the window holding keyLock for reading, so none
+		// can be part way through an update while it's cleared
+		arglog(LOG_DEBUG, "Resetting sequence number window for %s\n", remote->name);
+		pthread_rwlock_wrlock(&remote->keyLock);
+		replay_window_reset(&remote->proto.inWindow);
+		replay_window_update(&remote->proto.inWindow, ntohl(packet_arg(packet)->seq));
+		pthread_rwlock_unlock(&remote->keyLock);
 	}
-	
-	free_packet(newPacket);
 
 	return 0;
 }
@@ -3,9 +3,11 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 #include "utility.h"
 #include "crypto.h"
+#include "antireplay.h"
 #include "packet.h"
 #include "settings.h"
 
@@ -28,7 +30,9 @@ struct arg_network_info;
  * |   ...additional packet data...   |
  * +----------------------------------+
  *
- * Version - for thesis, 1 all the time
+ * Version - 1, or whatever was negotiated for WRAPPED packets (see
+ *		ARG_VERSION_*). Admin packets carry the highest version the sender speaks.
+ *		From version 2 on WRAPPED packets use the compact header below
  * Type - type of this packet, determines how it will be handled
  * Length - Length of packet, from version on. The minimum size is
  *		136, giving room for everything including the signature
@@ -36,6 +40,21 @@ struct arg_network_info;
  *		number, allowing replays to be prevented
  * Signature - Every packet is either signed with a the private key
  *		of the sender or the agreed upon symmetric key of between two gates
+ *
+ * Compact header, WRAPPED packets from version 2
+ * +----------------------------------+
+ * | version | packet type |  length  |
+ * +---------+-------------+----------+
+ * |          sequence number         |
+ * +----------------------------------+
+ * |             16 bytes             |
+ * |       Authentication tag         |
+ * +----------------------------------+
+ * |      ...encrypted packet...      |
+ * +----------------------------------+
+ *
+ * Tag - HMAC-SHA256 truncated to 16 bytes (version 2) or the AES-GCM tag
+ *		(version 3), in place of the 128 byte signature
  * 
  * In the following description, local is the current gateway and
  * remote is the gateway with which we are communicating. We assume
@@ -81,10 +100,30 @@ struct arg_network_info;
  *		local symmetric key
  *	4. Remote receives message, ensures the HMAC matches, and extracts the packet
  *	5. Remote sends packet on, into the internal network
+ *
+ * Route packet, version 3
+ * - AES-256-GCM with a key derived for each direction (see negotiate_arg_version())
+ *	1. Used once both gates have advertised version 3 in their connection data
+ *	2. Local encrypts and authenticates the packet in a single pass. The ARG
+ *		header up to the signature is associated data, the nonce is local's IV
+ *		with the sequence number folded in, and the tag goes in the signature
+ *	3. Remote opens it with the same key and nonce, which fails if anything
+ *		was altered, and sends the packet on
  */
 #define ARG_ADMIN_PORT 7654
 #define ARG_PROTO 253
 
+// Wrapped message formats. Each gate speaks every version up to its highest
+#define ARG_VERSION_HMAC 1 // AES-256-CTR, then HMAC-SHA256
+#define ARG_VERSION_COMPACT 2 // As version 1 with the compact header and a truncated HMAC
+#define ARG_VERSION_AEAD 3 // AES-256-GCM, compact header
+
+// Header fields authenticated as associated data in version 3
+#define ARG_AEAD_AAD_LEN offsetof(struct arghdr, sig)
+
+// Size of the tag in the compact header
+#define ARG_TAG_SIZE 16
+
 // Message types
 enum {
 	ARG_WRAPPED_MSG,
@@ -109,6 +148,17 @@ typedef struct arghdr {
 	uint8_t sig[RSA_SIG_SIZE];
 } arghdr;
 
+// Header for WRAPPED packets from ARG_VERSION_COMPACT on. Matches arghdr up
+// to the signature, so the tag is at arghdr.sig
+typedef struct arg_data_hdr {
+	uint8_t version;
+	uint8_t type;
+	uint16_t len;
+	uint32_t seq;
+
+	uint8_t tag[ARG_TAG_SIZE];
+} arg_data_hdr;
+
 // Basic data needed to transmit packets between gateways
 typedef struct arg_conn_data {
 	uint8_t symKey[AES_KEY_SIZE];
@@ -144,6 +194,28 @@ typedef struct argmsg {
 } argmsg;
 
 #define ARG_HDR_LEN sizeof(struct arghdr)
+#define ARG_DATA_HDR_LEN sizeof(struct arg_data_hdr)
+
+// Most space wrapping takes in front of the inner IP packet: ethernet, outer
+// IPv4, and ARG headers
+#define ARG_WRAP_HEADROOM (LINK_LAYER_SIZE + sizeof(struct iphdr) + ARG_HDR_LEN)
+
+// True if arg uses the compact header
+static inline bool arg_is_compact(const struct arghdr *arg)
+{
+	return arg->type == ARG_WRAPPED_MSG && arg->version >= ARG_VERSION_COMPACT;
+}
+
+// Size of arg's header, and of the signature or tag at arg->sig
+static inline unsigned int arg_hdr_len(const struct arghdr *arg)
+{
+	return arg_is_compact(arg) ? ARG_DATA_HDR_LEN : ARG_HDR_LEN;
+}
+
+static inline unsigned int arg_sig_len(const struct arghdr *arg)
+{
+	return arg_is_compact(arg) ? ARG_TAG_SIZE : RSA_SIG_SIZE;
+}
 
 #define ARG_GATE_HELLO 0x01
 
@@ -163,8 +235,9 @@ typedef struct proto_data {
 
 	struct timespec lastConnAttemptTime;
 
-	uint32_t inSeqNum; // Last sequence number we received from them
-	uint32_t outSeqNum; // Next sequence number for us to send
+	struct replay_window inWindow; // Sequence numbers we've received from them
+	uint64_t outSeqNum; // Next sequence number for us to send. Only the low half goes on the wire
+	uint32_t outEpochBase; // Upper half of outSeqNum when their current key arrived, see arg_aead_nonce()
 	long latency; // One-way latency in ms
 
 	unsigned int goodIPCount; // Number of packets we've seen that have good, valid IPs
@@ -172,10 +245,25 @@ typedef struct proto_data {
 	
 	struct timespec pingSentTime;
 	uint32_t sentPingID;
+
+	// MAC our packets to them are framed for, either their gate or the router
+	// in front of it. Every IP in their range resolves to the same place, so
+	// this stays good across hops. hwaddrSeq is odd while they're being
+	// rewritten (see gate_hwaddr())
+	uint32_t hwaddrSeq;
+	uint8_t hwaddr[ETH_ALEN];
+	bool hwaddrKnown;
+	struct timespec hwaddrExpires;
 } proto_data;
 
 void init_protocol_locks(void);
 
+// Lets packets to other gates go straight out dev at L2, using each gate's
+// cached next-hop MAC instead of the kernel's routing and ARP (which would
+// resolve every new hop IP). Without it, they are routed normally
+int init_protocol_egress(const char *dev);
+void uninit_protocol_egress(void);
+
 // Protocol flow control
 void start_time_sync(struct arg_network_info *local, struct arg_network_info *remote);
 void start_connection(struct arg_network_info *local, struct arg_network_info *remote);
@@ -211,13 +299,25 @@ int process_arg_trust(struct arg_network_info *local,
 						struct arg_network_info *remote,
 						const struct packet_data *packet);
 
-// Encapsulation
+// Picks the wrapped message format for remote from the highest version it
+// advertised, and sets up the AEAD keys if that's what it is. Caller
+// must hold remote's lock, and its keyLock for writing
+void negotiate_arg_version(struct arg_network_info *local,
+						   struct arg_network_info *remote,
+						   uint8_t theirVersion);
+
+// Highest version we can speak with the current crypto provider
+uint8_t arg_max_version(void);
+
+// Encapsulation. Both work in place when the packet is writable and has the
+// room (see packet_headroom()), leaving it wrapped or unwrapped, and on a
+// copy otherwise
 int send_arg_wrapped(struct arg_network_info *local,
 					  struct arg_network_info *remote,
-					  const struct packet_data *packet);
+					  struct packet_data *packet);
 int process_arg_wrapped(struct arg_network_info *local,
 						 struct arg_network_info *remote,
-						 const struct packet_data *packet);
+						 struct packet_data *packet);
 
 // Creates the ARG header for the given data and sends it
 int send_arg_packet(struct arg_network_info *local,
@@ -0,0 +1,247 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <pcap.h>
+
+#include "replay.h"
+#include "director.h"
+#include "hopper.h"
+#include "packet.h"
+#include "pool.h"
+#include "utility.h"
+#include "arg_error.h"
+
+static struct replay_stats stats;
+
+// Stands in for the network while replaying
+static int counting_sink(void *arg, const struct packet_data *packet)
+{
+	struct replay_stats *s = (struct replay_stats*)arg;
+
+	s->sent++;
+	if(packet_ipv4(packet))
+		s->sentBytes += ntohs(packet_ipv4(packet)->tot_len);
+	else
+		s->sentBytes += packet->len - packet->linkLayerLen;
+
+	return 0;
+}
+
+static void free_frames(struct replay_frame *frames, unsigned long count)
+{
+	unsigned long i = 0;
+
+	if(frames == NULL)
+		return;
+
+	for(i = 0; i < count; i++)
+		free(frames[i].data);
+	free(frames);
+}
+
+// Reads the whole file in up front so disk I/O isn't part of the timing
+static int load_frames(const char *path, struct replay_frame **framesOut,
+					   unsigned long *countOut, int *linkLayerLen)
+{
+	char ebuf[PCAP_ERRBUF_SIZE];
+	pcap_t *pd = NULL;
+	struct pcap_pkthdr *header = NULL;
+	const u_char *wireData = NULL;
+	struct replay_frame *frames = NULL;
+	struct replay_frame *bigger = NULL;
+	unsigned long count = 0;
+	unsigned long size = 0;
+	int ret;
+
+	pd = pcap_open_offline(path, ebuf);
+	if(pd == NULL)
+	{
+		arglog(LOG_FATAL, "Unable to open %s for replay: %s\n", path, ebuf);
+		return -ARG_CONFIG_BAD;
+	}
+
+	switch(pcap_datalink(pd))
+	{
+	case DLT_EN10MB:
+		*linkLayerLen = LINK_LAYER_SIZE;
+		break;
+	case DLT_RAW:
+		*linkLayerLen = 0;
+		break;
+	default:
+		arglog(LOG_FATAL, "Unsupported link type %i in %s\n", pcap_datalink(pd), path);
+		pcap_close(pd);
+		return -ARG_CONFIG_BAD;
+	}
+
+	while((ret = pcap_next_ex(pd, &header, &wireData)) == 1)
+	{
+		if(count == size)
+		{
+			size = (size ? size * 2 : 1024);
+			bigger = (struct replay_frame*)realloc(frames, size * sizeof(struct replay_frame));
+			if(bigger == NULL)
+			{
+				arglog(LOG_FATAL, "Unable to allocate space for replay frames\n");
+				free_frames(frames, count);
+				pcap_close(pd);
+				return -ENOMEM;
+			}
+			frames = bigger;
+		}
+
+		frames[count].data = (uint8_t*)malloc(header->caplen);
+		if(frames[count].data == NULL)
+		{
+			arglog(LOG_FATAL, "Unable to allocate space for replay frame\n");
+			free_frames(frames, count);
+			pcap_close(pd);
+			return -ENOMEM;
+		}
+
+		memcpy(frames[count].data, wireData, header->caplen);
+		frames[count].len = header->caplen;
+		frames[count].tstamp.tv_sec = header->ts.tv_sec;
+		frames[count].tstamp.tv_nsec = header->ts.tv_usec * 1000;
+		count++;
+	}
+
+	if(ret == -1)
+		arglog(LOG_ALERT, "Error reading %s, replaying the %lu frames read: %s\n", path, count, pcap_geterr(pd));
+
+	pcap_close(pd);
+
+	*framesOut = frames;
+	*countOut = count;
+	return 0;
+}
+
+int run_replay(const char *path, unsigned int loops)
+{
+	int ret;
+	int oldLevel;
+	bool oldResults;
+	unsigned int loop = 0;
+	unsigned long i = 0;
+	unsigned long count = 0;
+	int linkLayerLen = 0;
+	struct replay_frame *frames = NULL;
+	struct packet_data packet;
+	struct packet_pool pool;
+	struct replay_stage *stage = NULL;
+	struct timespec start, end, t0, t1, t2;
+
+	if((ret = load_frames(path, &frames, &count, &linkLayerLen)) < 0)
+		return ret;
+
+	arglog(LOG_ALERT, "Replaying %lu frames from %s %u time(s)\n", count, path, loops);
+
+	memset(&stats, 0, sizeof(stats));
+	set_send_hook(counting_sink, &stats);
+
+	// Same allocation behavior as a receive worker
+	if(init_packet_pool(&pool, DEFAULT_POOL_SIZE) == 0)
+		set_packet_pool(&pool);
+
+	// Per-packet logging would swamp what we're trying to measure
+	oldLevel = set_log_level(LOG_ALERT);
+	oldResults = set_log_results(false);
+
+	current_time(&start);
+
+	for(loop = 0; loop < loops; loop++)
+	{
+		for(i = 0; i < count; i++)
+		{
+			memset(&packet, 0, sizeof(packet));
+			packet.data = frames[i].data;
+			packet.len = frames[i].len;
+			packet.linkLayerLen = linkLayerLen;
+			packet.tstamp = frames[i].tstamp;
+			// Frames are replayed again on the next loop, so they must not be touched
+			packet.buf = NULL;
+			packet.bufLen = 0;
+
+			stats.packets++;
+			stats.bytes += packet.len;
+
+			current_time(&t0);
+			ret = parse_packet(&packet);
+			current_time(&t1);
+
+			stats.parse.packets++;
+			stats.parse.ns += time_offset_ns(&t0, &t1);
+
+			if(ret || !packet_ipv4(&packet))
+			{
+				stats.skipped++;
+				continue;
+			}
+
+			// Same split the capture filters make on a live gateway
+			if(!mask_array_cmp(ADDR_SIZE, gate_mask(), gate_base_ip(), &packet_ipv4(&packet)->saddr))
+			{
+				stage = &stats.outbound;
+				direct_outbound(&packet);
+			}
+			else if(!mask_array_cmp(ADDR_SIZE, gate_mask(), gate_base_ip(), &packet_ipv4(&packet)->daddr))
+			{
+				stage = &stats.inbound;
+				direct_inbound(&packet);
+			}
+			else
+			{
+				stats.skipped++;
+				continue;
+			}
+
+			current_time(&t2);
+			stage->packets++;
+			stage->ns += time_offset_ns(&t1, &t2);
+		}
+	}
+
+	current_time(&end);
+	stats.elapsedNs = time_offset_ns(&start, &end);
+
+	set_log_level(oldLevel);
+	set_log_results(oldResults);
+	set_send_hook(NULL, NULL);
+	set_packet_pool(NULL);
+	uninit_packet_pool(&pool);
+
+	print_replay_stats(&stats);
+
+	free_frames(frames, count);
+
+	return 0;
+}
+
+static void print_stage(const char *name, const struct replay_stage *stage)
+{
+	arglog(LOG_ALERT, "  %-9s %12lu packets %10.1f ns/packet\n", name, stage->packets,
+		(stage->packets ? (double)stage->ns / stage->packets : 0.0));
+}
+
+void print_replay_stats(const struct replay_stats *stats)
+{
+	double secs = stats->elapsedNs / 1e9;
+
+	if(secs <= 0)
+		secs = 1e-9;
+
+	arglog(LOG_ALERT, "Replay finished in %.3f s\n", secs);
+	arglog(LOG_ALERT, "  in:  %lu packets (%lu skipped), %lu bytes: %.0f packets/s, %.2f Mbit/s\n",
+		stats->packets, stats->skipped, stats->bytes,
+		stats->packets / secs, stats->bytes * 8 / secs / 1e6);
+	arglog(LOG_ALERT, "  out: %lu packets, %lu bytes: %.0f packets/s, %.2f Mbit/s\n",
+		stats->sent, stats->sentBytes,
+		stats->sent / secs, stats->sentBytes * 8 / secs / 1e6);
+
+	print_stage("parse", &stats->parse);
+	print_stage("outbound", &stats->outbound);
+	print_stage("inbound", &stats->inbound);
+}
+
@@ -0,0 +1,51 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "settings.h"
+
+// A captured frame held in memory for replay
+typedef struct replay_frame {
+	uint8_t *data;
+	unsigned long len;
+	struct timespec tstamp;
+} replay_frame;
+
+// Time spent in one part of processing, across every replayed packet
+typedef struct replay_stage {
+	uint64_t packets;
+	int64_t ns;
+} replay_stage;
+
+// Results of a replay run
+typedef struct replay_stats {
+	uint64_t packets;
+	uint64_t bytes;
+	uint64_t skipped; // Not IPv4, or neither to nor from our network
+
+	// Whatever the handlers tried to send, counted instead of sent
+	uint64_t sent;
+	uint64_t sentBytes;
+
+	struct replay_stage parse;
+	struct replay_stage outbound;
+	struct replay_stage inbound;
+
+	int64_t elapsedNs;
+} replay_stats;
+
+// Benchmark mode. Loads every frame from the pcap file at path into memory,
+// then feeds them loops times through parse_packet() and direct_outbound()
+// or direct_inbound() (decided by which side of our network the packet is on)
+// as fast as possible. Nothing is put on the wire: the send path is replaced
+// by a counting sink. Hopper and NAT must already be initialized; the director
+// must not be. Returns 0 on success, negative on error
+int run_replay(const char *path, unsigned int loops);
+
+// Prints the results of a run
+void print_replay_stats(const struct replay_stats *stats);
+
+#endif
+
@@ -4,6 +4,7 @@
 #include <string.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <unistd.h>
 
 #include "arg_error.h"
 #include "settings.h"
@@ -86,6 +87,18 @@ int read_config(struct config_data *conf)
 	}
 	conf->hopRate = atol(line);
 
+	// Anything else is optional tuning
+	set_config_defaults(conf);
+	while(!get_next_line(confFile, line, MAX_CONF_LINE))
+	{
+		if(parse_config_option(conf, line))
+		{
+			arglog(LOG_DEBUG, "Problem with option '%s' in conf\n", line);
+			fclose(confFile);
+			return -ARG_CONFIG_BAD;
+		}
+	}
+
 	fclose(confFile);
 	confFile = NULL;
 
@@ -156,6 +169,197 @@ void release_config(struct config_data *conf)
 	}
 }
 
+void set_config_defaults(struct config_data *conf)
+{
+	conf->captureMode = CAPTURE_PCAP;
+	conf->internalMode = INTERNAL_CAPTURE;
+	conf->workers = DEFAULT_WORKERS;
+	conf->busyPoll = 0;
+	conf->hopFilter = 1;
+	conf->sendBatch = DEFAULT_SEND_BATCH;
+	conf->sendFlush = DEFAULT_SEND_FLUSH;
+	conf->poolSize = DEFAULT_POOL_SIZE;
+	conf->pipeline = 0;
+	conf->pipelineRing = DEFAULT_PIPELINE_RING;
+	conf->pipelineFull = PIPELINE_FULL_DROP;
+	conf->ringBlockSize = DEFAULT_RING_BLOCK_SIZE;
+	conf->ringBlockCount = DEFAULT_RING_BLOCK_COUNT;
+	conf->ringBlockTimeout = DEFAULT_RING_BLOCK_TIMEOUT;
+	conf->xskMode = XSK_MODE_AUTO;
+	conf->xskFrames = DEFAULT_XSK_FRAMES;
+	conf->cryptoProvider = CRYPTO_AUTO;
+	conf->replayWindow = DEFAULT_REPLAY_WINDOW;
+	conf->logResults = 1;
+}
+
+int parse_config_option(struct config_data *conf, const char *line)
+{
+	char name[MAX_CONF_LINE];
+	char value[MAX_CONF_LINE];
+	long num = 0;
+
+	if(sscanf(line, "%s %s", name, value) != 2)
+		return -ARG_CONFIG_BAD;
+
+	num = atol(value);
+
+	if(strcmp(name, "capture") == 0)
+	{
+		if(strcmp(value, "pcap") == 0)
+			conf->captureMode = CAPTURE_PCAP;
+		else if(strcmp(value, "tpacket") == 0)
+			conf->captureMode = CAPTURE_TPACKET;
+		else if(strcmp(value, "xdp") == 0)
+			conf->captureMode = CAPTURE_XDP;
+		else
+			return -ARG_CONFIG_BAD;
+	}
+	else if(strcmp(name, "ring_block_size") == 0)
+	{
+		// Kernel requires blocks be a multiple of the page size
+		if(num <= 0 || num % getpagesize() != 0 || num % RING_FRAME_SIZE != 0)
+			return -ARG_CONFIG_BAD;
+		conf->ringBlockSize = num;
+	}
+	else if(strcmp(name, "ring_blocks") == 0)
+	{
+		if(num <= 0)
+			return -ARG_CONFIG_BAD;
+		conf->ringBlockCount = num;
+	}
+	else if(strcmp(name, "ring_block_timeout") == 0)
+	{
+		if(num <= 0)
+			return -ARG_CONFIG_BAD;
+		conf->ringBlockTimeout = num;
+	}
+	else if(strcmp(name, "internal") == 0)
+	{
+		if(strcmp(value, "capture") == 0)
+			conf->internalMode = INTERNAL_CAPTURE;
+		else if(strcmp(value, "tun") == 0)
+			conf->internalMode = INTERNAL_TUN;
+		else
+			return -ARG_CONFIG_BAD;
+	}
+	else if(strcmp(name, "workers") == 0)
+	{
+		if(num < 1 || num > MAX_WORKERS)
+			return -ARG_CONFIG_BAD;
+		conf->workers = num;
+	}
+	else if(strcmp(name, "busy_poll") == 0)
+	{
+		if(num < 0)
+			return -ARG_CONFIG_BAD;
+		conf->busyPoll = num;
+	}
+	else if(strcmp(name, "hop_filter") == 0)
+	{
+		if(strcmp(value, "on") == 0)
+			conf->hopFilter = 1;
+		else if(strcmp(value, "off") == 0)
+			conf->hopFilter = 0;
+		else
+			return -ARG_CONFIG_BAD;
+	}
+	else if(strcmp(name, "send_batch") == 0)
+	{
+		if(num < 1 || num > MAX_SEND_BATCH)
+			return -ARG_CONFIG_BAD;
+		conf->sendBatch = num;
+	}
+	else if(strcmp(name, "send_flush") == 0)
+	{
+		if(num < 1)
+			return -ARG_CONFIG_BAD;
+		conf->sendFlush = num;
+	}
+	else if(strcmp(name, "pool_size") == 0)
+	{
+		if(num < MIN_POOL_SIZE)
+			return -ARG_CONFIG_BAD;
+		conf->poolSize = num;
+	}
+	else if(strcmp(name, "pipeline") == 0)
+	{
+		if(strcmp(value, "on") == 0)
+			conf->pipeline = 1;
+		else if(strcmp(value, "off") == 0)
+			conf->pipeline = 0;
+		else
+			return -ARG_CONFIG_BAD;
+	}
+	else if(strcmp(name, "pipeline_ring") == 0)
+	{
+		if(num <= 0 || (num & (num - 1)) != 0)
+			return -ARG_CONFIG_BAD;
+		conf->pipelineRing = num;
+	}
+	else if(strcmp(name, "pipeline_full") == 0)
+	{
+		if(strcmp(value, "drop") == 0)
+			conf->pipelineFull = PIPELINE_FULL_DROP;
+		else if(strcmp(value, "wait") == 0)
+			conf->pipelineFull = PIPELINE_FULL_WAIT;
+		else
+			return -ARG_CONFIG_BAD;
+	}
+	else if(strcmp(name, "xdp_mode") == 0)
+	{
+		if(strcmp(value, "auto") == 0)
+			conf->xskMode = XSK_MODE_AUTO;
+		else if(strcmp(value, "native") == 0)
+			conf->xskMode = XSK_MODE_NATIVE;
+		else if(strcmp(value, "generic") == 0)
+			conf->xskMode = XSK_MODE_GENERIC;
+		else
+			return -ARG_CONFIG_BAD;
+	}
+	else if(strcmp(name, "xdp_frames") == 0)
+	{
+		// Need enough to keep both the fill ring and transmit reserve stocked
+		if(num < MIN_XSK_FRAMES)
+			return -ARG_CONFIG_BAD;
+		conf->xskFrames = num;
+	}
+	else if(strcmp(name, "crypto") == 0)
+	{
+		if(strcmp(value, "auto") == 0)
+			conf->cryptoProvider = CRYPTO_AUTO;
+		else if(strcmp(value, "polarssl") == 0)
+			conf->cryptoProvider = CRYPTO_POLARSSL;
+		else if(strcmp(value, "openssl") == 0)
+			conf->cryptoProvider = CRYPTO_OPENSSL;
+		else
+			return -ARG_CONFIG_BAD;
+	}
+	else if(strcmp(name, "replay_window") == 0)
+	{
+		// At least one slot's worth, see antireplay.h
+		if(num < 32 || num > MAX_REPLAY_WINDOW || (num & (num - 1)) != 0)
+			return -ARG_CONFIG_BAD;
+		conf->replayWindow = num;
+	}
+	else if(strcmp(name, "log_results") == 0)
+	{
+		if(strcmp(value, "on") == 0)
+			conf->logResults = 1;
+		else if(strcmp(value, "off") == 0)
+			conf->logResults = 0;
+		else
+			return -ARG_CONFIG_BAD;
+	}
+	else
+	{
+		arglog(LOG_DEBUG, "Unknown configuration option %s\n", name);
+		return -ARG_CONFIG_BAD;
+	}
+
+	arglog(LOG_DEBUG, "Option %s set to %s\n", name, value);
+	return 0;
+}
+
 int read_public_key(const struct config_data *conf, struct arg_network_info *gate)
 {
 	int ret;
@@ -40,6 +40,12 @@
 // be ready to receive. Easier than an overkill barrier.)
 #define INITIAL_CONNECT_WAIT 3
 
+// Hop epochs each gate's hop schedule holds, and the longest the schedule
+// thread sleeps between refreshes (ms). It wakes after a quarter of the
+// schedule has gone by, so with fast hop rates it refreshes more often
+#define HOP_SCHEDULE_SIZE 16
+#define HOP_SCHEDULE_MAX_WAIT 1000
+
 // Number of seconds between full checks of the NAT table for expired connections
 #define NAT_CLEAN_TIME 20
 
@@ -49,9 +55,11 @@
 /************************************************
 * Packet settings
 ************************************************/
-// Sequence numbers may have to wrap if they reach 2^32. How far from the boundary will we
-// accept a sudden reversion to the beginnig?
-#define SEQ_NUM_WRAP_ALLOWANCE 10
+// How far behind the newest sequence number seen from a gate packets are still
+// accepted (once each), so reordering doesn't drop them. Power of 2, may be
+// overridden in the main configuration file
+#define DEFAULT_REPLAY_WINDOW 1024
+#define MAX_REPLAY_WINDOW 4096
 
 // Actually compute new UDP, TCP, and IP checksums as needed. If disabled, checksums are set to 0
 #define COMPUTE_CHECKSUMS
@@ -77,16 +85,87 @@
 #define SHA1_HASH_SIZE 20
 
 /***********************************************
-* Misc
+* Capture
 ***********************************************/
-#define SYMMETRIC_ALGO "AES-256-CTR"
-#define HASH_ALGO "SHA256"
+// Defaults for the TPACKET_V3 receive ring. Each may be overridden in
+// the main configuration file (see read_config())
+#define DEFAULT_RING_BLOCK_SIZE (1 << 20)
+#define DEFAULT_RING_BLOCK_COUNT 64
+#define DEFAULT_RING_BLOCK_TIMEOUT 10 // ms
+
+// Nominal frame size handed to the kernel for the ring. TPACKET_V3 packs
+// variable-sized frames into blocks, so this only bounds the frame count
+#define RING_FRAME_SIZE 2048
+
+// Receive workers per interface. Each gets its own capture socket and
+// buffers, with flows spread between them by PACKET_FANOUT (or RSS for XDP)
+#define DEFAULT_WORKERS 1
+#define MAX_WORKERS 16
+
+// Most frames handled per pcap_dispatch() before checking for shutdown
+#define PCAP_DISPATCH_BATCH 64
+
+// Defaults for each sending thread's queue: packets sent together and
+// the longest the first of them waits for the rest (usec)
+#define DEFAULT_SEND_BATCH 32
+#define DEFAULT_SEND_FLUSH 50
+#define MAX_SEND_BATCH 64
+
+// Packet buffers each thread that builds packets keeps in its pool
+#define DEFAULT_POOL_SIZE 4096
+#define MIN_POOL_SIZE 64
+
+// Entries in each ring between pipeline stages (power of 2)
+#define DEFAULT_PIPELINE_RING 1024
+
+// Idle pipeline stages yield this many times before sleeping (ns) between checks
+#define PIPELINE_IDLE_SPINS 64
+#define PIPELINE_IDLE_SLEEP 50000
+
+// Default number of umem frames given to each interface for AF_XDP
+#define DEFAULT_XSK_FRAMES 4096
+#define MIN_XSK_FRAMES 1024
 
 /***********************************************
 * Configuration/settings manager
 ***********************************************/
 struct arg_network_info;
 
+// Ways packets may be pulled off of the interfaces
+enum {
+	CAPTURE_PCAP,
+	CAPTURE_TPACKET,
+	CAPTURE_XDP,
+	CAPTURE_TUN, // Internal side only, see INTERNAL_TUN
+};
+
+// What the internal device is
+enum {
+	INTERNAL_CAPTURE, // Real interface, captured with the capture mode above
+	INTERNAL_TUN, // Multi-queue TUN device we read and write IP packets on
+};
+
+// What a pipeline stage does when the next stage's ring is full. Capture
+// always drops so it never falls behind the kernel
+enum {
+	PIPELINE_FULL_DROP,
+	PIPELINE_FULL_WAIT,
+};
+
+// How the XDP program is attached when capturing with AF_XDP
+enum {
+	XSK_MODE_AUTO, // Native if the driver supports it, generic otherwise
+	XSK_MODE_NATIVE,
+	XSK_MODE_GENERIC,
+};
+
+// Library used for the per-packet crypto (see crypto.h)
+enum {
+	CRYPTO_AUTO, // OpenSSL if built in and it agrees with PolarSSL
+	CRYPTO_POLARSSL,
+	CRYPTO_OPENSSL,
+};
+
 // Names of all the gates we have configuration FILES for (only hard files,
 // not gates we learned of through trust data)
 typedef struct gate_list {
@@ -106,12 +185,40 @@ typedef struct config_data {
 
 	struct gate_list *gate;
 	long hopRate;
+
+	// Optional settings, given as "<name> <value>" lines after the required ones
+	int captureMode;
+	int internalMode;
+	int workers;
+	int busyPoll;
+	int hopFilter;
+	int sendBatch;
+	int sendFlush;
+	unsigned int poolSize;
+	int pipeline;
+	unsigned int pipelineRing;
+	int pipelineFull;
+	unsigned int ringBlockSize;
+	unsigned int ringBlockCount;
+	unsigned int ringBlockTimeout;
+	int xskMode;
+	unsigned int xskFrames;
+	int cryptoProvider;
+	unsigned int replayWindow;
+	int logResults;
 } config_data;
 
 // Work with configuration files
 int read_config(struct config_data *conf);
 void release_config(struct config_data *conf);
 
+// Fills in the defaults for all optional settings
+void set_config_defaults(struct config_data *conf);
+
+// Applies a single "<name> <value>" line from the configuration file
+// Returns 0 on success, -ARG_CONFIG_BAD if the option is unknown or invalid
+int parse_config_option(struct config_data *conf, const char *line);
+
 // Helpers to read in certain data
 int read_public_key(const struct config_data *conf, struct arg_network_info *gate);
 int read_private_key(const struct config_data *conf, struct arg_network_info *gate);
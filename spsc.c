@@ -0,0 +1,79 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "spsc.h"
+#include "utility.h"
+
+int init_spsc_ring(struct spsc_ring *ring, uint32_t size)
+{
+	memset(ring, 0, sizeof(struct spsc_ring));
+
+	if(size == 0 || (size & (size - 1)) != 0)
+	{
+		arglog(LOG_DEBUG, "Ring size %u is not a power of 2\n", size);
+		return -EINVAL;
+	}
+
+	ring->slots = (void**)calloc(size, sizeof(void*));
+	if(ring->slots == NULL)
+	{
+		arglog(LOG_DEBUG, "Unable to allocate ring of %u entries\n", size);
+		return -ENOMEM;
+	}
+
+	ring->size = size;
+	ring->mask = size - 1;
+
+	return 0;
+}
+
+void uninit_spsc_ring(struct spsc_ring *ring)
+{
+	if(ring->slots != NULL)
+	{
+		free(ring->slots);
+		ring->slots = NULL;
+	}
+}
+
+bool spsc_push(struct spsc_ring *ring, void *item)
+{
+	uint32_t head = ring->head;
+
+	if(head - ring->cachedTail == ring->size)
+	{
+		ring->cachedTail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+		if(head - ring->cachedTail == ring->size)
+			return false;
+	}
+
+	ring->slots[head & ring->mask] = item;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+void *spsc_pop(struct spsc_ring *ring)
+{
+	uint32_t tail = ring->tail;
+	void *item = NULL;
+
+	if(tail == ring->cachedHead)
+	{
+		ring->cachedHead = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if(tail == ring->cachedHead)
+			return NULL;
+	}
+
+	item = ring->slots[tail & ring->mask];
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+	return item;
+}
+
+uint32_t spsc_count(struct spsc_ring *ring)
+{
+	return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
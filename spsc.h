@@ -0,0 +1,41 @@
+#ifndef SPSC_H
+#define SPSC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define CACHE_LINE_SIZE 64
+
+// Bounded single-producer/single-consumer queue of pointers. Exactly one
+// thread may push and exactly one (other) thread may pop; no locks are taken.
+// Each side keeps a cached copy of the other's index so the shared cache
+// lines are only touched when the ring looks full or empty
+typedef struct spsc_ring {
+	void **slots;
+	uint32_t size;
+	uint32_t mask;
+
+	// Producer side
+	uint32_t head __attribute__((aligned(CACHE_LINE_SIZE)));
+	uint32_t cachedTail;
+
+	// Consumer side
+	uint32_t tail __attribute__((aligned(CACHE_LINE_SIZE)));
+	uint32_t cachedHead;
+} spsc_ring;
+
+// Size must be a power of 2
+int init_spsc_ring(struct spsc_ring *ring, uint32_t size);
+void uninit_spsc_ring(struct spsc_ring *ring);
+
+// Adds item to the ring. Returns false if the ring is full
+bool spsc_push(struct spsc_ring *ring, void *item);
+
+// Removes the oldest item from the ring. Returns NULL if it is empty
+void *spsc_pop(struct spsc_ring *ring);
+
+// Number of items waiting. Only exact when called from one of the two sides
+uint32_t spsc_count(struct spsc_ring *ring);
+
+#endif
+
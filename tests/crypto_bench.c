@@ -0,0 +1,153 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "settings.h"
+#include "crypto.h"
+#include "utility.h"
+
+// Bytes in each packet, and packets run through each provider
+#define BENCH_SIZE 1500
+#define BENCH_ROUNDS 20000
+
+// Small packets the HMAC keying cost is timed at, where it matters most
+static const size_t hmacSizes[] = {40, 64, 128, 256, 576};
+
+// Providers init_crypto() can be told to use
+static const struct {
+	const char *name;
+	int provider;
+} providers[] = {
+	{"polarssl", CRYPTO_POLARSSL},
+	{"openssl", CRYPTO_OPENSSL},
+};
+
+// MB/s, given how long BENCH_ROUNDS packets took
+static long bench_speed(const struct timespec *begin, const struct timespec *end)
+{
+	int64_t ns = time_offset_ns(begin, end);
+
+	if(ns <= 0)
+		ns = 1;
+
+	return (long)((int64_t)BENCH_SIZE * BENCH_ROUNDS * 1000 / ns);
+}
+
+// Encrypt then HMAC, the way versions before AEAD wrap packets
+static long bench_ctr_hmac(struct sym_key *key, const uint8_t *nonce, uint8_t *buf)
+{
+	uint8_t mac[SYM_HMAC_SIZE];
+	struct timespec begin;
+	struct timespec end;
+	int i = 0;
+
+	current_time(&begin);
+	for(i = 0; i < BENCH_ROUNDS; i++)
+	{
+		sym_ctr(key, nonce, buf, BENCH_SIZE, buf);
+		sym_hmac(key, buf, BENCH_SIZE, mac);
+	}
+	current_time(&end);
+
+	return bench_speed(&begin, &end);
+}
+
+// One-pass AEAD
+static long bench_aead(struct sym_key *key, const uint8_t *nonce, uint8_t *buf)
+{
+	uint8_t tag[SYM_AEAD_TAG_SIZE];
+	struct timespec begin;
+	struct timespec end;
+	int i = 0;
+
+	current_time(&begin);
+	for(i = 0; i < BENCH_ROUNDS; i++)
+		sym_aead_seal(key, nonce, nonce, 8, buf, BENCH_SIZE, buf, tag);
+	current_time(&end);
+
+	return bench_speed(&begin, &end);
+}
+
+// Nanoseconds per HMAC of len bytes. Pre-keyed uses the states sym_key_set()
+// prepared, the way every packet is done; otherwise the key is set for each
+// one, as it was before those states were kept
+static long bench_hmac(struct sym_key *key, const uint8_t *keyData, const uint8_t *buf,
+					   size_t len, bool preKeyed)
+{
+	uint8_t mac[SYM_HMAC_SIZE];
+	struct timespec begin;
+	struct timespec end;
+	int i = 0;
+
+	current_time(&begin);
+	for(i = 0; i < BENCH_ROUNDS; i++)
+	{
+		if(!preKeyed)
+			sym_key_set(key, keyData, AES_KEY_SIZE);
+		sym_hmac(key, buf, len, mac);
+	}
+	current_time(&end);
+
+	return (long)(time_offset_ns(&begin, &end) / BENCH_ROUNDS);
+}
+
+int main(int argc, char *argv[])
+{
+	struct sym_key key;
+	uint8_t keyData[AES_KEY_SIZE];
+	uint8_t nonce[AES_BLOCK_SIZE];
+	uint8_t buf[BENCH_SIZE];
+	int count = sizeof(providers) / sizeof(providers[0]);
+	int i = 0;
+	int j = 0;
+
+	get_random_bytes(keyData, sizeof(keyData));
+	get_random_bytes(nonce, sizeof(nonce));
+	get_random_bytes(buf, sizeof(buf));
+
+	printf("%-10s%16s%16s   (MB/s, %i byte packets)\n", "provider", "ctr+hmac", "gcm", BENCH_SIZE);
+	for(i = 0; i < count; i++)
+	{
+		// Not built in
+		if(init_crypto(providers[i].provider) != 0)
+			continue;
+
+		memset(&key, 0, sizeof(key));
+		if(sym_key_set(&key, keyData, sizeof(keyData)) != 0)
+		{
+			printf("%-10sunable to set key\n", providers[i].name);
+			continue;
+		}
+
+		printf("%-10s%16ld", providers[i].name, bench_ctr_hmac(&key, nonce, buf));
+		if(crypto_has_aead())
+			printf("%16ld\n", bench_aead(&key, nonce, buf));
+		else
+			printf("%16s\n", "-");
+
+		sym_key_free(&key);
+	}
+
+	printf("\n%-10s%8s%16s%16s   (ns per HMAC-SHA256)\n", "provider", "bytes", "pre-keyed", "re-keyed");
+	for(i = 0; i < count; i++)
+	{
+		if(init_crypto(providers[i].provider) != 0)
+			continue;
+
+		memset(&key, 0, sizeof(key));
+		if(sym_key_set(&key, keyData, sizeof(keyData)) != 0)
+			continue;
+
+		for(j = 0; j < sizeof(hmacSizes) / sizeof(hmacSizes[0]); j++)
+		{
+			printf("%-10s%8lu%16ld%16ld\n", providers[i].name, (unsigned long)hmacSizes[j],
+				bench_hmac(&key, keyData, buf, hmacSizes[j], true),
+				bench_hmac(&key, keyData, buf, hmacSizes[j], false));
+		}
+
+		sym_key_free(&key);
+	}
+
+	return 0;
+}
@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "csum.h"
+#include "utility.h"
+
+// Bytes summed in each round of each size, enough that timing is steady
+#define BENCH_TOTAL_BYTES (256L * 1024 * 1024)
+
+// Throughput of func over len bytes of buf, in GB/s
+static double bench(csum_func func, const uint8_t *buf, unsigned long len)
+{
+	struct timespec begin;
+	struct timespec end;
+	volatile uint32_t sink = 0;
+	long rounds = BENCH_TOTAL_BYTES / len;
+	long i = 0;
+	int64_t ns = 0;
+
+	current_time(&begin);
+	for(i = 0; i < rounds; i++)
+		sink += func(buf, len, 0);
+	current_time(&end);
+
+	ns = time_offset_ns(&begin, &end);
+	if(ns <= 0)
+		ns = 1;
+
+	return (double)len * rounds / ns;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long sizes[] = {64, 576, 1500, 9000, 64 * 1024};
+	struct csum_impl impls[CSUM_MAX_IMPLS];
+	uint8_t *buf = NULL;
+	int count = 0;
+	int i = 0;
+	int j = 0;
+
+	buf = malloc(sizes[sizeof(sizes) / sizeof(sizes[0]) - 1]);
+	if(buf == NULL)
+		return 1;
+
+	for(i = 0; i < sizes[sizeof(sizes) / sizeof(sizes[0]) - 1]; i++)
+		buf[i] = rand();
+
+	printf("%-10s", "bytes");
+	for(j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++)
+		printf("%10lu", sizes[j]);
+	printf("   (GB/s)\n");
+
+	count = csum_get_impls(impls, CSUM_MAX_IMPLS - 1);
+	impls[count].name = "reference";
+	impls[count++].func = csum_reference;
+
+	for(i = 0; i < count; i++)
+	{
+		printf("%-10s", impls[i].name);
+		for(j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++)
+			printf("%10.2f", bench(impls[i].func, buf, sizes[j]));
+		printf("\n");
+	}
+
+	free(buf);
+	return 0;
+}
+
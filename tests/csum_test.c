@@ -0,0 +1,77 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "csum.h"
+
+// Largest buffer summed, and random cases tried per implementation
+#define TEST_BUF_SIZE (64 * 1024)
+#define TEST_RANDOM_CASES 20000
+
+// Every implementation the CPU supports must match csum_reference() for
+// every short length at every alignment, and for random long ones
+static int check_impl(const struct csum_impl *impl, const uint8_t *buf)
+{
+	unsigned long offset = 0;
+	unsigned long len = 0;
+	uint32_t start = 0;
+	int failed = 0;
+	int i = 0;
+
+	for(offset = 0; offset < 64; offset++)
+	{
+		for(len = 0; len <= 256; len++)
+		{
+			if(csum_fold(impl->func(buf + offset, len, 0)) != csum_fold(csum_reference(buf + offset, len, 0)))
+			{
+				printf("%s: mismatch at offset %lu, length %lu\n", impl->name, offset, len);
+				failed++;
+			}
+		}
+	}
+
+	for(i = 0; i < TEST_RANDOM_CASES; i++)
+	{
+		offset = rand() % 64;
+		len = rand() % (TEST_BUF_SIZE - offset);
+		start = rand();
+
+		if(csum_fold(impl->func(buf + offset, len, start)) != csum_fold(csum_reference(buf + offset, len, start)))
+		{
+			printf("%s: mismatch at offset %lu, length %lu, starting sum %x\n", impl->name, offset, len, start);
+			failed++;
+		}
+	}
+
+	printf("%s: %s\n", impl->name, failed ? "FAIL" : "ok");
+	return failed;
+}
+
+int main(int argc, char *argv[])
+{
+	struct csum_impl impls[CSUM_MAX_IMPLS];
+	uint8_t *buf = NULL;
+	int count = 0;
+	int failed = 0;
+	int i = 0;
+
+	buf = malloc(TEST_BUF_SIZE);
+	if(buf == NULL)
+		return 1;
+
+	srand(1);
+	for(i = 0; i < TEST_BUF_SIZE; i++)
+		buf[i] = rand();
+
+	// All ones is where carries are most likely to go wrong
+	for(i = 0; i < 1024; i++)
+		buf[i] = 0xFF;
+
+	count = csum_get_impls(impls, CSUM_MAX_IMPLS);
+	for(i = 0; i < count; i++)
+		failed += check_impl(&impls[i], buf);
+
+	free(buf);
+	return failed ? 1 : 0;
+}
+
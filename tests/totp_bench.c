@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "settings.h"
+#include "crypto.h"
+#include "totp.h"
+#include "utility.h"
+
+// Gate counts timed, up to the largest, and rounds of each
+#define BENCH_MAX_GATES 256
+#define BENCH_ROUNDS 200
+
+// Nanoseconds to refresh the hop schedule of each of gates gates, either
+// with hotp() from scratch (keyData set) or batched a gate at a time the
+// way refresh_hop_schedule() does it
+static long bench(const uint8_t *keyData, const struct hotp_key *keys, int gates)
+{
+	const struct hotp_key *keyList[HOP_SCHEDULE_SIZE];
+	unsigned long epochs[HOP_SCHEDULE_SIZE];
+	uint32_t out[HOP_SCHEDULE_SIZE];
+	struct timespec begin;
+	struct timespec end;
+	int round = 0;
+	int gate = 0;
+	int i = 0;
+
+	current_time(&begin);
+	for(round = 0; round < BENCH_ROUNDS; round++)
+	{
+		for(gate = 0; gate < gates; gate++)
+		{
+			for(i = 0; i < HOP_SCHEDULE_SIZE; i++)
+				epochs[i] = round + i;
+
+			if(keyData != NULL)
+			{
+				for(i = 0; i < HOP_SCHEDULE_SIZE; i++)
+					out[i] = hotp(keyData + gate * HOP_KEY_SIZE, HOP_KEY_SIZE, epochs[i]);
+			}
+			else
+			{
+				for(i = 0; i < HOP_SCHEDULE_SIZE; i++)
+					keyList[i] = &keys[gate];
+				hotp_batch(keyList, epochs, out, HOP_SCHEDULE_SIZE);
+			}
+		}
+	}
+	current_time(&end);
+
+	return (long)(time_offset_ns(&begin, &end) / BENCH_ROUNDS);
+}
+
+int main(int argc, char *argv[])
+{
+	uint8_t *keyData = NULL;
+	struct hotp_key *keys = NULL;
+	int gates = 0;
+	int i = 0;
+
+	init_totp();
+
+	keyData = malloc(BENCH_MAX_GATES * HOP_KEY_SIZE);
+	keys = malloc(BENCH_MAX_GATES * sizeof(struct hotp_key));
+	if(keyData == NULL || keys == NULL)
+		return 1;
+
+	get_random_bytes(keyData, BENCH_MAX_GATES * HOP_KEY_SIZE);
+	for(i = 0; i < BENCH_MAX_GATES; i++)
+		hotp_key_set(&keys[i], keyData + i * HOP_KEY_SIZE, HOP_KEY_SIZE);
+
+	printf("%-8s%16s%16s   (%i epochs per gate)\n", "gates", "batched ns", "hotp() ns", HOP_SCHEDULE_SIZE);
+	for(gates = 1; gates <= BENCH_MAX_GATES; gates *= 4)
+		printf("%-8i%16ld%16ld\n", gates, bench(NULL, keys, gates), bench(keyData, NULL, gates));
+
+	free(keyData);
+	free(keys);
+	return 0;
+}
+
@@ -0,0 +1,463 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TOTP_X86
+#endif
+
+#include <polarssl/sha1.h>
+
+#include "totp.h"
+#include "settings.h"
+#include "crypto.h"
+#include "utility.h"
+
+#define SHA1_BLOCK_SIZE 64
+
+// Runs one block through each of the lanes the implementation handles, of
+// which the first n are wanted. SIMD versions do all their lanes regardless.
+// state[i][lane] is word i of a lane's state, msg[i][lane] word i of its block
+typedef void (*sha1_lanes_func)(uint32_t state[5][HOTP_MAX_LANES], const uint32_t msg[16][HOTP_MAX_LANES], int n);
+
+static const uint32_t sha1IV[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+
+static inline uint32_t rotl32(uint32_t x, int n)
+{
+	return (x << n) | (x >> (32 - n));
+}
+
+static inline uint32_t load_be32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+// Plain SHA1 compression of one block into state
+static void sha1_compress(uint32_t state[5], const uint32_t msg[16])
+{
+	uint32_t w[16];
+	uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+	uint32_t f, k, t;
+	int i = 0;
+
+	memcpy(w, msg, sizeof(w));
+	for(i = 0; i < 80; i++)
+	{
+		if(i >= 16)
+			w[i & 15] = rotl32(w[(i - 3) & 15] ^ w[(i - 8) & 15] ^ w[(i - 14) & 15] ^ w[i & 15], 1);
+
+		if(i < 20)
+		{
+			f = (b & c) | (~b & d);
+			k = 0x5A827999;
+		}
+		else if(i < 40)
+		{
+			f = b ^ c ^ d;
+			k = 0x6ED9EBA1;
+		}
+		else if(i < 60)
+		{
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8F1BBCDC;
+		}
+		else
+		{
+			f = b ^ c ^ d;
+			k = 0xCA62C1D6;
+		}
+
+		t = rotl32(a, 5) + f + e + k + w[i & 15];
+		e = d;
+		d = c;
+		c = rotl32(b, 30);
+		b = a;
+		a = t;
+	}
+
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+}
+
+// One lane at a time, so only the wanted ones
+static void sha1_lanes_generic(uint32_t state[5][HOTP_MAX_LANES], const uint32_t msg[16][HOTP_MAX_LANES], int n)
+{
+	uint32_t laneState[5];
+	uint32_t laneMsg[16];
+	int lane = 0;
+	int i = 0;
+
+	for(lane = 0; lane < n; lane++)
+	{
+		for(i = 0; i < 5; i++)
+			laneState[i] = state[i][lane];
+		for(i = 0; i < 16; i++)
+			laneMsg[i] = msg[i][lane];
+
+		sha1_compress(laneState, laneMsg);
+
+		for(i = 0; i < 5; i++)
+			state[i][lane] = laneState[i];
+	}
+}
+
+#ifdef TOTP_X86
+#define ROTL_SSE2(x, n) _mm_or_si128(_mm_slli_epi32((x), (n)), _mm_srli_epi32((x), 32 - (n)))
+
+// Four lanes at once, one per 32-bit element. Lanes 4-7 are left alone
+__attribute__((target("sse2")))
+static void sha1_lanes_sse2(uint32_t state[5][HOTP_MAX_LANES], const uint32_t msg[16][HOTP_MAX_LANES], int n)
+{
+	__m128i s[5];
+	__m128i w[16];
+	__m128i a, b, c, d, e, f, k, t;
+	int i = 0;
+
+	for(i = 0; i < 5; i++)
+		s[i] = _mm_loadu_si128((const __m128i*)state[i]);
+	for(i = 0; i < 16; i++)
+		w[i] = _mm_loadu_si128((const __m128i*)msg[i]);
+
+	a = s[0];
+	b = s[1];
+	c = s[2];
+	d = s[3];
+	e = s[4];
+
+	for(i = 0; i < 80; i++)
+	{
+		if(i >= 16)
+		{
+			t = _mm_xor_si128(_mm_xor_si128(w[(i - 3) & 15], w[(i - 8) & 15]),
+				_mm_xor_si128(w[(i - 14) & 15], w[i & 15]));
+			w[i & 15] = ROTL_SSE2(t, 1);
+		}
+
+		if(i < 20)
+		{
+			f = _mm_or_si128(_mm_and_si128(b, c), _mm_andnot_si128(b, d));
+			k = _mm_set1_epi32(0x5A827999);
+		}
+		else if(i < 40)
+		{
+			f = _mm_xor_si128(_mm_xor_si128(b, c), d);
+			k = _mm_set1_epi32(0x6ED9EBA1);
+		}
+		else if(i < 60)
+		{
+			f = _mm_or_si128(_mm_and_si128(b, c), _mm_and_si128(d, _mm_or_si128(b, c)));
+			k = _mm_set1_epi32(0x8F1BBCDC);
+		}
+		else
+		{
+			f = _mm_xor_si128(_mm_xor_si128(b, c), d);
+			k = _mm_set1_epi32(0xCA62C1D6);
+		}
+
+		t = _mm_add_epi32(_mm_add_epi32(ROTL_SSE2(a, 5), f), _mm_add_epi32(_mm_add_epi32(e, k), w[i & 15]));
+		e = d;
+		d = c;
+		c = ROTL_SSE2(b, 30);
+		b = a;
+		a = t;
+	}
+
+	_mm_storeu_si128((__m128i*)state[0], _mm_add_epi32(s[0], a));
+	_mm_storeu_si128((__m128i*)state[1], _mm_add_epi32(s[1], b));
+	_mm_storeu_si128((__m128i*)state[2], _mm_add_epi32(s[2], c));
+	_mm_storeu_si128((__m128i*)state[3], _mm_add_epi32(s[3], d));
+	_mm_storeu_si128((__m128i*)state[4], _mm_add_epi32(s[4], e));
+}
+
+#define ROTL_AVX2(x, n) _mm256_or_si256(_mm256_slli_epi32((x), (n)), _mm256_srli_epi32((x), 32 - (n)))
+
+// Eight lanes at once, same as sha1_lanes_sse2()
+__attribute__((target("avx2")))
+static void sha1_lanes_avx2(uint32_t state[5][HOTP_MAX_LANES], const uint32_t msg[16][HOTP_MAX_LANES], int n)
+{
+	__m256i s[5];
+	__m256i w[16];
+	__m256i a, b, c, d, e, f, k, t;
+	int i = 0;
+
+	for(i = 0; i < 5; i++)
+		s[i] = _mm256_loadu_si256((const __m256i*)state[i]);
+	for(i = 0; i < 16; i++)
+		w[i] = _mm256_loadu_si256((const __m256i*)msg[i]);
+
+	a = s[0];
+	b = s[1];
+	c = s[2];
+	d = s[3];
+	e = s[4];
+
+	for(i = 0; i < 80; i++)
+	{
+		if(i >= 16)
+		{
+			t = _mm256_xor_si256(_mm256_xor_si256(w[(i - 3) & 15], w[(i - 8) & 15]),
+				_mm256_xor_si256(w[(i - 14) & 15], w[i & 15]));
+			w[i & 15] = ROTL_AVX2(t, 1);
+		}
+
+		if(i < 20)
+		{
+			f = _mm256_or_si256(_mm256_and_si256(b, c), _mm256_andnot_si256(b, d));
+			k = _mm256_set1_epi32(0x5A827999);
+		}
+		else if(i < 40)
+		{
+			f = _mm256_xor_si256(_mm256_xor_si256(b, c), d);
+			k = _mm256_set1_epi32(0x6ED9EBA1);
+		}
+		else if(i < 60)
+		{
+			f = _mm256_or_si256(_mm256_and_si256(b, c), _mm256_and_si256(d, _mm256_or_si256(b, c)));
+			k = _mm256_set1_epi32(0x8F1BBCDC);
+		}
+		else
+		{
+			f = _mm256_xor_si256(_mm256_xor_si256(b, c), d);
+			k = _mm256_set1_epi32(0xCA62C1D6);
+		}
+
+		t = _mm256_add_epi32(_mm256_add_epi32(ROTL_AVX2(a, 5), f),
+			_mm256_add_epi32(_mm256_add_epi32(e, k), w[i & 15]));
+		e = d;
+		d = c;
+		c = ROTL_AVX2(b, 30);
+		b = a;
+		a = t;
+	}
+
+	_mm256_storeu_si256((__m256i*)state[0], _mm256_add_epi32(s[0], a));
+	_mm256_storeu_si256((__m256i*)state[1], _mm256_add_epi32(s[1], b));
+	_mm256_storeu_si256((__m256i*)state[2], _mm256_add_epi32(s[2], c));
+	_mm256_storeu_si256((__m256i*)state[3], _mm256_add_epi32(s[3], d));
+	_mm256_storeu_si256((__m256i*)state[4], _mm256_add_epi32(s[4], e));
+}
+#endif
+
+static sha1_lanes_func sha1Lanes = sha1_lanes_generic;
+static int sha1LaneCount = HOTP_MAX_LANES;
+
+// Words of a final block holding len bytes of data, which follow prefixLen
+// bytes already compressed
+static void sha1_final_block(uint32_t *msg, int stride, const uint8_t *data, unsigned int len,
+							 unsigned int prefixLen)
+{
+	uint8_t block[SHA1_BLOCK_SIZE];
+	uint64_t bits = (uint64_t)(prefixLen + len) * 8;
+	int i = 0;
+
+	memset(block, 0, sizeof(block));
+	memcpy(block, data, len);
+	block[len] = 0x80;
+	for(i = 0; i < 8; i++)
+		block[SHA1_BLOCK_SIZE - 1 - i] = (uint8_t)(bits >> (8 * i));
+
+	for(i = 0; i < 16; i++)
+		msg[i * stride] = load_be32(block + 4 * i);
+}
+
+void hotp_key_set(struct hotp_key *key, const uint8_t *keyData, unsigned int klen)
+{
+	uint8_t hashed[SHA1_HASH_SIZE];
+	uint8_t pad[SHA1_BLOCK_SIZE];
+	uint32_t msg[16];
+	int i = 0;
+
+	// Long keys are hashed first (RFC 2104)
+	if(klen > SHA1_BLOCK_SIZE)
+	{
+		sha1(keyData, klen, hashed);
+		keyData = hashed;
+		klen = sizeof(hashed);
+	}
+
+	memset(pad, 0x36, sizeof(pad));
+	for(i = 0; i < klen; i++)
+		pad[i] ^= keyData[i];
+	for(i = 0; i < 16; i++)
+		msg[i] = load_be32(pad + 4 * i);
+	memcpy(key->inner, sha1IV, sizeof(sha1IV));
+	sha1_compress(key->inner, msg);
+
+	memset(pad, 0x5C, sizeof(pad));
+	for(i = 0; i < klen; i++)
+		pad[i] ^= keyData[i];
+	for(i = 0; i < 16; i++)
+		msg[i] = load_be32(pad + 4 * i);
+	memcpy(key->outer, sha1IV, sizeof(sha1IV));
+	sha1_compress(key->outer, msg);
+
+	memset(pad, 0, sizeof(pad));
+}
+
+// Computes up to HOTP_MAX_LANES values with lanes, n of them meaningful
+static void hotp_group(sha1_lanes_func lanes, const struct hotp_key *const *keys,
+					   const unsigned long *counts, uint32_t *out, int n)
+{
+	uint32_t state[5][HOTP_MAX_LANES];
+	uint32_t msg[16][HOTP_MAX_LANES];
+	uint8_t digest[SHA1_HASH_SIZE];
+	uint8_t *curr = NULL;
+	unsigned long count;
+	int offset = 0;
+	int lane = 0;
+	int i = 0;
+
+	// Unused lanes just repeat the first
+	for(lane = 0; lane < HOTP_MAX_LANES; lane++)
+	{
+		i = (lane < n ? lane : 0);
+		count = counts[i];
+
+		// Counter goes in the same way hotp() gives it to sha1_hmac()
+		sha1_final_block(&msg[0][lane], HOTP_MAX_LANES, (uint8_t*)&count, sizeof(count), SHA1_BLOCK_SIZE);
+		for(i = 0; i < 5; i++)
+			state[i][lane] = keys[lane < n ? lane : 0]->inner[i];
+	}
+
+	lanes(state, (const uint32_t (*)[HOTP_MAX_LANES])msg, n);
+
+	// Outer hash over the inner digest
+	for(lane = 0; lane < HOTP_MAX_LANES; lane++)
+	{
+		for(i = 0; i < 5; i++)
+		{
+			digest[4 * i] = state[i][lane] >> 24;
+			digest[4 * i + 1] = state[i][lane] >> 16;
+			digest[4 * i + 2] = state[i][lane] >> 8;
+			digest[4 * i + 3] = state[i][lane];
+		}
+
+		sha1_final_block(&msg[0][lane], HOTP_MAX_LANES, digest, sizeof(digest), SHA1_BLOCK_SIZE);
+		for(i = 0; i < 5; i++)
+			state[i][lane] = keys[lane < n ? lane : 0]->outer[i];
+	}
+
+	lanes(state, (const uint32_t (*)[HOTP_MAX_LANES])msg, n);
+
+	// Truncate, same as hotp()
+	for(lane = 0; lane < n; lane++)
+	{
+		for(i = 0; i < 5; i++)
+		{
+			digest[4 * i] = state[i][lane] >> 24;
+			digest[4 * i + 1] = state[i][lane] >> 16;
+			digest[4 * i + 2] = state[i][lane] >> 8;
+			digest[4 * i + 3] = state[i][lane];
+		}
+
+		offset = digest[SHA1_HASH_SIZE - 1] & 0xf;
+		curr = digest + offset;
+		out[lane] = (curr[0] & 0x7f) << 24 | curr[1] << 16 | curr[2] << 8 | curr[3];
+	}
+}
+
+// hotp_batch() with a particular implementation, laneCount values per pass
+static void hotp_batch_with(sha1_lanes_func lanes, int laneCount, const struct hotp_key *const *keys,
+							const unsigned long *counts, uint32_t *out, int n)
+{
+	int done = 0;
+	int group = 0;
+
+	for(done = 0; done < n; done += group)
+	{
+		group = n - done;
+		if(group > laneCount)
+			group = laneCount;
+
+		hotp_group(lanes, keys + done, counts + done, out + done, group);
+	}
+}
+
+void hotp_batch(const struct hotp_key *const *keys, const unsigned long *counts, uint32_t *out, int n)
+{
+	hotp_batch_with(sha1Lanes, sha1LaneCount, keys, counts, out, n);
+}
+
+// Compares an implementation against hotp() on random keys and counts
+static int hotp_check(sha1_lanes_func lanes, int laneCount)
+{
+	uint8_t keyData[HOTP_MAX_LANES * 2][HOP_KEY_SIZE];
+	struct hotp_key keys[HOTP_MAX_LANES * 2];
+	const struct hotp_key *keyList[HOTP_MAX_LANES * 2];
+	unsigned long counts[HOTP_MAX_LANES * 2];
+	uint32_t out[HOTP_MAX_LANES * 2];
+	int round = 0;
+	int n = 0;
+	int i = 0;
+
+	for(round = 0; round < 20; round++)
+	{
+		n = 1 + rand() % (HOTP_MAX_LANES * 2);
+		for(i = 0; i < n; i++)
+		{
+			get_random_bytes(keyData[i], sizeof(keyData[i]));
+			get_random_bytes(&counts[i], sizeof(counts[i]));
+			hotp_key_set(&keys[i], keyData[i], sizeof(keyData[i]));
+			keyList[i] = &keys[i];
+		}
+
+		hotp_batch_with(lanes, laneCount, keyList, counts, out, n);
+
+		for(i = 0; i < n; i++)
+		{
+			if(out[i] != hotp(keyData[i], sizeof(keyData[i]), counts[i]))
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+void init_totp(void)
+{
+	struct {
+		const char *name;
+		sha1_lanes_func func;
+		int lanes;
+		int supported;
+	} impls[] = {
+		#ifdef TOTP_X86
+		{"avx2", sha1_lanes_avx2, 8, 0},
+		{"sse2", sha1_lanes_sse2, 4, 0},
+		#endif
+		{"generic", sha1_lanes_generic, HOTP_MAX_LANES, 1},
+	};
+	int count = sizeof(impls) / sizeof(impls[0]);
+	int chosen = count - 1;
+	int j = 0;
+
+	#ifdef TOTP_X86
+	__builtin_cpu_init();
+	impls[0].supported = __builtin_cpu_supports("avx2");
+	impls[1].supported = __builtin_cpu_supports("sse2");
+	#endif
+
+	// Widest (earliest listed) one that's supported and agrees with hotp() wins
+	for(j = count - 1; j >= 0; j--)
+	{
+		if(!impls[j].supported)
+			continue;
+
+		if(hotp_check(impls[j].func, impls[j].lanes))
+		{
+			arglog(LOG_ALERT, "%s HOTP disagrees with reference, not using\n", impls[j].name);
+			continue;
+		}
+
+		chosen = j;
+	}
+
+	sha1Lanes = impls[chosen].func;
+	sha1LaneCount = impls[chosen].lanes;
+	arglog(LOG_DEBUG, "Using %s HOTP (%i at once)\n", impls[chosen].name, sha1LaneCount);
+}
+
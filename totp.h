@@ -0,0 +1,30 @@
+#ifndef TOTP_H
+#define TOTP_H
+
+#include <stdint.h>
+
+// Most HOTP values computed side by side (one per 32-bit lane of an AVX2 register)
+#define HOTP_MAX_LANES 8
+
+// A hop key with HMAC-SHA1's inner and outer pads already run through the
+// compression function. An HOTP value is then one more block for each
+typedef struct hotp_key {
+	uint32_t inner[5];
+	uint32_t outer[5];
+} hotp_key;
+
+// Picks the widest multi-buffer SHA1 the CPU supports, after checking it
+// against hotp() (see crypto.h) on random keys and counts. Anything that
+// disagrees is skipped. Until this is called the generic version is used,
+// so it is always safe to compute values. Timings are in tests/totp_bench
+void init_totp(void);
+
+// Keys key from klen bytes of keyData
+void hotp_key_set(struct hotp_key *key, const uint8_t *keyData, unsigned int klen);
+
+// out[i] = hotp(keys[i], counts[i]) for each of the n, as many at once as the
+// CPU allows. Keys may repeat
+void hotp_batch(const struct hotp_key *const *keys, const unsigned long *counts, uint32_t *out, int n);
+
+#endif
+
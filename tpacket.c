@@ -0,0 +1,306 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
+
+#include "tpacket.h"
+#include "packet.h"
+#include "utility.h"
+#include "arg_error.h"
+
+int init_tpacket_ring(struct tpacket_ring *ring, const char *dev,
+					  const struct config_data *config, struct bpf_program *filter)
+{
+	int version = TPACKET_V3;
+	unsigned int reserve = PACKET_HEADROOM;
+	struct tpacket_req3 req;
+	struct sockaddr_ll addr;
+	struct packet_mreq mreq;
+	int ifindex = 0;
+
+	ring->fd = -1;
+	ring->map = NULL;
+	ring->currBlock = 0;
+	ring->blockSize = config->ringBlockSize;
+	ring->blockCount = config->ringBlockCount;
+	ring->blockTimeout = config->ringBlockTimeout;
+
+	if((ifindex = if_nametoindex(dev)) == 0)
+	{
+		arglog(LOG_FATAL, "Unable to find index of %s for ring\n", dev);
+		return -ARG_CONFIG_BAD;
+	}
+
+	if((ring->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL))) < 0)
+	{
+		arglog(LOG_FATAL, "Unable to create packet socket for %s: %s\n", dev, strerror(errno));
+		return -errno;
+	}
+
+	// Filter must be in place before we bind, otherwise everything seen
+	// in between will land in the ring
+	if(attach_filter(ring->fd, filter) < 0)
+	{
+		arglog(LOG_FATAL, "Unable to attach filter to ring on %s: %s\n", dev, strerror(errno));
+		uninit_tpacket_ring(ring);
+		return -ARG_CONFIG_BAD;
+	}
+
+	if(setsockopt(ring->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0)
+	{
+		arglog(LOG_FATAL, "TPACKET_V3 not supported on %s: %s\n", dev, strerror(errno));
+		uninit_tpacket_ring(ring);
+		return -ARG_CONFIG_BAD;
+	}
+
+	// Space in front of every frame, so headers can be prepended in place
+	if(setsockopt(ring->fd, SOL_PACKET, PACKET_RESERVE, &reserve, sizeof(reserve)) < 0)
+	{
+		arglog(LOG_FATAL, "Unable to reserve frame headroom on %s: %s\n", dev, strerror(errno));
+		uninit_tpacket_ring(ring);
+		return -ARG_CONFIG_BAD;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = ring->blockSize;
+	req.tp_block_nr = ring->blockCount;
+	req.tp_frame_size = RING_FRAME_SIZE;
+	req.tp_frame_nr = (ring->blockSize / RING_FRAME_SIZE) * ring->blockCount;
+	req.tp_retire_blk_tov = ring->blockTimeout;
+	req.tp_feature_req_word = 0;
+
+	if(setsockopt(ring->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0)
+	{
+		arglog(LOG_FATAL, "Unable to create %u x %u byte ring on %s: %s\n",
+			ring->blockCount, ring->blockSize, dev, strerror(errno));
+		uninit_tpacket_ring(ring);
+		return -ARG_CONFIG_BAD;
+	}
+
+	ring->mapLen = (size_t)ring->blockSize * ring->blockCount;
+	ring->map = mmap(NULL, ring->mapLen, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, 0);
+	if(ring->map == MAP_FAILED)
+	{
+		arglog(LOG_FATAL, "Unable to map ring for %s: %s\n", dev, strerror(errno));
+		ring->map = NULL;
+		uninit_tpacket_ring(ring);
+		return -ENOMEM;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sll_family = AF_PACKET;
+	addr.sll_protocol = htons(ETH_P_ALL);
+	addr.sll_ifindex = ifindex;
+	if(bind(ring->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+	{
+		arglog(LOG_FATAL, "Unable to bind ring to %s: %s\n", dev, strerror(errno));
+		uninit_tpacket_ring(ring);
+		return -ARG_CONFIG_BAD;
+	}
+
+	// Same as pcap_set_promisc()
+	memset(&mreq, 0, sizeof(mreq));
+	mreq.mr_ifindex = ifindex;
+	mreq.mr_type = PACKET_MR_PROMISC;
+	if(setsockopt(ring->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0)
+	{
+		arglog(LOG_FATAL, "Unable to put %s into promiscuous mode: %s\n", dev, strerror(errno));
+		uninit_tpacket_ring(ring);
+		return -ARG_CONFIG_BAD;
+	}
+
+	arglog(LOG_DEBUG, "Receive ring on %s: %u blocks of %u bytes, %u ms timeout\n",
+		dev, ring->blockCount, ring->blockSize, ring->blockTimeout);
+
+	return 0;
+}
+
+int attach_filter(int fd, struct bpf_program *filter)
+{
+	struct sock_fprog fprog;
+
+	fprog.len = filter->bf_len;
+	fprog.filter = (struct sock_filter*)filter->bf_insns;
+	if(setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) < 0)
+		return -errno;
+
+	return 0;
+}
+
+void uninit_tpacket_ring(struct tpacket_ring *ring)
+{
+	if(ring->map != NULL)
+	{
+		munmap(ring->map, ring->mapLen);
+		ring->map = NULL;
+	}
+
+	if(ring->fd >= 0)
+	{
+		close(ring->fd);
+		ring->fd = -1;
+	}
+}
+
+int init_tpacket_tx_ring(struct tpacket_tx_ring *ring, int ifindex, unsigned int frameCount)
+{
+	int version = TPACKET_V2;
+	struct tpacket_req req;
+	struct sockaddr_ll addr;
+	unsigned int framesPerBlock = getpagesize() / RING_FRAME_SIZE;
+
+	ring->fd = -1;
+	ring->ifindex = ifindex;
+	ring->map = NULL;
+	ring->currFrame = 0;
+	ring->pending = 0;
+
+	// Blocks must be whole pages
+	if(framesPerBlock == 0)
+		framesPerBlock = 1;
+	ring->frameCount = (frameCount + framesPerBlock - 1) / framesPerBlock * framesPerBlock;
+
+	// Protocol 0 so nothing received is queued here
+	if((ring->fd = socket(AF_PACKET, SOCK_RAW, 0)) < 0)
+		return -errno;
+
+	if(setsockopt(ring->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0)
+	{
+		uninit_tpacket_tx_ring(ring);
+		return -ARG_CONFIG_BAD;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.tp_frame_size = RING_FRAME_SIZE;
+	req.tp_frame_nr = ring->frameCount;
+	req.tp_block_size = RING_FRAME_SIZE * framesPerBlock;
+	req.tp_block_nr = ring->frameCount / framesPerBlock;
+
+	if(setsockopt(ring->fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0)
+	{
+		uninit_tpacket_tx_ring(ring);
+		return -ARG_CONFIG_BAD;
+	}
+
+	ring->mapLen = (size_t)req.tp_block_size * req.tp_block_nr;
+	ring->map = mmap(NULL, ring->mapLen, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, 0);
+	if(ring->map == MAP_FAILED)
+	{
+		ring->map = NULL;
+		uninit_tpacket_tx_ring(ring);
+		return -ENOMEM;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sll_family = AF_PACKET;
+	addr.sll_protocol = 0;
+	addr.sll_ifindex = ifindex;
+	if(bind(ring->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+	{
+		uninit_tpacket_tx_ring(ring);
+		return -errno;
+	}
+
+	return 0;
+}
+
+void uninit_tpacket_tx_ring(struct tpacket_tx_ring *ring)
+{
+	if(ring->map != NULL)
+	{
+		munmap(ring->map, ring->mapLen);
+		ring->map = NULL;
+	}
+
+	if(ring->fd >= 0)
+	{
+		close(ring->fd);
+		ring->fd = -1;
+	}
+}
+
+int tpacket_tx_queue(struct tpacket_tx_ring *ring, const uint8_t *frame, unsigned long len)
+{
+	struct tpacket2_hdr *hdr = NULL;
+	unsigned int dataOffset = TPACKET_ALIGN(sizeof(struct tpacket2_hdr));
+
+	if(len > RING_FRAME_SIZE - dataOffset)
+		return -EMSGSIZE;
+
+	hdr = (struct tpacket2_hdr*)(ring->map + (size_t)ring->currFrame * RING_FRAME_SIZE);
+
+	// Slots the kernel rejected are reusable, they just never went out
+	if(hdr->tp_status != TP_STATUS_AVAILABLE && hdr->tp_status != TP_STATUS_WRONG_FORMAT)
+		return -ENOBUFS;
+
+	// Don't touch the slot before we've seen the kernel release it
+	__sync_synchronize();
+
+	memcpy((uint8_t*)hdr + dataOffset, frame, len);
+	hdr->tp_len = len;
+
+	__sync_synchronize();
+	hdr->tp_status = TP_STATUS_SEND_REQUEST;
+
+	ring->currFrame = (ring->currFrame + 1) % ring->frameCount;
+	ring->pending++;
+
+	return 0;
+}
+
+int tpacket_tx_flush(struct tpacket_tx_ring *ring)
+{
+	int count = ring->pending;
+
+	if(count == 0)
+		return 0;
+
+	ring->pending = 0;
+	if(send(ring->fd, NULL, 0, MSG_DONTWAIT) < 0 && errno != EAGAIN)
+		return -errno;
+
+	return count;
+}
+
+int tpacket_dispatch(struct tpacket_ring *ring, tpacket_handler handler, void *arg)
+{
+	int count = 0;
+	struct tpacket_block_desc *block = NULL;
+	struct tpacket3_hdr *frame = NULL;
+	struct timespec tstamp;
+
+	block = (struct tpacket_block_desc*)(ring->map + (size_t)ring->currBlock * ring->blockSize);
+
+	if(!(block->hdr.bh1.block_status & TP_STATUS_USER))
+		return 0;
+
+	// Don't read frame data before we've seen the status flip
+	__sync_synchronize();
+
+	frame = (struct tpacket3_hdr*)((uint8_t*)block + block->hdr.bh1.offset_to_first_pkt);
+	for(count = 0; count < block->hdr.bh1.num_pkts; count++)
+	{
+		tstamp.tv_sec = frame->tp_sec;
+		tstamp.tv_nsec = frame->tp_nsec;
+
+		(*handler)(arg, (uint8_t*)frame + frame->tp_mac, frame->tp_snaplen, &tstamp);
+
+		frame = (struct tpacket3_hdr*)((uint8_t*)frame + frame->tp_next_offset);
+	}
+
+	// Hand the block back to the kernel
+	__sync_synchronize();
+	block->hdr.bh1.block_status = TP_STATUS_KERNEL;
+	ring->currBlock = (ring->currBlock + 1) % ring->blockCount;
+
+	return count;
+}
+
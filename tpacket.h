@@ -0,0 +1,81 @@
+#ifndef TPACKET_H
+#define TPACKET_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include <pcap.h>
+
+#include "settings.h"
+
+// Memory-mapped AF_PACKET (TPACKET_V3) receive ring. The kernel fills whole
+// blocks of frames, which are then walked in place without copying and without
+// a syscall per packet
+typedef struct tpacket_ring {
+	int fd;
+
+	uint8_t *map;
+	size_t mapLen;
+
+	unsigned int blockSize;
+	unsigned int blockCount;
+	unsigned int blockTimeout; // ms
+
+	// Next block we expect the kernel to hand us
+	unsigned int currBlock;
+} tpacket_ring;
+
+// Memory-mapped AF_PACKET (TPACKET_V2) transmit ring bound to one device.
+// Frames are copied into free slots and the kernel sends every slot marked
+// ready with a single send()
+typedef struct tpacket_tx_ring {
+	int fd;
+	int ifindex;
+
+	uint8_t *map;
+	size_t mapLen;
+
+	unsigned int frameCount;
+	unsigned int currFrame;
+
+	// Frames queued since the last flush
+	unsigned int pending;
+} tpacket_tx_ring;
+
+// Called for each frame in a block. Frame data is only valid until the
+// handler returns, at which point the block may be given back to the kernel.
+// Frames may be modified, and have PACKET_HEADROOM free in front of them
+typedef void (*tpacket_handler)(void *arg, uint8_t *frame, unsigned long len, const struct timespec *tstamp);
+
+// Opens a raw socket on dev, sets up the ring as described by config,
+// and attaches the given compiled filter. Device is placed in promiscuous mode
+int init_tpacket_ring(struct tpacket_ring *ring, const char *dev,
+					  const struct config_data *config, struct bpf_program *filter);
+void uninit_tpacket_ring(struct tpacket_ring *ring);
+
+// Opens a packet socket on the device and maps a ring of frameCount slots
+// (each RING_FRAME_SIZE) for transmitting. Receives nothing
+int init_tpacket_tx_ring(struct tpacket_tx_ring *ring, int ifindex, unsigned int frameCount);
+void uninit_tpacket_tx_ring(struct tpacket_tx_ring *ring);
+
+// Copies an ethernet frame into the next free slot. Returns 0 if queued,
+// -ENOBUFS if the kernel still owns every slot (flush and try again), and
+// -EMSGSIZE if the frame is larger than a slot
+int tpacket_tx_queue(struct tpacket_tx_ring *ring, const uint8_t *frame, unsigned long len);
+
+// Has the kernel send everything queued. Returns the number of frames
+// handed over, or negative on error
+int tpacket_tx_flush(struct tpacket_tx_ring *ring);
+
+// Puts filter on any packet socket (including the one under a pcap handle),
+// atomically replacing whatever was there
+int attach_filter(int fd, struct bpf_program *filter);
+
+// If the kernel has handed over the next block, passes every frame in it to
+// handler. Never blocks; wait for the ring's fd to be readable when this
+// returns 0. Returns the number of frames handled, or negative on error
+int tpacket_dispatch(struct tpacket_ring *ring, tpacket_handler handler, void *arg);
+
+#endif
+
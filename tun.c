@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <sys/ioctl.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_tun.h>
+
+#include "tun.h"
+#include "settings.h"
+#include "utility.h"
+#include "arg_error.h"
+
+int init_tun_queue(struct tun_queue *queue, const char *dev)
+{
+	struct ifreq ifr;
+
+	queue->fd = -1;
+	queue->buf = NULL;
+
+	if((queue->fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK)) < 0)
+	{
+		arglog(LOG_FATAL, "Unable to open /dev/net/tun: %s\n", strerror(errno));
+		return -errno;
+	}
+
+	// Every open/TUNSETIFF pair with IFF_MULTI_QUEUE adds another queue
+	// to the same device
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, dev, IFNAMSIZ - 1);
+	ifr.ifr_flags = IFF_TUN | IFF_NO_PI | IFF_MULTI_QUEUE;
+	if(ioctl(queue->fd, TUNSETIFF, &ifr) < 0)
+	{
+		arglog(LOG_FATAL, "Unable to attach queue to TUN device %s: %s\n", dev, strerror(errno));
+		uninit_tun_queue(queue);
+		return -ARG_CONFIG_BAD;
+	}
+
+	queue->buf = (uint8_t*)malloc((size_t)TUN_BATCH_SIZE * TUN_SLOT_SIZE);
+	if(queue->buf == NULL)
+	{
+		arglog(LOG_FATAL, "Unable to allocate TUN receive buffers\n");
+		uninit_tun_queue(queue);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+void uninit_tun_queue(struct tun_queue *queue)
+{
+	if(queue->buf != NULL)
+	{
+		free(queue->buf);
+		queue->buf = NULL;
+	}
+
+	if(queue->fd >= 0)
+	{
+		close(queue->fd);
+		queue->fd = -1;
+	}
+}
+
+int tun_dispatch(struct tun_queue *queue, tun_handler handler, void *arg)
+{
+	int i = 0;
+	int count = 0;
+	ssize_t len;
+	unsigned long lens[TUN_BATCH_SIZE];
+	struct timespec tstamp;
+
+	// Drain what's ready before doing any work on it
+	while(count < TUN_BATCH_SIZE)
+	{
+		len = read(queue->fd, queue->buf + (size_t)count * TUN_SLOT_SIZE + PACKET_HEADROOM, MAX_PACKET_SIZE);
+		if(len < 0)
+		{
+			if(errno == EAGAIN || errno == EINTR)
+				break;
+			return -errno;
+		}
+
+		if(len == 0)
+			break;
+
+		lens[count++] = len;
+	}
+
+	if(count == 0)
+		return 0;
+
+	// TUN gives no timestamps, so the whole batch shares one
+	clock_gettime(CLOCK_REALTIME, &tstamp);
+
+	for(i = 0; i < count; i++)
+		(*handler)(arg, queue->buf + (size_t)i * TUN_SLOT_SIZE + PACKET_HEADROOM, lens[i], &tstamp);
+
+	return count;
+}
+
+int tun_write(struct tun_queue *queue, const struct packet_data *packet)
+{
+	int len = 0;
+
+	if(!packet_ipv4(packet))
+		return -ARG_PACKET_PARSE_ERROR;
+
+	// The raw socket fills in the IP checksum for us, TUN doesn't. Packets
+	// being sent are done with once this returns, so update it in place
+	ip_csum(packet_ipv4(packet));
+
+	len = ntohs(packet_ipv4(packet)->tot_len);
+	if(write(queue->fd, (uint8_t*)packet_ipv4(packet), len) < 0)
+	{
+		arglog(LOG_DEBUG, "TUN write failed, errno %i. Msg size %i\n", errno, len);
+		return -errno;
+	}
+
+	return 0;
+}
+
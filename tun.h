@@ -0,0 +1,42 @@
+#ifndef TUN_H
+#define TUN_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "packet.h"
+#include "settings.h"
+
+// Most packets read off a queue before they're handed on
+#define TUN_BATCH_SIZE 32
+
+// Each receive slot has PACKET_HEADROOM free in front of the packet
+#define TUN_SLOT_SIZE (PACKET_HEADROOM + MAX_PACKET_SIZE)
+
+// One queue of a multi-queue TUN device. Each worker owns one, so reads
+// need no locking; writes of whole packets may come from any thread
+typedef struct tun_queue {
+	int fd;
+
+	// Receive slots for a batch, each big enough for any IP packet
+	// plus headroom
+	uint8_t *buf;
+} tun_queue;
+
+// Called for each IP packet read. See tpacket_handler
+typedef void (*tun_handler)(void *arg, uint8_t *frame, unsigned long len, const struct timespec *tstamp);
+
+// Attaches a new queue to the TUN device dev, creating the device if it
+// doesn't exist. Packets carry no link layer or packet info header
+int init_tun_queue(struct tun_queue *queue, const char *dev);
+void uninit_tun_queue(struct tun_queue *queue);
+
+// Reads as many packets as are ready (up to TUN_BATCH_SIZE), then passes
+// each to handler. Never blocks. Returns the number handled, or negative on error
+int tun_dispatch(struct tun_queue *queue, tun_handler handler, void *arg);
+
+// Hands an IPv4 packet to the kernel through the queue. Returns 0 on success
+int tun_write(struct tun_queue *queue, const struct packet_data *packet);
+
+#endif
+
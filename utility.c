@@ -9,6 +9,7 @@
 #include "packet.h"
 
 static int logLevel = LOG_DEBUG;
+static bool logResults = true;
 
 // Show hex of all data in buf
 void printRaw(int len, const void *buf)
@@ -65,6 +66,28 @@ int set_log_level(int level)
 	return old;
 }
 
+bool set_log_results(bool show)
+{
+	bool old = logResults;
+	logResults = show;
+	return old;
+}
+
+bool log_enabled(int level)
+{
+	// Below every other level, so it has its own switch
+	if(level == LOG_RESULTS)
+	{
+		#ifdef DISP_RESULTS
+		return logResults;
+		#else
+		return false;
+		#endif
+	}
+
+	return level <= logLevel;
+}
+
 void arglog(int level, char *fmt, ...)
 {
 	va_list ap;
@@ -79,12 +102,7 @@ void varglog(int level, char *fmt, va_list ap)
 	int fullLen = 40;
 	char *line = NULL;
 
-	#ifndef DISP_RESULTS
-	if(level == LOG_RESULTS)
-		return;
-	#endif
-
-	if(level <= logLevel)
+	if(log_enabled(level))
 	{
 		struct timeval out;
 		gettimeofday(&out, NULL);
@@ -113,10 +131,26 @@ void arglog_result(const struct packet_data *inPacket,
 				   const char *processor, const char *reason)
 {
 	char inPacketID[MAX_PACKET_ID_SIZE] = "";
-	char outPacketID[MAX_PACKET_ID_SIZE] = "";
+
+	if(!log_enabled(LOG_RESULTS))
+		return;
 
 	if(inPacket)
 		create_packet_id(inPacket, inPacketID, sizeof(inPacketID));
+
+	arglog_result_id(inPacketID, outPacket, is_inbound, is_accepted, processor, reason);
+}
+
+void arglog_result_id(const char *inPacketID,
+					  const struct packet_data *outPacket,
+					  char is_inbound, char is_accepted,
+					  const char *processor, const char *reason)
+{
+	char outPacketID[MAX_PACKET_ID_SIZE] = "";
+
+	if(!log_enabled(LOG_RESULTS))
+		return;
+
 	if(outPacket)
 		create_packet_id(outPacket, outPacketID, sizeof(outPacketID));
 
@@ -160,6 +194,12 @@ long time_offset(const struct timespec *begin, const struct timespec *end)
 	return diff;
 }
 
+int64_t time_offset_ns(const struct timespec *begin, const struct timespec *end)
+{
+	return ((int64_t)end->tv_sec - begin->tv_sec) * 1000000000LL
+		+ ((int64_t)end->tv_nsec - begin->tv_nsec);
+}
+
 void current_time_plus(struct timespec *ts, int ms)
 {
 	current_time(ts);
@@ -212,3 +252,36 @@ int mask_array_cmp(int len, const void *mask, const void *left, const void *righ
 	return 0;
 }
 
+int mask_prefix_len(int len, const void *mask, bool *contiguous)
+{
+	int i = 0;
+	int bits = 0;
+	uint8_t rest = 0;
+	const uint8_t *mCast = (const uint8_t*)mask;
+
+	// Whole bytes of ones
+	for(i = 0; i < len && mCast[i] == 0xFF; i++)
+		bits += 8;
+
+	// Partial byte
+	if(i < len)
+	{
+		rest = mCast[i];
+		while(rest & 0x80)
+		{
+			bits++;
+			rest <<= 1;
+		}
+
+		*contiguous = (rest == 0);
+		for(i++; i < len; i++)
+		{
+			if(mCast[i] != 0)
+				*contiguous = false;
+		}
+	}
+	else
+		*contiguous = true;
+
+	return bits;
+}
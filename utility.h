@@ -2,6 +2,7 @@
 #define UTILITY_H
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <time.h>
 #include <stdarg.h>
@@ -21,6 +22,14 @@ enum {
 struct packet_data;
 
 int set_log_level(int level);
+
+// Turns the per-packet accepted/rejected (LOG_RESULTS) lines on or off,
+// whatever the level. Returns the old setting
+bool set_log_results(bool show);
+
+// True if messages at level are shown. Lets callers skip work (like
+// create_packet_id()) that only feeds the log
+bool log_enabled(int level);
 void arglog(int level, char *fmt, ...);
 void varglog(int level, char *fmt, va_list ap);
 void arglog_result(const struct packet_data *inPacket,
@@ -28,6 +37,13 @@ void arglog_result(const struct packet_data *inPacket,
 				   char is_inbound, char is_accepted,
 				   const char *processor, const char *reason);
 
+// Same as arglog_result(), for when the incoming packet has since been
+// overwritten. inPacketID comes from create_packet_id()
+void arglog_result_id(const char *inPacketID,
+					  const struct packet_data *outPacket,
+					  char is_inbound, char is_accepted,
+					  const char *processor, const char *reason);
+
 // Returns the current monotonic time (not real-world time)
 void current_time(struct timespec *out);
 
@@ -38,6 +54,9 @@ long current_time_offset(const struct timespec *begin);
 // the number of milliseconds. Positive values indicate begin is before end
 long time_offset(const struct timespec *begin, const struct timespec *end);
 
+// Same as time_offset, but in nanoseconds, for timing short operations
+int64_t time_offset_ns(const struct timespec *begin, const struct timespec *end);
+
 // Returns the current time + the given number of milliseconds.
 // ms may be negative
 void current_time_plus(struct timespec *ts, int ms);
@@ -54,5 +73,9 @@ void mask_array(int len, const void *orig, const void *mask, void *result);
 // If equal, 0 is returned. Otherwise, non-0 (undefined beyond that)
 int mask_array_cmp(int len, const void *mask, const void *left, const void *right);
 
+// Number of leading one bits in mask. Sets *contiguous to whether every bit
+// after them is zero, so the mask is a plain prefix
+int mask_prefix_len(int len, const void *mask, bool *contiguous);
+
 #endif
 
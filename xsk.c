@@ -0,0 +1,599 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_xdp.h>
+#include <linux/if_link.h>
+#include <linux/bpf.h>
+
+#include "xsk.h"
+#include "utility.h"
+#include "arg_error.h"
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+/**************************
+Helpers
+**************************/
+static int sys_bpf(int cmd, union bpf_attr *attr)
+{
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static uint32_t ring_consumable(struct xsk_ring *ring)
+{
+	return __atomic_load_n(ring->producer, __ATOMIC_ACQUIRE) - *ring->consumer;
+}
+
+static uint32_t ring_producible(struct xsk_ring *ring)
+{
+	return ring->size - (*ring->producer - __atomic_load_n(ring->consumer, __ATOMIC_ACQUIRE));
+}
+
+static void ring_consume(struct xsk_ring *ring, uint32_t count)
+{
+	__atomic_store_n(ring->consumer, *ring->consumer + count, __ATOMIC_RELEASE);
+}
+
+static void ring_produce(struct xsk_ring *ring, uint32_t count)
+{
+	__atomic_store_n(ring->producer, *ring->producer + count, __ATOMIC_RELEASE);
+}
+
+static int map_ring(int fd, struct xsk_ring *ring, const struct xdp_ring_offset *off,
+					uint32_t size, size_t entrySize, off_t pgoff)
+{
+	ring->size = size;
+	ring->mask = size - 1;
+	ring->mapLen = off->desc + size * entrySize;
+	ring->map = mmap(NULL, ring->mapLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, pgoff);
+	if(ring->map == MAP_FAILED)
+	{
+		ring->map = NULL;
+		return -errno;
+	}
+
+	ring->producer = (uint32_t*)((uint8_t*)ring->map + off->producer);
+	ring->consumer = (uint32_t*)((uint8_t*)ring->map + off->consumer);
+	ring->flags = (uint32_t*)((uint8_t*)ring->map + off->flags);
+	ring->desc = (uint8_t*)ring->map + off->desc;
+
+	return 0;
+}
+
+static void unmap_ring(struct xsk_ring *ring)
+{
+	if(ring->map != NULL)
+	{
+		munmap(ring->map, ring->mapLen);
+		ring->map = NULL;
+	}
+}
+
+/**************************
+Umem
+**************************/
+int init_xsk_umem(struct xsk_umem *umem, unsigned int frameCount)
+{
+	umem->fd = -1;
+	umem->frameCount = frameCount;
+	umem->len = (size_t)frameCount * XSK_FRAME_SIZE;
+
+	umem->area = mmap(NULL, umem->len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if(umem->area == MAP_FAILED)
+	{
+		arglog(LOG_FATAL, "Unable to allocate %lu bytes of umem\n", umem->len);
+		umem->area = NULL;
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+void uninit_xsk_umem(struct xsk_umem *umem)
+{
+	if(umem->area != NULL)
+	{
+		munmap(umem->area, umem->len);
+		umem->area = NULL;
+	}
+}
+
+/**************************
+Device
+**************************/
+int init_xsk_device(struct xsk_device *dev, const char *name, unsigned int queues, int mode)
+{
+	union bpf_attr attr;
+	char log[1024] = "";
+
+	// Equivalent of:
+	//   return bpf_redirect_map(&xsks, ctx->rx_queue_index, XDP_PASS);
+	// Assembled by hand so we don't need a BPF toolchain
+	struct bpf_insn prog[] = {
+		// r2 = ctx->rx_queue_index
+		{ .code = BPF_LDX | BPF_W | BPF_MEM, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_1,
+		  .off = 16 },
+		// r1 = &xsks (two instructions)
+		{ .code = BPF_LD | BPF_DW | BPF_IMM, .dst_reg = BPF_REG_1, .src_reg = BPF_PSEUDO_MAP_FD },
+		{ .code = 0 },
+		// r3 = XDP_PASS
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_3, .imm = XDP_PASS },
+		// r0 = bpf_redirect_map(r1, r2, r3)
+		{ .code = BPF_JMP | BPF_CALL, .imm = BPF_FUNC_redirect_map },
+		{ .code = BPF_JMP | BPF_EXIT },
+	};
+
+	dev->progFd = -1;
+	dev->mapFd = -1;
+	dev->linkFd = -1;
+	dev->native = false;
+	dev->zeroCopy = false;
+
+	if((dev->ifindex = if_nametoindex(name)) == 0)
+	{
+		arglog(LOG_FATAL, "Unable to find index of %s for XDP\n", name);
+		return -ARG_CONFIG_BAD;
+	}
+
+	// Map from queue to socket
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_XSKMAP;
+	attr.key_size = sizeof(uint32_t);
+	attr.value_size = sizeof(uint32_t);
+	attr.max_entries = queues;
+	if((dev->mapFd = sys_bpf(BPF_MAP_CREATE, &attr)) < 0)
+	{
+		arglog(LOG_FATAL, "Unable to create XSK map for %s: %s\n", name, strerror(errno));
+		return -ARG_CONFIG_BAD;
+	}
+
+	prog[1].imm = dev->mapFd;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_XDP;
+	attr.insns = (uint64_t)(unsigned long)prog;
+	attr.insn_cnt = sizeof(prog) / sizeof(prog[0]);
+	attr.license = (uint64_t)(unsigned long)"GPL";
+	attr.log_buf = (uint64_t)(unsigned long)log;
+	attr.log_size = sizeof(log);
+	attr.log_level = 1;
+	if((dev->progFd = sys_bpf(BPF_PROG_LOAD, &attr)) < 0)
+	{
+		arglog(LOG_FATAL, "Unable to load XDP program for %s: %s\n%s\n", name, strerror(errno), log);
+		uninit_xsk_device(dev);
+		return -ARG_CONFIG_BAD;
+	}
+
+	// Prefer running in the driver, fall back to generic mode (which works
+	// everywhere, including veth pairs)
+	memset(&attr, 0, sizeof(attr));
+	attr.link_create.prog_fd = dev->progFd;
+	attr.link_create.target_ifindex = dev->ifindex;
+	attr.link_create.attach_type = BPF_XDP;
+
+	if(mode != XSK_MODE_GENERIC)
+	{
+		attr.link_create.flags = XDP_FLAGS_DRV_MODE;
+		if((dev->linkFd = sys_bpf(BPF_LINK_CREATE, &attr)) >= 0)
+			dev->native = true;
+		else if(mode == XSK_MODE_NATIVE)
+		{
+			arglog(LOG_FATAL, "Driver for %s does not support native XDP: %s\n", name, strerror(errno));
+			uninit_xsk_device(dev);
+			return -ARG_CONFIG_BAD;
+		}
+	}
+
+	if(dev->linkFd < 0)
+	{
+		attr.link_create.flags = XDP_FLAGS_SKB_MODE;
+		if((dev->linkFd = sys_bpf(BPF_LINK_CREATE, &attr)) < 0)
+		{
+			arglog(LOG_FATAL, "Unable to attach XDP program to %s: %s\n", name, strerror(errno));
+			uninit_xsk_device(dev);
+			return -ARG_CONFIG_BAD;
+		}
+	}
+
+	arglog(LOG_DEBUG, "XDP program attached to %s in %s mode\n", name, dev->native ? "native" : "generic");
+
+	return 0;
+}
+
+void uninit_xsk_device(struct xsk_device *dev)
+{
+	// Closing the link detaches the program
+	if(dev->linkFd >= 0)
+	{
+		close(dev->linkFd);
+		dev->linkFd = -1;
+	}
+	if(dev->progFd >= 0)
+	{
+		close(dev->progFd);
+		dev->progFd = -1;
+	}
+	if(dev->mapFd >= 0)
+	{
+		close(dev->mapFd);
+		dev->mapFd = -1;
+	}
+}
+
+/**************************
+Socket
+**************************/
+int init_xsk_socket(struct xsk_socket *sock, struct xsk_device *dev, const char *name,
+					unsigned int queue, struct xsk_umem *umem)
+{
+	int ret;
+	int ringSize = XSK_RING_SIZE;
+	struct xdp_umem_reg reg;
+	struct xdp_mmap_offsets off;
+	struct sockaddr_xdp addr;
+	socklen_t optlen;
+	union bpf_attr attr;
+	uint32_t key = queue;
+
+	memset(sock, 0, sizeof(struct xsk_socket));
+	sock->fd = -1;
+	sock->dev = dev;
+	sock->umem = umem;
+	sock->queue = queue;
+
+	if(get_mac_addr(name, sock->hwaddr) < 0)
+	{
+		arglog(LOG_FATAL, "Unable to get hardware address of %s\n", name);
+		return -ARG_CONFIG_BAD;
+	}
+
+	if((sock->fd = socket(AF_XDP, SOCK_RAW, 0)) < 0)
+	{
+		arglog(LOG_FATAL, "Unable to create XDP socket: %s\n", strerror(errno));
+		return -errno;
+	}
+
+	// First socket registers the umem, the rest share it
+	if(umem->fd < 0)
+	{
+		memset(&reg, 0, sizeof(reg));
+		reg.addr = (uint64_t)(unsigned long)umem->area;
+		reg.len = umem->len;
+		reg.chunk_size = XSK_FRAME_SIZE;
+		reg.headroom = 0;
+		if(setsockopt(sock->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0)
+		{
+			arglog(LOG_FATAL, "Unable to register umem: %s\n", strerror(errno));
+			uninit_xsk_socket(sock);
+			return -ARG_CONFIG_BAD;
+		}
+	}
+
+	// Every device/queue needs its own fill and completion rings, even with a shared umem
+	if(setsockopt(sock->fd, SOL_XDP, XDP_UMEM_FILL_RING, &ringSize, sizeof(ringSize)) < 0
+		|| setsockopt(sock->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &ringSize, sizeof(ringSize)) < 0
+		|| setsockopt(sock->fd, SOL_XDP, XDP_RX_RING, &ringSize, sizeof(ringSize)) < 0
+		|| setsockopt(sock->fd, SOL_XDP, XDP_TX_RING, &ringSize, sizeof(ringSize)) < 0)
+	{
+		arglog(LOG_FATAL, "Unable to size XDP rings: %s\n", strerror(errno));
+		uninit_xsk_socket(sock);
+		return -ARG_CONFIG_BAD;
+	}
+
+	optlen = sizeof(off);
+	if(getsockopt(sock->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0)
+	{
+		arglog(LOG_FATAL, "Unable to get XDP ring offsets: %s\n", strerror(errno));
+		uninit_xsk_socket(sock);
+		return -ARG_CONFIG_BAD;
+	}
+
+	if((ret = map_ring(sock->fd, &sock->rx, &off.rx, XSK_RING_SIZE, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING)) < 0
+		|| (ret = map_ring(sock->fd, &sock->tx, &off.tx, XSK_RING_SIZE, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING)) < 0
+		|| (ret = map_ring(sock->fd, &sock->fill, &off.fr, XSK_RING_SIZE, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING)) < 0
+		|| (ret = map_ring(sock->fd, &sock->comp, &off.cr, XSK_RING_SIZE, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING)) < 0)
+	{
+		arglog(LOG_FATAL, "Unable to map XDP rings: %s\n", strerror(-ret));
+		uninit_xsk_socket(sock);
+		return ret;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sxdp_family = AF_XDP;
+	addr.sxdp_ifindex = dev->ifindex;
+	addr.sxdp_queue_id = queue;
+	addr.sxdp_flags = XDP_USE_NEED_WAKEUP;
+	if(umem->fd >= 0)
+	{
+		addr.sxdp_flags |= XDP_SHARED_UMEM;
+		addr.sxdp_shared_umem_fd = umem->fd;
+	}
+
+	// Zero copy is only possible when running in the driver
+	ret = -1;
+	if(dev->native)
+	{
+		addr.sxdp_flags |= XDP_ZEROCOPY;
+		if((ret = bind(sock->fd, (struct sockaddr*)&addr, sizeof(addr))) == 0)
+			dev->zeroCopy = true;
+		addr.sxdp_flags &= ~XDP_ZEROCOPY;
+	}
+
+	if(ret < 0)
+	{
+		addr.sxdp_flags |= XDP_COPY;
+		if(bind(sock->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+		{
+			arglog(LOG_FATAL, "Unable to bind XDP socket to %s queue %u: %s\n", name, queue, strerror(errno));
+			uninit_xsk_socket(sock);
+			return -ARG_CONFIG_BAD;
+		}
+	}
+
+	if(umem->fd < 0)
+		umem->fd = sock->fd;
+
+	// Start receiving
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = dev->mapFd;
+	attr.key = (uint64_t)(unsigned long)&key;
+	attr.value = (uint64_t)(unsigned long)&sock->fd;
+	if(sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0)
+	{
+		arglog(LOG_FATAL, "Unable to add XDP socket to map: %s\n", strerror(errno));
+		uninit_xsk_socket(sock);
+		return -ARG_CONFIG_BAD;
+	}
+
+	arglog(LOG_DEBUG, "XDP socket bound to %s queue %u (%s)\n", name, queue,
+		dev->zeroCopy ? "zero copy" : "copy");
+
+	return 0;
+}
+
+void uninit_xsk_socket(struct xsk_socket *sock)
+{
+	unmap_ring(&sock->rx);
+	unmap_ring(&sock->tx);
+	unmap_ring(&sock->fill);
+	unmap_ring(&sock->comp);
+
+	if(sock->fd >= 0)
+	{
+		close(sock->fd);
+		sock->fd = -1;
+	}
+}
+
+/**************************
+Port
+**************************/
+// Moves frames the TX socket is done with back to our free list
+static void reap_completions(struct xsk_port *port)
+{
+	uint32_t i = 0;
+	uint32_t count = ring_consumable(&port->tx->comp);
+	uint32_t cons = *port->tx->comp.consumer;
+	uint64_t *addrs = (uint64_t*)port->tx->comp.desc;
+
+	for(i = 0; i < count; i++)
+	{
+		uint64_t addr = addrs[(cons + i) & port->tx->comp.mask];
+		port->free[port->freeCount++] = addr - (addr % XSK_FRAME_SIZE);
+	}
+
+	if(count)
+		ring_consume(&port->tx->comp, count);
+}
+
+// Gives free frames to the kernel to receive into, keeping some back for transmits
+static void refill(struct xsk_port *port)
+{
+	uint32_t i = 0;
+	uint32_t count = 0;
+	uint32_t prod = *port->rx->fill.producer;
+	uint64_t *addrs = (uint64_t*)port->rx->fill.desc;
+
+	if(port->freeCount <= XSK_TX_RESERVE)
+		return;
+
+	count = port->freeCount - XSK_TX_RESERVE;
+	if(count > ring_producible(&port->rx->fill))
+		count = ring_producible(&port->rx->fill);
+
+	for(i = 0; i < count; i++)
+		addrs[(prod + i) & port->rx->fill.mask] = port->free[--port->freeCount];
+
+	if(count)
+		ring_produce(&port->rx->fill, count);
+}
+
+int init_xsk_port(struct xsk_port *port, struct xsk_socket *rx, struct xsk_socket *tx,
+				  const char *txName, unsigned int firstFrame, unsigned int frameCount)
+{
+	int ret;
+	unsigned int i = 0;
+
+	memset(port, 0, sizeof(struct xsk_port));
+	port->rx = rx;
+	port->tx = tx;
+	port->frameCount = frameCount;
+
+	port->free = (uint64_t*)calloc(frameCount, sizeof(uint64_t));
+	if(port->free == NULL)
+	{
+		arglog(LOG_DEBUG, "Unable to allocate XDP frame list\n");
+		return -ENOMEM;
+	}
+
+	for(i = 0; i < frameCount; i++)
+		port->free[port->freeCount++] = (uint64_t)(firstFrame + i) * XSK_FRAME_SIZE;
+
+	if((ret = init_neighbor_cache(&port->neigh, txName)) < 0)
+	{
+		uninit_xsk_port(port);
+		return ret;
+	}
+
+	refill(port);
+
+	return 0;
+}
+
+void uninit_xsk_port(struct xsk_port *port)
+{
+	uninit_neighbor_cache(&port->neigh);
+
+	if(port->free != NULL)
+	{
+		free(port->free);
+		port->free = NULL;
+	}
+}
+
+int xsk_dispatch(struct xsk_port *port, xsk_handler handler, void *arg)
+{
+	uint32_t i = 0;
+	uint32_t count = 0;
+	uint32_t cons = 0;
+	struct xdp_desc *descs = (struct xdp_desc*)port->rx->rx.desc;
+	struct timespec tstamp;
+
+	reap_completions(port);
+	refill(port);
+
+	count = ring_consumable(&port->rx->rx);
+	if(count == 0)
+	{
+		// Kernel may need a kick to start using what we put in the fill ring.
+		// Waiting on the fd does this too, but busy pollers never wait
+		if(*port->rx->fill.flags & XDP_RING_NEED_WAKEUP)
+			recvfrom(port->rx->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+		return 0;
+	}
+
+	if(count > XSK_BATCH_SIZE)
+		count = XSK_BATCH_SIZE;
+
+	// XDP gives us no timestamps, so the whole batch shares one
+	clock_gettime(CLOCK_REALTIME, &tstamp);
+
+	cons = *port->rx->rx.consumer;
+	for(i = 0; i < count; i++)
+	{
+		struct xdp_desc *desc = &descs[(cons + i) & port->rx->rx.mask];
+
+		port->currAddr = desc->addr;
+		port->currTaken = false;
+
+		(*handler)(arg, port->rx->umem->area + desc->addr, desc->len, &tstamp);
+
+		// Frame goes back in the pool unless it was transmitted directly
+		if(!port->currTaken)
+			port->free[port->freeCount++] = desc->addr - (desc->addr % XSK_FRAME_SIZE);
+	}
+
+	ring_consume(&port->rx->rx, count);
+
+	xsk_flush(port);
+
+	return count;
+}
+
+int xsk_send(struct xsk_port *port, const struct packet_data *packet)
+{
+	uint8_t *area = port->tx->umem->area;
+	uint8_t *frame = NULL;
+	struct ethhdr *eth = NULL;
+	struct iphdr *iph = NULL;
+	struct xdp_desc *desc = NULL;
+	uint64_t addr;
+	uint64_t currFrame = port->currAddr - (port->currAddr % XSK_FRAME_SIZE);
+	uint8_t mac[ETH_ALEN];
+	unsigned long ipLen;
+
+	if(!packet_ipv4(packet))
+		return 1;
+
+	ipLen = ntohs(packet_ipv4(packet)->tot_len);
+	if(ipLen + LINK_LAYER_SIZE > XSK_FRAME_SIZE || ipLen + packet->linkLayerLen > packet->len)
+		return 1;
+
+	if(neighbor_lookup(&port->neigh, (uint8_t*)&packet_ipv4(packet)->daddr, mac) < 0)
+		return 1;
+
+	if(ring_producible(&port->tx->tx) == 0)
+	{
+		xsk_flush(port);
+		reap_completions(port);
+		if(ring_producible(&port->tx->tx) == 0)
+			return 1;
+	}
+
+	if(!port->currTaken
+		&& packet->linkLayerLen == LINK_LAYER_SIZE
+		&& packet->data >= area + currFrame
+		&& packet->data + packet->len <= area + currFrame + XSK_FRAME_SIZE)
+	{
+		// Rewritten in place in the frame we received it in. Just turn it around
+		addr = packet->data - area;
+		frame = packet->data;
+		port->currTaken = true;
+	}
+	else
+	{
+		if(port->freeCount == 0)
+			reap_completions(port);
+		if(port->freeCount == 0)
+			return 1;
+
+		addr = port->free[--port->freeCount];
+		frame = area + addr;
+		memcpy(frame + LINK_LAYER_SIZE, packet->data + packet->linkLayerLen, ipLen);
+	}
+
+	eth = (struct ethhdr*)frame;
+	memcpy(eth->h_dest, mac, ETH_ALEN);
+	memcpy(eth->h_source, port->tx->hwaddr, ETH_ALEN);
+	eth->h_proto = htons(ETH_P_IP);
+
+	// The kernel no longer fills in the IP checksum for us
+	iph = (struct iphdr*)(frame + LINK_LAYER_SIZE);
+	ip_csum(iph);
+
+	desc = &((struct xdp_desc*)port->tx->tx.desc)[*port->tx->tx.producer & port->tx->tx.mask];
+	desc->addr = addr;
+	desc->len = ipLen + LINK_LAYER_SIZE;
+	desc->options = 0;
+	ring_produce(&port->tx->tx, 1);
+
+	port->txPending++;
+
+	return 0;
+}
+
+void xsk_flush(struct xsk_port *port)
+{
+	if(port->txPending == 0)
+		return;
+
+	// Generic mode always needs the kick, native only when the driver asks
+	if(!port->tx->dev->native || (*port->tx->tx.flags & XDP_RING_NEED_WAKEUP))
+		sendto(port->tx->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+
+	port->txPending = 0;
+}
+
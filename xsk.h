@@ -0,0 +1,136 @@
+#ifndef XSK_H
+#define XSK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include <netinet/if_ether.h>
+
+#include "settings.h"
+#include "packet.h"
+#include "neighbor.h"
+
+// Size of each frame in the umem and entries in each of the rings
+#define XSK_FRAME_SIZE 4096
+#define XSK_RING_SIZE 2048
+
+// Frames each port keeps back from the fill ring for copying
+// outbound packets into
+#define XSK_TX_RESERVE 256
+
+// Most descriptors pulled off the RX ring at once
+#define XSK_BATCH_SIZE 64
+
+// One side of a ring shared with the kernel
+typedef struct xsk_ring {
+	uint32_t *producer;
+	uint32_t *consumer;
+	uint32_t *flags;
+	void *desc;
+
+	uint32_t size;
+	uint32_t mask;
+
+	void *map;
+	size_t mapLen;
+} xsk_ring;
+
+// Memory shared by every socket. Frames are referred to by their offset into area
+typedef struct xsk_umem {
+	uint8_t *area;
+	size_t len;
+	unsigned int frameCount;
+
+	// Socket the umem was registered on. All others share it
+	int fd;
+} xsk_umem;
+
+// XDP program and socket map attached to an interface
+typedef struct xsk_device {
+	int ifindex;
+	int progFd;
+	int mapFd;
+	int linkFd;
+
+	bool native;
+	bool zeroCopy;
+} xsk_device;
+
+// Socket bound to a single queue of a device
+typedef struct xsk_socket {
+	int fd;
+	unsigned int queue;
+
+	struct xsk_device *dev;
+	struct xsk_umem *umem;
+
+	struct xsk_ring rx;
+	struct xsk_ring tx;
+	struct xsk_ring fill;
+	struct xsk_ring comp;
+
+	uint8_t hwaddr[ETH_ALEN];
+} xsk_socket;
+
+// A receive thread's view of AF_XDP: the socket it receives on and the socket
+// it forwards out of. Frames move from the fill ring to RX, through the handler,
+// out TX and back via the completion ring without ever leaving the umem.
+// Only the owning thread may touch a port
+typedef struct xsk_port {
+	struct xsk_socket *rx;
+	struct xsk_socket *tx;
+
+	// Frames belonging to this port that are not in any ring
+	uint64_t *free;
+	unsigned int freeCount;
+	unsigned int frameCount;
+
+	// Frame currently being handled and whether it was sent on as-is
+	uint64_t currAddr;
+	bool currTaken;
+
+	unsigned int txPending;
+
+	struct neighbor_cache neigh;
+} xsk_port;
+
+// Called for each received frame. See tpacket_handler
+typedef void (*xsk_handler)(void *arg, uint8_t *frame, unsigned long len, const struct timespec *tstamp);
+
+// Creates the umem backing every socket
+int init_xsk_umem(struct xsk_umem *umem, unsigned int frameCount);
+void uninit_xsk_umem(struct xsk_umem *umem);
+
+// Loads and attaches the redirect program to dev. Native (driver) mode is used if
+// allowed and supported, otherwise generic (SKB) mode
+int init_xsk_device(struct xsk_device *dev, const char *name, unsigned int queues, int mode);
+void uninit_xsk_device(struct xsk_device *dev);
+
+// Opens a socket on the given queue of dev using umem
+int init_xsk_socket(struct xsk_socket *sock, struct xsk_device *dev, const char *name,
+					unsigned int queue, struct xsk_umem *umem);
+void uninit_xsk_socket(struct xsk_socket *sock);
+
+// Hands frames [firstFrame, firstFrame + frameCount) to the port and primes
+// its fill ring. tx is the socket packets received on rx leave through
+int init_xsk_port(struct xsk_port *port, struct xsk_socket *rx, struct xsk_socket *tx,
+				  const char *txName, unsigned int firstFrame, unsigned int frameCount);
+void uninit_xsk_port(struct xsk_port *port);
+
+// Passes each frame waiting on the port's RX ring to handler. Never blocks;
+// wait for the RX socket to be readable when this returns 0.
+// Returns the number of frames handled, or negative on error
+int xsk_dispatch(struct xsk_port *port, xsk_handler handler, void *arg);
+
+// Transmits an IPv4 packet out the port's TX socket. If the packet still lives
+// in the frame currently being handled it is sent from there, otherwise it is
+// copied into a free frame. Returns 0 if sent, negative on error, and positive
+// if the packet could not be handled here and should be sent normally
+int xsk_send(struct xsk_port *port, const struct packet_data *packet);
+
+// Tells the kernel about any pending transmits
+void xsk_flush(struct xsk_port *port);
+
+#endif
+